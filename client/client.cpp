@@ -1,87 +1,429 @@
+#include "histogram.hpp"
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <iostream>
-#include <sys/select.h>
-#include <sys/types.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* ** Load generator **
+ *  Opens many connections to an echo endpoint, spread over worker threads, and sends at a
+ *  fixed total rate, open loop: every message has a due time on a schedule and goes out then,
+ *  whether or not earlier ones have come back. Latency runs from the due time until the last
+ *  byte of the echo is read, so a server that stalls is charged for every message it held up
+ *  and not only for the one in flight (no coordinated omission). Messages still unanswered at
+ *  the end are recorded with the time they waited until then.
+ *
+ *  Connections echo in order, replies are matched to messages by counting bytes, so the
+ *  payload is plain filler and the tool works against any echo: funny_echo_server as the
+ *  reference ceiling, funny_echo for funny_cpp with an in-process controller.
+ *
+ *  usage: funny_loadgen [-c connections] [-t threads] [-r rate] [-d seconds] [-w warmup]
+ *                       [-s sizes] [-o file.hgrm] [host:]port
+ *  sizes: fixed:N, uniform:MIN-MAX or exp:MEAN, capped at 65536 bytes
+ */
+
 #define PORT 8080
 
-bool inputAvailable () {
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    fd_set readfds; 
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-    select(STDIN_FILENO+1, &readfds, NULL, NULL, &tv);
-    return FD_ISSET(STDIN_FILENO, &readfds);
+static const size_t MAX_SIZE = 65536;
+
+struct Sizes
+{
+    enum
+    {
+        FIXED,
+        UNIFORM,
+        EXP
+    } kind = FIXED;
+    double a = 64, b = 64;
+
+    size_t next(std::mt19937_64 &rng) const
+    {
+        double size = a;
+        if (kind == UNIFORM)
+            size = std::uniform_real_distribution<double>(a, b + 1)(rng);
+        else if (kind == EXP)
+            size = std::exponential_distribution<double>(1 / a)(rng);
+        return std::clamp<size_t>((size_t)size, 1, MAX_SIZE);
+    }
+};
+
+static struct sockaddr_in target;
+static int connections = 100, threads = 4;
+static double rate = 10000, duration = 10, warmup = 1;
+static Sizes sizes;
+static const char *hgrmPath = nullptr;
+static char filler[MAX_SIZE];
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct Message
+{
+    uint64_t due;
+    size_t left;
+};
+
+struct Conn
+{
+    int fd = -1;
+    std::deque<Message> inflight;
+    // Filler bytes due but not taken by the socket yet
+    size_t unsent = 0;
+    bool waiting = false;
+};
+
+struct Result
+{
+    Histogram latency;
+    uint64_t sent = 0, received = 0, dropped = 0, errors = 0, connectFailed = 0, outstanding = 0;
+};
+
+static std::mutex resultLock;
+static Result total;
+
+class Worker
+{
+public:
+    Worker(int index, int count) : index(index), rng(index * 7919 + now_ns())
+    {
+        conns.resize(count);
+    }
+
+    void run(uint64_t start)
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        add(timerFd, EPOLLIN, -1);
+        for (size_t i = 0; i < conns.size(); i++)
+            open(i);
+
+        // This worker's share of the schedule, the workers' messages interleave
+        double period = 1e9 * threads / rate;
+        double phase = 1e9 * index / rate;
+        uint64_t measureFrom = start + warmup * 1e9, stopAt = start + (warmup + duration) * 1e9;
+        uint64_t k = 0, due = start + phase;
+        struct epoll_event events[256];
+        while (true)
+        {
+            uint64_t now = now_ns();
+            for (; due <= now && due < stopAt; due = start + phase + ++k * period)
+                send(conns[k % conns.size()], due);
+            if (due >= stopAt && (now >= stopAt + 1000000000ull || inflight() == 0))
+                break;
+            arm(due < stopAt ? due : now + 10000000);
+            int n = epoll_wait(epollFd, events, 256, -1);
+            for (int i = 0; i < n; i++)
+            {
+                int c = events[i].data.u32;
+                if (c < 0)
+                {
+                    uint64_t expirations;
+                    while (read(timerFd, &expirations, sizeof(expirations)) > 0)
+                        ;
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    flush(conns[c]);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    receive(conns[c], measureFrom);
+            }
+        }
+
+        // Unanswered messages count with what they waited so far, a lower bound, instead of
+        // vanishing from the latencies of a server that stalled at the end
+        uint64_t now = now_ns();
+        for (Conn &conn : conns)
+            for (Message &message : conn.inflight)
+                if (message.due >= measureFrom)
+                    result.latency.record(now - message.due);
+        result.outstanding = inflight();
+        for (Conn &conn : conns)
+            if (conn.fd >= 0)
+                close(conn.fd);
+        close(timerFd);
+        close(epollFd);
+        std::lock_guard<std::mutex> lock(resultLock);
+        total.latency.add(result.latency);
+        total.sent += result.sent;
+        total.received += result.received;
+        total.dropped += result.dropped;
+        total.errors += result.errors;
+        total.connectFailed += result.connectFailed;
+        total.outstanding += result.outstanding;
+    }
+
+private:
+    int index;
+    int epollFd = -1, timerFd = -1;
+    std::vector<Conn> conns;
+    std::mt19937_64 rng;
+    Result result;
+    char buf[MAX_SIZE];
+
+    void add(int fd, uint32_t events, int c)
+    {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.u32 = c;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void arm(uint64_t at)
+    {
+        struct itimerspec spec = {};
+        spec.it_value.tv_sec = at / 1000000000ull;
+        spec.it_value.tv_nsec = at % 1000000000ull;
+        timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+    }
+
+    size_t inflight() const
+    {
+        size_t n = 0;
+        for (const Conn &conn : conns)
+            n += conn.inflight.size();
+        return n;
+    }
+
+    void open(size_t c)
+    {
+        Conn &conn = conns[c];
+        conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (conn.fd < 0 || connect(conn.fd, (struct sockaddr *)&target, sizeof(target)) < 0)
+        {
+            if (conn.fd >= 0)
+                close(conn.fd);
+            conn.fd = -1;
+            result.connectFailed++;
+            return;
+        }
+        int yes = 1;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK);
+        add(conn.fd, EPOLLIN, c);
+    }
+
+    void fail(Conn &conn)
+    {
+        result.errors += conn.inflight.size();
+        conn.inflight.clear();
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        close(conn.fd);
+        conn.fd = -1;
+    }
+
+    void send(Conn &conn, uint64_t due)
+    {
+        if (conn.fd < 0)
+        {
+            result.dropped++;
+            return;
+        }
+        size_t size = sizes.next(rng);
+        conn.inflight.push_back({due, size});
+        conn.unsent += size;
+        result.sent++;
+        if (!conn.waiting)
+            flush(conn);
+    }
+
+    void flush(Conn &conn)
+    {
+        while (conn.fd >= 0 && conn.unsent > 0)
+        {
+            ssize_t m = ::send(conn.fd, filler, std::min(conn.unsent, MAX_SIZE), MSG_NOSIGNAL);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (m <= 0)
+                return fail(conn);
+            conn.unsent -= m;
+        }
+        bool waiting = conn.unsent > 0;
+        if (waiting != conn.waiting)
+        {
+            struct epoll_event ev;
+            ev.events = waiting ? EPOLLIN | EPOLLOUT : (uint32_t)EPOLLIN;
+            ev.data.u32 = &conn - conns.data();
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+            conn.waiting = waiting;
+        }
+    }
+
+    void receive(Conn &conn, uint64_t measureFrom)
+    {
+        while (conn.fd >= 0)
+        {
+            ssize_t m = recv(conn.fd, buf, sizeof(buf), 0);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (m <= 0)
+                return fail(conn);
+            uint64_t now = now_ns();
+            size_t n = m;
+            while (n > 0 && !conn.inflight.empty())
+            {
+                Message &message = conn.inflight.front();
+                size_t k = std::min(n, message.left);
+                message.left -= k;
+                n -= k;
+                if (message.left)
+                    break;
+                if (message.due >= measureFrom)
+                    result.latency.record(now - message.due);
+                result.received++;
+                conn.inflight.pop_front();
+            }
+        }
+    }
+};
+
+static bool parse_sizes(const char *text)
+{
+    if (sscanf(text, "fixed:%lf", &sizes.a) == 1)
+        sizes.kind = Sizes::FIXED;
+    else if (sscanf(text, "uniform:%lf-%lf", &sizes.a, &sizes.b) == 2 && sizes.a <= sizes.b)
+        sizes.kind = Sizes::UNIFORM;
+    else if (sscanf(text, "exp:%lf", &sizes.a) == 1 && sizes.a > 0)
+        sizes.kind = Sizes::EXP;
+    else
+        return false;
+    return true;
 }
 
+static bool parse_target(const char *text)
+{
+    std::string host = "127.0.0.1", port = text;
+    if (const char *colon = strrchr(text, ':'))
+    {
+        host.assign(text, colon - text);
+        port = colon + 1;
+    }
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return false;
+    memcpy(&target, res->ai_addr, sizeof(target));
+    freeaddrinfo(res);
+    return true;
+}
 
-int main(int argc, char const *argv[])
+int main(int argc, char **argv)
 {
-    int status, valread, client_fd;
-    struct sockaddr_in serv_addr;
-    char* hello = "Hello from client";
-    int recv_buf_size = 1024;
-    char* recv_buf = (char*) malloc(recv_buf_size);
-    if ((client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        printf("\n Socket creation error \n");
-        return -1;
-    }
-    
-
-    fcntl(client_fd, F_SETFL, O_NONBLOCK);
-
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-
-    // Convert IPv4 and IPv6 addresses from text to binary
-    // form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0)
-    {
-        printf(
-            "\nInvalid address/ Address not supported \n");
-        return -1;
-    }
-
-    if ((status = connect(client_fd, (struct sockaddr *)&serv_addr,
-                          sizeof(serv_addr))) < 0)
-    {
-        printf("\nConnection Failed \n");
-        return -1;
-    }
-    
-    send(client_fd, hello, strlen(hello), 0);
-    printf("Hello message sent\n");
-    valread = read(client_fd, recv_buf, recv_buf_size);
-    printf("%s\n", recv_buf);
-
-    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
-    int read_buf_size = 1024;
-    char* read_buf = (char*) malloc(read_buf_size);
-
-    int sent;
-    
-    while (true) {
-        if (!inputAvailable()) {
-            //valread = read(client_fd, recv_buf, read_buf_size);
-            //printf("recv: %s\n", recv_buf);
-            std::cout << "no input" << std::endl;
-            sleep(500000);
-        } else {
-            int n = read(STDIN_FILENO, read_buf, read_buf_size);
-            printf("read: %s\n", read_buf);
-            sent = send(client_fd, read_buf, n, 0);
+    target.sin_family = AF_INET;
+    target.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &target.sin_addr);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:r:d:w:s:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 's':
+            if (!parse_sizes(optarg))
+            {
+                fprintf(stderr, "-s expects fixed:N, uniform:MIN-MAX or exp:MEAN\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            hgrmPath = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c connections] [-t threads] [-r rate] [-d seconds] [-w warmup] [-s sizes] [-o file.hgrm] [host:]port\n", argv[0]);
+            return 1;
         }
-        
     }
-    
-    // closing the connected socket
-    close(client_fd);
-    return 0;
-}
\ No newline at end of file
+    if (optind < argc && !parse_target(argv[optind]))
+    {
+        fprintf(stderr, "Can't resolve %s\n", argv[optind]);
+        return 1;
+    }
+    threads = std::max(1, std::min(threads, connections));
+    if (connections < 1 || rate <= 0 || duration <= 0)
+    {
+        fprintf(stderr, "connections, rate and duration must be positive\n");
+        return 1;
+    }
+
+    // Thousands of sockets need more than the default 1024 descriptors
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    memset(filler, 'x', sizeof(filler));
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::make_unique<Worker>(i, connections / threads + (i < connections % threads)));
+    // Connecting takes a while with many connections, the schedule starts after it
+    uint64_t start = now_ns() + 200000000ull + connections * 100000ull;
+    std::vector<std::thread> running;
+    for (auto &worker : workers)
+        running.emplace_back([&worker, start]
+                             { worker->run(start); });
+    for (std::thread &thread : running)
+        thread.join();
+
+    Histogram &h = total.latency;
+    printf("%d connections (%lu failed), %d threads, %.0f msg/s for %.1f s after %.1f s warmup\n",
+           connections, (unsigned long)total.connectFailed, threads, rate, duration, warmup);
+    printf("sent %lu  received %lu  dropped %lu  errors %lu  outstanding %lu\n", (unsigned long)total.sent,
+           (unsigned long)total.received, (unsigned long)total.dropped, (unsigned long)total.errors, (unsigned long)total.outstanding);
+    printf("latency us  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+           h.mean() / 1000, h.percentile(50) / 1000.0, h.percentile(90) / 1000.0, h.percentile(99) / 1000.0,
+           h.percentile(99.9) / 1000.0, h.percentile(99.99) / 1000.0, h.max() / 1000.0);
+    if (hgrmPath)
+    {
+        FILE *file = fopen(hgrmPath, "w");
+        if (!file)
+        {
+            perror("fopen");
+            return 1;
+        }
+        h.print(file, 1000.0);
+        fclose(file);
+    }
+    return total.errors || total.connectFailed ? 2 : 0;
+}
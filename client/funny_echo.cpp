@@ -0,0 +1,28 @@
+#include "funny.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* ** funny_cpp echo **
+ *  The daemon's core with an in-process controller that accepts every peer and sends each
+ *  message straight back, the funny_cpp side of a funny_loadgen run.
+ *
+ *  usage: funny_echo [port]
+ */
+
+#define PORT 8080
+
+class Echo : public funny::Controller
+{
+public:
+    void on_request_connect(funny::Conn conn) override { funny::accept(conn); }
+    void on_message(funny::Conn conn, std::span<const char> message) override { funny::send(conn, message); }
+};
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : PORT;
+    Echo echo;
+    printf("Echoing through funny_cpp on port %d\n", port);
+    fflush(stdout);
+    return funny::serve(port, echo);
+}
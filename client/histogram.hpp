@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+/* ** Latency histogram **
+ *  HDR style: values below 256 have a bucket each, above that every power of two is split
+ *  into 128 buckets, so any value is kept within 1% over the whole uint64_t range in ~60 KB.
+ *  Recording is an index computation and an increment. One histogram per thread, add()
+ *  merges them at the end.
+ */
+class Histogram
+{
+public:
+    static const int HALF = 128;
+    static const int LINEAR = 2 * HALF;
+    static const size_t BUCKETS = LINEAR + 56 * HALF;
+
+    Histogram() : counts(BUCKETS) {}
+
+    void record(uint64_t value)
+    {
+        counts[index(value)]++;
+        total++;
+        sum += value;
+        maxValue = std::max(maxValue, value);
+    }
+
+    void add(const Histogram &other)
+    {
+        for (size_t i = 0; i < BUCKETS; i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? (double)sum / total : 0; }
+
+    // The highest value equivalent to the one at percentile (0..100)
+    uint64_t percentile(double p) const
+    {
+        if (!total)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100 * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min(highest(i), maxValue);
+        }
+        return maxValue;
+    }
+
+    // The percentile distribution in the .hgrm text format, values divided by scale
+    void print(FILE *file, double scale) const
+    {
+        fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS && seen < total; i++)
+        {
+            if (!counts[i])
+                continue;
+            seen += counts[i];
+            double fraction = (double)seen / total;
+            if (fraction < 1)
+                fprintf(file, "%12.3f %14.12f %10lu %14.2f\n", std::min(highest(i), maxValue) / scale, fraction, (unsigned long)seen, 1 / (1 - fraction));
+            else
+                fprintf(file, "%12.3f %14.12f %10lu\n", maxValue / scale, fraction, (unsigned long)seen);
+        }
+        fprintf(file, "#[Mean = %.3f, Max = %.3f, Total count = %lu]\n", mean() / scale, maxValue / scale, (unsigned long)total);
+    }
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0, sum = 0, maxValue = 0;
+
+    static size_t index(uint64_t value)
+    {
+        if (value < LINEAR)
+            return value;
+        int shift = 63 - __builtin_clzll(value) - 7;
+        return LINEAR + (shift - 1) * HALF + ((value >> shift) - HALF);
+    }
+
+    static uint64_t highest(size_t i)
+    {
+        if (i < LINEAR)
+            return i;
+        int shift = (i - LINEAR) / HALF + 1;
+        uint64_t top = (i - LINEAR) % HALF + HALF;
+        return ((top + 1) << shift) - 1;
+    }
+};
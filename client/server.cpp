@@ -1,157 +1,199 @@
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
-#include <sys/time.h>
-#include <errno.h>
+#include <thread>
+#include <vector>
+#include "poller.hpp"
+
+/* ** Echo server **
+ *  The reference ceiling for funny_loadgen: every thread has its own SO_REUSEPORT listener and
+ *  epoll set, the kernel spreads connections over them and nothing is shared. Bytes are sent
+ *  back as they arrive. A connection whose peer doesn't read stops being read until what is
+ *  pending went out, so memory stays bounded by one buffer per connection.
+ *  With -b threads busy-poll for spin_us before blocking, as the daemon does with --busy-poll,
+ *  and with -c thread i is pinned to core first_cpu + i.
+ *
+ *  usage: funny_echo_server [-t threads] [-b spin_us] [-c first_cpu] [port]
+ */
 
 #define PORT 8080
 
-int main(int argc, char const *argv[])
-{
-    int listen_sd, new_sd, max_sd;
-    int i, len, rc, opt = 1;
-    int desc_ready, end_server = false; 
-    int close_conn; 
+static const size_t BUFFER = 65536;
 
-    int recv_buf_size = 1024;
-    char* recv_buf = (char*) malloc(recv_buf_size);
+struct Conn
+{
+    int fd;
+    std::vector<char> pending;
+    size_t done = 0;
+};
 
+static int listen_on(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
     struct sockaddr_in addr;
-    fd_set master_set, working_set; 
-    timeval timeout; 
- 
-    char *hello = "Hello from server";
-
-    // Creating socket file descriptor
-    if ((listen_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Forcefully attaching socket to the port 8080
-    if (setsockopt(listen_sd, SOL_SOCKET,
-                   SO_REUSEADDR | SO_REUSEPORT, &opt,
-                   sizeof(opt)))
-    {
-        perror("setsockopt failed");
-        close(listen_sd);
-        exit(EXIT_FAILURE);
-    }
-    // int addrlen = sizeof(address);
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
-
-    // Forcefully attaching socket to the port 8080
-    if (bind(listen_sd, (struct sockaddr *)&addr,
-             sizeof(addr)) < 0)
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0)
     {
-        perror("bind failed");
-        close(listen_sd);
-        exit(EXIT_FAILURE);
-    }
-    if (listen(listen_sd, 32) < 0)
-    {
-        perror("listen failed");
-        close(listen_sd);
+        perror("bind/listen");
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
 
-    FD_ZERO(&master_set);
-    max_sd = listen_sd;
-    FD_SET(listen_sd, &master_set);
+static void set_events(int epollFd, Conn *conn, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
 
-    timeout.tv_sec = 3 * 60;
-    timeout.tv_usec = 0; 
+static void drop(Conn *conn)
+{
+    close(conn->fd);
+    delete conn;
+}
 
-    while (end_server == false) {
-        memcpy(&working_set, &master_set, sizeof(master_set));
+// False once the connection is gone
+static bool flush(int epollFd, Conn *conn)
+{
+    while (conn->done < conn->pending.size())
+    {
+        ssize_t m = send(conn->fd, conn->pending.data() + conn->done, conn->pending.size() - conn->done, MSG_NOSIGNAL);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (m <= 0)
+            return false;
+        conn->done += m;
+    }
+    conn->pending.clear();
+    conn->done = 0;
+    set_events(epollFd, conn, EPOLLIN);
+    return true;
+}
 
-        printf("Waiting on select()...\n");
+static bool echo(int epollFd, Conn *conn, char *buf)
+{
+    while (true)
+    {
+        ssize_t n = recv(conn->fd, buf, BUFFER, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n <= 0)
+            return false;
+        ssize_t m = send(conn->fd, buf, n, MSG_NOSIGNAL);
+        if (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if (m < n)
+        { // The peer isn't reading, hold the rest and stop reading until it went out
+            m = m < 0 ? 0 : m;
+            conn->pending.assign(buf + m, buf + n);
+            set_events(epollFd, conn, EPOLLOUT);
+            return true;
+        }
+    }
+}
 
-        rc = select(max_sd+1, &working_set, NULL, NULL, &timeout);
+static void serve(int port, Api::Poller poller)
+{
+    poller.start();
+    int listenFd = listen_on(port);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+    std::vector<char> buf(BUFFER);
+    struct epoll_event events[256];
+    while (true)
+    {
+        int n = poller.wait(epollFd, events, 256, -1);
+        for (int i = 0; i < n; i++)
+        {
+            Conn *conn = (Conn *)events[i].data.ptr;
+            if (!conn)
+            {
+                int fd;
+                while ((fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    int yes = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    poller.tune_socket(fd);
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = new Conn{fd, {}, 0};
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+            bool alive = true;
+            if (events[i].events & (EPOLLOUT | EPOLLERR))
+                alive = flush(epollFd, conn);
+            if (alive && conn->pending.empty() && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                alive = echo(epollFd, conn, buf.data());
+            if (!alive)
+                drop(conn);
+        }
+    }
+}
 
-        if (rc < 0) {
-            perror("  select() failed");
+int main(int argc, char **argv)
+{
+    int threads = std::thread::hardware_concurrency(), firstCpu = -1, opt;
+    uint32_t spinUs = 0;
+    while ((opt = getopt(argc, argv, "t:b:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
             break;
-        } 
-        if (rc == 0) {
-            printf("  select() timed out.  End program.\n");
+        case 'b':
+            spinUs = strtoul(optarg, NULL, 10);
             break;
+        case 'c':
+            firstCpu = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-b spin_us] [-c first_cpu] [port]\n", argv[0]);
+            return 1;
         }
-
-        desc_ready = rc; 
-        for (i=0; i<=max_sd && desc_ready > 0; i++) {
-            if (FD_ISSET(i , &working_set)) {
-                desc_ready -= 1;
-                if (i == listen_sd) {
-                    printf("  Listening socket is readable\n");
-                    while (new_sd != -1) {
-                        new_sd = accept(listen_sd, NULL, NULL);
-                        if (new_sd < 0) {
-                            if (errno != EWOULDBLOCK) {
-                                perror(" accept() failed");
-                                end_server = true;
-                            }
-                            break;
-                        }
-
-                        printf("  New incoming connection - %d\n", new_sd);
-                        FD_SET(new_sd, &master_set);
-                        if (new_sd > max_sd) 
-                            max_sd = new_sd;
-                    }
-                } else {
-                    printf("  Descriptor %d is readable\n", i);
-                    close_conn = false;
-                    while (true) {
-                        rc = recv(i, recv_buf, recv_buf_size, 0);
-                        if (rc < 0) {
-                            if (errno != EWOULDBLOCK) {
-                                perror("  recv failed");
-                                close_conn = true;
-                            }
-                            break;
-                        }
-                        if (rc == 0) {
-                            printf("  Connection closed\n");
-                            close_conn = true;
-                            break;
-                        }
-
-                        len = rc; 
-                        printf("  %d bytes recv\n", len);
-                        rc = send(i, recv_buf, len, 0);
-                        if (rc < 0) {
-                            perror("  send failed");
-                            close_conn = true; 
-                            break; 
-                        }
-                    }
-                    if (close_conn) {
-                        close(i);
-                        FD_CLR(i, &master_set);
-                        if (i == max_sd) {
-                            while (FD_ISSET(max_sd, &master_set) == false) {
-                                max_sd -= 1;
-                            }
-                        }
-                    }
-                } /* End of connection is readable */
-            } /* End of if (FD_ISSET(i, &working_set))*/
-        } /* End of loop through selectable descriptors */        
     }
+    int port = optind < argc ? atoi(argv[optind]) : PORT;
 
-    // Clean up 
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
-    for (i=0; i<max_sd; i++) {
-        if (FD_ISSET(i, &master_set)) 
-            close(i);
+    printf("Echoing on port %d with %d threads\n", port, threads);
+    std::vector<std::thread> running;
+    for (int i = 0; i < std::max(threads, 1); i++)
+    {
+        Api::Poller poller;
+        poller.busy = spinUs > 0;
+        poller.spinUs = spinUs;
+        poller.cpu = firstCpu < 0 ? -1 : firstCpu + i;
+        running.emplace_back(serve, port, poller);
     }
-}
\ No newline at end of file
+    for (std::thread &thread : running)
+        thread.join();
+}
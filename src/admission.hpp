@@ -0,0 +1,90 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* ** Admission control **
+ *  Every INTERVAL ms the loop samples the load signals, each as a fraction of its limit
+ *     OUTPUT_BACKLOG  bytes queued for the controller, of Output::MAX_DATA_BYTES where every
+ *                     peer is throttled
+ *     SEND_BACKLOG    bytes copied for peers that don't take them, of sendLimit
+ *     PRE_ACCEPT      bytes held for connections waiting for ACCEPT_CONNECT, of preAcceptLimit
+ *  The load is the highest of them and picks the level
+ *     NORMAL
+ *     ELEVATED    peers are read SHRUNK_READ_BUDGET times per wakeup instead of READ_BUDGET,
+ *                 new peers are reset right after accept
+ *     OVERLOADED  accept pauses and the kernel backlog holds new peers, messages from
+ *                 connections weighted below the highest weight in use are dropped. While
+ *                 every connection has the same weight nothing is dropped, shedding starts
+ *                 once the controller raised the weight of the ones that matter.
+ *  A level is entered at ENTER and left below LEAVE, so the daemon doesn't flap around a
+ *  threshold. Every change is reported to the controller with an OVERLOAD frame, and so
+ *  is every SHED_REPORT ms of shedding.
+ *  Loop thread only.
+ */
+namespace Api
+{
+    class Admission
+    {
+    public:
+        enum Level
+        {
+            NORMAL,
+            ELEVATED,
+            OVERLOADED
+        };
+
+        enum Signal
+        {
+            OUTPUT_BACKLOG,
+            SEND_BACKLOG,
+            PRE_ACCEPT,
+            SIGNALS
+        };
+
+        static const int INTERVAL = 50;
+        static const int READ_BUDGET = 16;
+        static const int SHRUNK_READ_BUDGET = 2;
+        static const int SHED_REPORT = 1000;
+        static constexpr double ENTER[] = {0, 0.75, 0.9};
+        static constexpr double LEAVE[] = {0, 0.5, 0.7};
+
+        size_t sendLimit = 64 << 20;
+        size_t preAcceptLimit = 16 << 20;
+
+        Level level = NORMAL;
+        Signal cause = OUTPUT_BACKLOG;
+        double load = 0;
+        // Messages dropped since the last report
+        uint32_t shed = 0;
+        uint64_t reportedAt = 0;
+        // Highest output weight of a local connection, as of the last sample
+        int topWeight = 1;
+
+        // True if the level changed
+        bool update(const double (&signals)[SIGNALS])
+        {
+            load = 0;
+            for (int i = 0; i < SIGNALS; i++)
+                if (signals[i] > load)
+                {
+                    load = signals[i];
+                    cause = (Signal)i;
+                }
+            Level next = level;
+            while (next < OVERLOADED && load >= ENTER[next + 1])
+                next = (Level)(next + 1);
+            while (next > NORMAL && load < LEAVE[next])
+                next = (Level)(next - 1);
+            if (next == level)
+                return false;
+            level = next;
+            return true;
+        }
+
+        int read_budget() const { return level == NORMAL ? READ_BUDGET : SHRUNK_READ_BUDGET; }
+        bool rejecting() const { return level >= ELEVATED; }
+        bool accept_paused() const { return level == OVERLOADED; }
+        bool sheds(int weight) const { return level == OVERLOADED && weight < topWeight; }
+        bool report_due(uint64_t now) const { return shed && now - reportedAt >= SHED_REPORT; }
+    };
+}
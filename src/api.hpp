@@ -1,9 +1,22 @@
-#include "tcpsocket.hpp"
+#pragma once
+#include "output.hpp"
+#include "capture.hpp"
+#include "funny.hpp"
+#include "stats.hpp"
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <fmt/core.h>
 #include <assert.h>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <vector>
 
 /* ** API specification **
  *  The magic byte(s) encode
@@ -17,6 +30,60 @@
  *
  *  A message is all the bytes following the ML. It has to be encodable by the MLENGTH.
  *  For example if MLENGTH is unsigned short, then the MAX_MESSAGE_LENGTH is 65535.
+ *
+ *  DISCONNECT sent by the daemon carries the connection number in the low byte of the ML
+ *  and a DisconnectReason in the high byte.
+ *
+ *  CONNECT_MANY dials many peers in one frame, its message is a sequence of
+ *  [u8 host length][host][u16 port] entries. Every dial, from CONNECT or CONNECT_MANY,
+ *  answers with CREATE_CONNECT or with CONNECT_FAILED whose message is
+ *  [u8 DisconnectReason]["host:port"].
+ *
+ *  SET_FRAMING switches how a connection's byte stream is split into messages,
+ *  its message is [u8 connection][u8 FramingMode][u32 size] (size is used by FIXED).
+ *
+ *  SET_WEIGHT has no message, the ML carries the connection number in the low byte and
+ *  its output scheduling weight in the high byte (0 resets to 1).
+ *
+ *  SUBSCRIBE and UNSUBSCRIBE add and remove a topic pattern of a connection, their message
+ *  is [u8 connection][pattern]. PUBLISH sends a payload to every accepted connection with a
+ *  matching subscription, its message is [u8 topic length][topic][payload]. See topics.hpp.
+ *
+ *  SET_CORK makes a connection gather the messages sent to it and write them at once, its
+ *  message is [u8 connection][u32 bytes][u32 delay us]. They go out when bytes are gathered
+ *  or delay has passed since the first one, delay 0 means at the end of the loop iteration.
+ *  bytes 0 turns it off, which is the default.
+ *
+ *  OVERLOAD is sent by the daemon when its admission level changes, and once a second while
+ *  it drops messages, its message is [u8 Admission::Level][u8 Admission::Signal cause]
+ *  [u8 load percent][u32 messages shed since the last OVERLOAD]. See admission.hpp.
+ *
+ *  SET_COMPRESSION turns LZ compression of a tcp connection on or off, its message is
+ *  [u8 connection][u8 mode], mode 1 on and 0 off. Both directions switch right away. There
+ *  is no negotiation with the peer: both ends have to be set up, the peer switching its own
+ *  codec at the same point of the stream as agreed in the application protocol, otherwise
+ *  the connection breaks on the first block. The codec's counters are in STATS. See
+ *  compress.hpp.
+ *
+ *  STATS is sent by the daemon every --stats-interval ms while connections change, its
+ *  message is [u64 clock ms][StatsRecord]... See stats.hpp.
+ *
+ *  MULTIPLEX is [u8 connection][u8 op]. Op 1 makes a tcp connection a carrier of channels,
+ *  both directions switch right away like with SET_COMPRESSION. Channels the peer opens are
+ *  reported with REQUEST_CONNECT and accepted like connections. Op 2 opens a channel on a
+ *  carrier, reported with CREATE_CONNECT. A channel is sent to, framed and disconnected by
+ *  its own id. See mux.hpp.
+ *
+ *  SESSION turns a resumable session of a tcp connection on or off, its message is
+ *  [u8 connection][u8 mode], mode 1 on and 0 off. Both directions switch right away like with
+ *  SET_COMPRESSION, the daemon's first record carries the token. When the link goes down the
+ *  connection stays, without a DISCONNECT, for --session-linger ms and a peer presenting the
+ *  token on --resume-port continues both streams where they broke off. See session.hpp.
+ *
+ *  SET_PEER names the peer of an inbound connection for --outbox, its message is
+ *  [u8 connection][name]. Messages to it are kept for the name once it closed, and an
+ *  accepted connection with a name that has a backlog gets it first. An empty name keeps
+ *  nothing. Outbound connections are named "host:port" by the daemon. See outbox.hpp.
  */
 namespace Api
 {
@@ -50,81 +117,207 @@ namespace Api
         LOG_INFO = CREATE_CONNECT - 1,
         LOG_ERROR = LOG_INFO - 1,
 
-        MAX_CONNECTIONS = LOG_ERROR - 1
+        CONNECT_MANY = LOG_ERROR - 1,
+        CONNECT_FAILED = CONNECT_MANY - 1,
+        SET_FRAMING = CONNECT_FAILED - 1,
+        SET_WEIGHT = SET_FRAMING - 1,
+        SUBSCRIBE = SET_WEIGHT - 1,
+        UNSUBSCRIBE = SUBSCRIBE - 1,
+        PUBLISH = UNSUBSCRIBE - 1,
+        SET_CORK = PUBLISH - 1,
+        OVERLOAD = SET_CORK - 1,
+        SET_COMPRESSION = OVERLOAD - 1,
+        STATS = SET_COMPRESSION - 1,
+        MULTIPLEX = STATS - 1,
+        SESSION = MULTIPLEX - 1,
+        SET_PEER = SESSION - 1,
+
+        MAX_CONNECTIONS = SET_PEER - 1
     };
+    static_assert(STATS == STATS_MAGIC);
 
-    void buffer_read_all(int fd, char *buf, int len)
+    enum DisconnectReason
     {
-        int m = read(fd, buf, len);
-        int d = len - m;
-        while (d > 0)
+        PEER_CLOSED,
+        CONTROLLER,
+        SOCKET_ERROR,
+        IDLE_TIMEOUT,
+        PRE_ACCEPT_TIMEOUT,
+        CONNECT_TIMEOUT,
+        CONNECT_REFUSED,
+        RESOLVE_FAILED,
+        CONNECTION_LIMIT,
+        FRAMING_ERROR
+    };
+
+    bool buffer_read_all(int fd, char *buf, int len)
+    {
+        while (len > 0)
         {
+            int m = read(fd, buf, len);
+            if (m <= 0)
+            {
+                if (m < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
             buf += m;
-            m = read(fd, buf, d);
-            d -= m;
+            len -= m;
         }
+        return true;
     }
 
-    void buffer_send_socket_all(TCPSocket<> *socket, char *buf, int len)
+    // Sockets are non-blocking, wait for buffer space instead of spinning on EAGAIN
+    bool buffer_send_all(int fd, const char *buf, int len)
     {
-        int m = socket->Send(buf, len);
-        int d = len - m;
-        while (d > 0)
+        while (len > 0)
         {
+            int m = send(fd, buf, len, MSG_NOSIGNAL);
+            if (m < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    struct pollfd pfd = {fd, POLLOUT, 0};
+                    poll(&pfd, 1, -1);
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
             buf += m;
-            m = socket->Send(buf, d);
-            d -= m;
+            len -= m;
         }
+        return true;
+    }
+
+    // Make buffer methods
+    std::vector<char> make_buffer_special(MagicType mag, MessageLengthType mag_as_message_length)
+    {
+        std::vector<char> prefix_buffer(PREFIX_SIZE);
+        memcpy(prefix_buffer.data(), &mag, MAGIC_TYPE_SIZE);
+        memcpy(prefix_buffer.data() + MAGIC_TYPE_SIZE, &mag_as_message_length, MESSAGE_LENGTH_TYPE_SIZE);
+        return prefix_buffer;
+    }
+
+    void append_buffer(std::vector<char> &buf, MagicType mag, const char *message_buffer, MessageLengthType message_length)
+    {
+        size_t at = buf.size();
+        buf.resize(at + PREFIX_SIZE + message_length);
+        memcpy(&buf[at], &mag, MAGIC_TYPE_SIZE);
+        memcpy(&buf[at + MAGIC_TYPE_SIZE], &message_length, MESSAGE_LENGTH_TYPE_SIZE);
+        memcpy(&buf[at + PREFIX_SIZE], message_buffer, message_length);
     }
 
-    int buffer_write_all_len(int fd, char *buf, int len)
+    std::vector<char> make_buffer(MagicType mag, const char *message_buffer, MessageLengthType message_length)
     {
-        int m = write(fd, buf, len);
-        int d = len - m;
-        while (d > 0)
+        std::vector<char> full_message_buffer;
+        append_buffer(full_message_buffer, mag, message_buffer, message_length);
+        return full_message_buffer;
+    }
+
+    Output output;
+    Capture capture;
+    // An in-process controller gets callbacks instead of frames
+    funny::Controller *controller = nullptr;
+
+    // The controller a connection reports to, LOCAL_HOME or the cluster node whose controller claimed it
+    const int LOCAL_HOME = -1;
+    // Carries frames to the controller of another cluster node
+    std::function<int(int home, std::vector<char> buf)> api_forward;
+
+    Lane frame_lane(MagicType mag)
+    {
+        switch (mag)
         {
-            buf += m;
-            m = write(fd, buf, d);
-            d -= m;
+        case Magic::LOG_INFO:
+        case Magic::LOG_ERROR:
+            return LOG_LANE;
+        case Magic::REQUEST_CONNECT:
+        case Magic::CREATE_CONNECT:
+        case Magic::DISCONNECT:
+        case Magic::CONNECT_FAILED:
+            return CONTROL_LANE;
+        default:
+            return mag < MAX_CONNECTIONS ? DATA_LANE : CONTROL_LANE;
         }
-        free(buf);
-        return len;
     }
-    int buffer_write_all(int fd, char *buf) { return buffer_write_all_len(fd, buf, strlen(buf)); }
 
-    // Make buffer methods
-    char *make_buffer_special(MagicType mag, MagicType mag_as_message_length)
+    // Frames from the controller that carry their connection number in the ML and no message
+    bool api_in_special(MagicType mag)
     {
-        char *prefix_buffer = (char *)malloc(PREFIX_SIZE);
-        memcpy(prefix_buffer, &mag, MAGIC_TYPE_SIZE);
-        (*prefix_buffer) += MAGIC_TYPE_SIZE;
-        memcpy(prefix_buffer, &mag_as_message_length, MESSAGE_LENGTH_TYPE_SIZE);
-        return prefix_buffer;
+        return mag == Magic::DISCONNECT || mag == Magic::ACCEPT_CONNECT || mag == Magic::SET_WEIGHT;
     }
 
-    char *make_buffer(MagicType mag, const char *message_buffer, MessageLengthType message_length)
+    // Frames from the daemon that carry their connection number in the ML and no message
+    bool api_out_special(MagicType mag)
     {
-        if (message_length > MAX_MESSAGE_LENGTH)
+        return mag == Magic::REQUEST_CONNECT || mag == Magic::CREATE_CONNECT || mag == Magic::DISCONNECT;
+    }
+
+    // The connection a frame belongs to, for ordering in the output stage
+    int frame_connection(const std::vector<char> &buf)
+    {
+        MagicType mag;
+        memcpy(&mag, buf.data(), MAGIC_TYPE_SIZE);
+        if (mag < MAX_CONNECTIONS)
+            return mag;
+        if (mag == Magic::REQUEST_CONNECT || mag == Magic::CREATE_CONNECT || mag == Magic::DISCONNECT)
+            return (unsigned char)buf[MAGIC_TYPE_SIZE];
+        return Output::NO_CONNECTION;
+    }
+
+    // Queues one or more frames of the same magic for API_OUT_FILENO
+    int api_out(std::vector<char> buf)
+    {
+        int n = buf.size();
+        if (n == 0)
+            return 0;
+        MagicType mag;
+        memcpy(&mag, buf.data(), MAGIC_TYPE_SIZE);
+        int conn = frame_connection(buf);
+        output.push(frame_lane(mag), conn, std::move(buf));
+        return n;
+    }
+
+    // Collects several frames of one connection so they reach API_OUT_FILENO with a single write
+    class FrameBatch
+    {
+    public:
+        void add(MagicType mag, const char *message_buffer, MessageLengthType message_length)
         {
-            std::string text = "[make_buffer] message length is bigger than ";
-            text += std::to_string(MAX_MESSAGE_LENGTH);
-            perror(text.c_str());
-            exit(1);
+            append_buffer(buf, mag, message_buffer, message_length);
         }
-        char *full_message_buffer = (char *)malloc(PREFIX_SIZE + message_length);
-        memcpy(full_message_buffer, &mag, MAGIC_TYPE_SIZE);
-        (*full_message_buffer) += MAGIC_TYPE_SIZE;
-        memcpy(full_message_buffer, &message_length, MESSAGE_LENGTH_TYPE_SIZE);
-        (*full_message_buffer) += MESSAGE_LENGTH_TYPE_SIZE;
-        memcpy(full_message_buffer, message_buffer, message_length);
-        return full_message_buffer;
+
+        int flush()
+        {
+            int n = api_out(std::move(buf));
+            buf = std::vector<char>();
+            return n;
+        }
+
+        size_t size() const { return buf.size(); }
+
+    private:
+        std::vector<char> buf;
+    };
+
+    int api_out_to(int home, std::vector<char> buf)
+    {
+        if (home == LOCAL_HOME)
+            return api_out(std::move(buf));
+        return api_forward(home, std::move(buf));
     }
+
     // Api out calls
     int api_req_connect(MagicType cn)
     { //
-        return buffer_write_all(
-            API_OUT_FILENO,
-            make_buffer_special(Magic::REQUEST_CONNECT, cn));
+        if (controller)
+        {
+            controller->on_request_connect(cn);
+            return 0;
+        }
+        return api_out(make_buffer_special(Magic::REQUEST_CONNECT, cn));
     }
 
     // Log calls
@@ -132,9 +325,13 @@ namespace Api
     inline int log(MagicType log, fmt::format_string<T...> fmt, T &&...args)
     {
         char buf[MAX_MESSAGE_LENGTH];
-        int n = fmt::format_to_n(buf, MAX_MESSAGE_LENGTH, fmt, std::forward<T>(args)...).size;
-        assert(n <= MAX_MESSAGE_LENGTH);
-        return buffer_write_all_len(API_OUT_FILENO, make_buffer(log, buf, n), n);
+        int n = std::min<size_t>(fmt::format_to_n(buf, MAX_MESSAGE_LENGTH, fmt, std::forward<T>(args)...).size, MAX_MESSAGE_LENGTH);
+        if (controller)
+        {
+            controller->on_log(log == LOG_ERROR, {buf, (size_t)n});
+            return n;
+        }
+        return api_out(make_buffer(log, buf, n));
     }
     template <typename... T>
     inline int log_info(fmt::format_string<T...> fmt, T &&...args) { return log(LOG_INFO, fmt, std::forward<T>(args)...); }
@@ -142,10 +339,61 @@ namespace Api
     inline int log_error(fmt::format_string<T...> fmt, T &&...args) { return log(LOG_ERROR, fmt, std::forward<T>(args)...); }
 
     // Api calls
-    inline int api(MagicType connId, const char *message, MessageLengthType length) { return buffer_write_all_len(API_OUT_FILENO, make_buffer(connId, message, length), length + PREFIX_SIZE); }
+    inline int api(MagicType connId, const char *message, MessageLengthType length) { return api_out(make_buffer(connId, message, length)); }
     inline int api_message(MagicType connId, const char *message, MessageLengthType length) { return api(connId, message, length); }
 
-    inline int api_special(MagicType mag, MagicType mag_as_message_length) { return buffer_write_all_len(API_OUT_FILENO, make_buffer_special(mag, mag_as_message_length), PREFIX_SIZE); }
-    inline int api_create_connect(MagicType connId) { return api_special(Magic::CREATE_CONNECT, connId); }
+    inline int api_special(MagicType mag, MessageLengthType mag_as_message_length) { return api_out(make_buffer_special(mag, mag_as_message_length)); }
+    inline int api_create_connect(MagicType connId, int home = LOCAL_HOME)
+    {
+        if (controller)
+        {
+            controller->on_create_connect(connId);
+            return 0;
+        }
+        return api_out_to(home, make_buffer_special(Magic::CREATE_CONNECT, connId));
+    }
+    inline int api_disconnect(MagicType connId, DisconnectReason reason, int home = LOCAL_HOME)
+    {
+        if (controller)
+        {
+            controller->on_disconnect(connId, reason);
+            return 0;
+        }
+        return api_out_to(home, make_buffer_special(Magic::DISCONNECT, connId | reason << 8));
+    }
+    inline int api_connect_failed(DisconnectReason reason, const std::string &host, int port, int home = LOCAL_HOME)
+    {
+        if (controller)
+        {
+            controller->on_connect_failed(reason, host, port);
+            return 0;
+        }
+        char buf[MAX_MESSAGE_LENGTH];
+        buf[0] = reason;
+        int n = 1 + std::min<size_t>(fmt::format_to_n(buf + 1, MAX_MESSAGE_LENGTH - 1, "{}:{}", host, port).size, MAX_MESSAGE_LENGTH - 1);
+        return api_out_to(home, make_buffer(Magic::CONNECT_FAILED, buf, n));
+    }
+    inline int api_overload(int level, int cause, double load, uint32_t shed)
+    {
+        if (controller)
+        {
+            controller->on_overload(level, cause);
+            return 0;
+        }
+        char buf[3 + sizeof(shed)];
+        buf[0] = level;
+        buf[1] = cause;
+        buf[2] = std::min(load * 100, 255.0);
+        memcpy(buf + 3, &shed, sizeof(shed));
+        return api_out(make_buffer(Magic::OVERLOAD, buf, sizeof(buf)));
+    }
+    // records starts with STATS_HEADER bytes of room for the clock
+    inline int api_stats(uint64_t clock, std::vector<char> &records)
+    {
+        if (controller)
+            return 0;
+        memcpy(records.data(), &clock, sizeof(clock));
+        return api_out(make_buffer(Magic::STATS, records.data(), records.size()));
+    }
 
 }
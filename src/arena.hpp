@@ -0,0 +1,190 @@
+#pragma once
+#include <sys/mman.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+/* ** Memory arena **
+ *  With --arena the daemon takes the memory it will need at startup, so a first burst
+ *  doesn't pay for page faults and allocator growth.
+ *
+ *  Connections are carved from one mapping of fixed size slots, backed by MAP_HUGETLB pages
+ *  where the system has them reserved and by transparent huge pages otherwise, faulted in
+ *  right away. Frame buffers and pre-accept storage come from malloc, the heap is grown by
+ *  heapReserve bytes up front and malloc is told to keep it: one arena for all threads,
+ *  never trimmed, no mmap for buffers of a frame's size.
+ *  With lock the whole process is mlocked, now and in the future.
+ *
+ *  A slot request that doesn't fit falls back to the heap and is counted in fallbacks.
+ *  Slots are taken and returned from any thread.
+ */
+namespace Api
+{
+    class Arena
+    {
+    public:
+        static const size_t HUGE_PAGE = 2 << 20;
+        static const size_t HEAP_STEP = 1 << 20;
+
+        bool enabled = false, hugePages = false, locked = false;
+        size_t slotSize = 0, slots = 0, heapReserve = 0;
+
+        ~Arena()
+        {
+            if (base)
+                munmap(base, length);
+        }
+
+        // False if the slots can't be mapped, the heap reserve and mlock are best effort
+        bool reserve(size_t size, size_t count, size_t heap, bool lock)
+        {
+            slotSize = (size + 63) & ~(size_t)63;
+            slots = count;
+            length = (slotSize * slots + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+            base = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+            hugePages = base != MAP_FAILED;
+            if (!hugePages)
+            {
+                base = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (base == MAP_FAILED)
+                {
+                    base = nullptr;
+                    perror("[Arena] mmap");
+                    return false;
+                }
+                madvise(base, length, MADV_HUGEPAGE);
+                // Faulted in after the advice, so THP can back it
+                memset(base, 0, length);
+            }
+            for (size_t i = slots; i-- > 0;)
+            {
+                char *slot = base + i * slotSize;
+                memcpy(slot, &freeList, sizeof(freeList));
+                freeList = slot;
+            }
+
+            mallopt(M_ARENA_MAX, 1);
+            mallopt(M_MMAP_THRESHOLD, 32 << 20);
+            mallopt(M_TRIM_THRESHOLD, INT_MAX);
+            heapReserve = grow_heap(heap);
+            if (lock)
+            {
+                locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+                if (!locked)
+                    perror("[Arena] mlockall");
+            }
+            enabled = true;
+            return true;
+        }
+
+        // nullptr if size doesn't fit a slot or every slot is taken
+        void *allocate(size_t size)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (size > slotSize || !freeList)
+            {
+                fallbacks++;
+                return nullptr;
+            }
+            char *slot = freeList;
+            memcpy(&freeList, slot, sizeof(freeList));
+            used++;
+            highWater = std::max(highWater, used);
+            return slot;
+        }
+
+        bool owns(void *p) const { return (char *)p >= base && (char *)p < base + slotSize * slots; }
+
+        void deallocate(void *p)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            memcpy(p, &freeList, sizeof(freeList));
+            freeList = (char *)p;
+            used--;
+        }
+
+        size_t slots_used()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return used;
+        }
+
+        size_t slots_high_water()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return highWater;
+        }
+
+        size_t slot_fallbacks()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return fallbacks;
+        }
+
+        // Bytes the heap holds that nothing uses
+        static size_t heap_free() { return mallinfo2().fordblks; }
+        static size_t heap_size() { return mallinfo2().arena; }
+
+    private:
+        char *base = nullptr;
+        size_t length = 0;
+        char *freeList = nullptr;
+        size_t used = 0, highWater = 0, fallbacks = 0;
+        std::mutex lock;
+
+        // Buffers below the mmap threshold come from the heap, touched and given back they stay in it
+        static size_t grow_heap(size_t bytes)
+        {
+            std::vector<void *> steps;
+            size_t grown = 0;
+            for (; grown < bytes; grown += HEAP_STEP)
+            {
+                void *p = malloc(HEAP_STEP);
+                if (!p)
+                    break;
+                memset(p, 0, HEAP_STEP);
+                steps.push_back(p);
+            }
+            for (void *p : steps)
+                free(p);
+            return grown;
+        }
+    };
+
+    inline Arena arena;
+
+    // Takes slots from the arena while it is enabled and has room, the heap otherwise
+    template <typename T>
+    struct ArenaAllocator
+    {
+        using value_type = T;
+
+        ArenaAllocator() = default;
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U> &) {}
+
+        T *allocate(size_t n)
+        {
+            void *p = arena.enabled ? arena.allocate(n * sizeof(T)) : nullptr;
+            return (T *)(p ? p : ::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *p, size_t)
+        {
+            if (arena.owns(p))
+                arena.deallocate(p);
+            else
+                ::operator delete(p);
+        }
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U> &) const { return true; }
+    };
+}
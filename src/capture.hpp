@@ -0,0 +1,225 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <mutex>
+
+/* ** Traffic capture **
+ *  With --capture PATH the daemon appends every api frame it reads and writes and every
+ *  socket event to PATH. The file is written through an mmapped window of WINDOW bytes,
+ *  so recording is a memcpy under a lock, no syscall unless a window is full.
+ *
+ *  File: FileHeader, then records. A record is a RecordHeader followed by `length` payload
+ *  bytes, padded to 8 bytes. Records never cross a window, the rest of a window that can't
+ *  hold the next record is skipped (a PAD record, or zeros which read as PAD).
+ *  Timestamps are CLOCK_MONOTONIC nanoseconds since the capture was opened.
+ *
+ *     API_IN        one frame read from API_IN_FILENO
+ *     API_OUT       bytes written to API_OUT_FILENO, one record per write
+ *     SOCKET_OPEN   an inbound connection took id `conn`, payload "ip:port"
+ *     SOCKET_DIAL   an outbound connection took id `conn`, payload "host:port"
+ *     SOCKET_READ   bytes read from connection `conn`
+ *     SOCKET_WRITE  bytes written to connection `conn`
+ *     SOCKET_CLOSE  connection `conn` closed, payload [u8 DisconnectReason]
+ *
+ *  funny_replay drives a daemon from a capture.
+ */
+namespace Api
+{
+    class Capture
+    {
+    public:
+        static const uint32_t MAGIC = 0x43594e46; // "FNYC"
+        static const uint32_t VERSION = 1;
+        static const size_t WINDOW = 8 << 20;
+
+        enum Kind : uint8_t
+        {
+            PAD,
+            API_IN,
+            API_OUT,
+            SOCKET_OPEN,
+            SOCKET_DIAL,
+            SOCKET_READ,
+            SOCKET_WRITE,
+            SOCKET_CLOSE
+        };
+
+        struct FileHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t realtime_ns;
+            uint64_t window;
+            uint64_t reserved;
+        };
+
+        struct RecordHeader
+        {
+            uint64_t ts_ns;
+            uint32_t length;
+            uint8_t kind;
+            uint8_t conn;
+            uint16_t reserved;
+        };
+
+        static size_t padded(size_t length) { return (length + 7) & ~(size_t)7; }
+
+        static uint64_t monotonic_ns()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+
+        ~Capture() { close(); }
+
+        bool open(const char *path)
+        {
+            fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                perror("[Capture] open");
+                return false;
+            }
+            start = monotonic_ns();
+            windowStart = 0;
+            if (!map_window())
+                return false;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            FileHeader header = {MAGIC, VERSION, ts.tv_sec * 1000000000ull + ts.tv_nsec, WINDOW, 0};
+            memcpy(base, &header, sizeof(header));
+            used = sizeof(header);
+            enabled = true;
+            return true;
+        }
+
+        // Set once before any thread records, so it is read without the lock
+        bool enabled = false;
+
+        void record(Kind kind, uint8_t conn, const char *data, size_t length)
+        {
+            struct iovec iov = {(void *)data, length};
+            record(kind, conn, &iov, 1);
+        }
+
+        // One record from several pieces, e.g. a frame prefix and its message
+        void record(Kind kind, uint8_t conn, const struct iovec *iov, int count)
+        {
+            if (!enabled)
+                return;
+            size_t length = 0;
+            for (int i = 0; i < count; i++)
+                length += iov[i].iov_len;
+            size_t size = sizeof(RecordHeader) + padded(length);
+            std::lock_guard<std::mutex> guard(lock);
+            if (!base)
+                return;
+            if (used + size > WINDOW)
+            {
+                if (WINDOW - used >= sizeof(RecordHeader))
+                {
+                    RecordHeader pad = {0, 0, PAD, 0, 0};
+                    memcpy(base + used, &pad, sizeof(pad));
+                }
+                windowStart += WINDOW;
+                if (size > WINDOW || !map_window())
+                    return;
+            }
+            RecordHeader header = {monotonic_ns() - start, (uint32_t)length, kind, conn, 0};
+            char *at = base + used;
+            memcpy(at, &header, sizeof(header));
+            at += sizeof(header);
+            for (int i = 0; i < count; i++)
+            {
+                memcpy(at, iov[i].iov_base, iov[i].iov_len);
+                at += iov[i].iov_len;
+            }
+            used += size;
+        }
+
+        // Cuts the file to what was recorded
+        void close()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            enabled = false;
+            if (fd < 0)
+                return;
+            if (base)
+                munmap(base, WINDOW);
+            base = nullptr;
+            ftruncate(fd, windowStart + used);
+            ::close(fd);
+            fd = -1;
+        }
+
+    private:
+        int fd = -1;
+        char *base = nullptr;
+        uint64_t windowStart = 0;
+        size_t used = 0;
+        uint64_t start = 0;
+        std::mutex lock;
+
+        // Lock held or not shared yet
+        bool map_window()
+        {
+            if (base)
+                munmap(base, WINDOW);
+            base = nullptr;
+            used = 0;
+            if (ftruncate(fd, windowStart + WINDOW) < 0)
+            {
+                perror("[Capture] ftruncate");
+                return false;
+            }
+            base = (char *)mmap(nullptr, WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, fd, windowStart);
+            if (base == MAP_FAILED)
+            {
+                perror("[Capture] mmap");
+                base = nullptr;
+                return false;
+            }
+            return true;
+        }
+    };
+
+    // Walks the records of a capture file mapped at data, calls func(header, payload) for each
+    template <typename Func>
+    bool capture_for_each(const char *data, size_t size, Func func)
+    {
+        Capture::FileHeader file;
+        if (size < sizeof(file))
+            return false;
+        memcpy(&file, data, sizeof(file));
+        if (file.magic != Capture::MAGIC || file.version != Capture::VERSION || !file.window)
+            return false;
+        size_t at = sizeof(file);
+        while (at + sizeof(Capture::RecordHeader) <= size)
+        {
+            Capture::RecordHeader header;
+            memcpy(&header, data + at, sizeof(header));
+            size_t windowEnd = (at / file.window + 1) * file.window;
+            if (header.kind == Capture::PAD)
+            {
+                at = windowEnd;
+                continue;
+            }
+            size_t next = at + sizeof(header) + Capture::padded(header.length);
+            if (next > size || next > windowEnd)
+                return false;
+            func(header, data + at + sizeof(header));
+            at = next;
+            if (windowEnd - at < sizeof(Capture::RecordHeader))
+                at = windowEnd;
+        }
+        return true;
+    }
+}
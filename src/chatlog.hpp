@@ -0,0 +1,466 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <fmt/core.h>
+
+/* ** Chat history **
+ *  Messages are appended to fixed size, memory-mapped segment files (seg-XXXXXXXX.log).
+ *  index.bin holds one fixed size IndexEntry per message (timestamp, connection, segment, offset, length),
+ *  so reopening the history is a single mmap of the index; segments are mapped lazily on first access.
+ *
+ *  Search uses a trigram inverted index. trigram.bin is an immutable checkpoint covering messages
+ *  [0, covered), newer messages live in an in-memory delta which is folded into a new checkpoint
+ *  every CHECKPOINT_EVERY messages and on close. Candidates from the posting lists are verified
+ *  against the message text, so the index can never produce false hits.
+ */
+namespace funny
+{
+    class ChatLog
+    {
+    public:
+        static const uint8_t SELF = 0xFF;
+        static const uint32_t SEGMENT_SIZE = 64 << 20;
+        static const uint32_t CHECKPOINT_EVERY = 1 << 18;
+
+        struct IndexEntry
+        {
+            uint64_t timestamp_us;
+            uint32_t segment;
+            uint32_t offset;
+            uint32_t length;
+            uint8_t conn;
+            uint8_t pad[3];
+        };
+
+        struct Message
+        {
+            uint64_t timestamp_us;
+            uint8_t conn;
+            const char *text;
+            uint32_t length;
+        };
+
+        ChatLog(std::string dir) : dir(dir)
+        {
+            mkdir(dir.c_str(), 0700);
+            open_index();
+            open_trigrams();
+        }
+        ~ChatLog()
+        {
+            if (delta_messages > 0)
+                checkpoint();
+            for (Segment &seg : segments)
+                if (seg.base)
+                    munmap(seg.base, SEGMENT_SIZE);
+            if (ck_base)
+                munmap(ck_base, ck_size);
+            munmap(index_base, index_map_size());
+            close(index_fd);
+        }
+
+        static std::string default_path()
+        {
+            const char *env = getenv("FUNNY_HISTORY");
+            if (env)
+                return env;
+            const char *home = getenv("HOME");
+            return std::string(home ? home : ".") + "/.funny_history";
+        }
+
+        uint64_t size() { return header->count; }
+
+        Message get(uint64_t i)
+        {
+            IndexEntry &e = entries[i];
+            return {e.timestamp_us, e.conn, segment(e.segment) + e.offset, e.length};
+        }
+
+        uint64_t append(uint8_t conn, const char *text, uint32_t length)
+        {
+            if (length > SEGMENT_SIZE)
+                length = SEGMENT_SIZE;
+            if (segments.empty() || tail_offset + length > SEGMENT_SIZE)
+            {
+                segments.push_back({nullptr});
+                tail_offset = 0;
+            }
+            uint32_t seg = segments.size() - 1;
+            memcpy(segment(seg) + tail_offset, text, length);
+
+            uint64_t id = header->count;
+            if (id == index_capacity)
+                grow_index();
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            entries[id] = {(uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, seg, tail_offset, length, conn, {0}};
+            tail_offset += length;
+            // Publish the entry only after its payload and record are in place
+            __atomic_store_n(&header->count, id + 1, __ATOMIC_RELEASE);
+
+            if (indexed_upto == id)
+                index_step(1);
+            return id;
+        }
+
+        // Messages appended before the last checkpoint are indexed in small steps, driven by the Gui idle loop
+        bool index_pending() { return indexed_upto < header->count; }
+
+        void index_step(uint64_t max_messages)
+        {
+            std::vector<uint32_t> grams;
+            uint64_t end = std::min<uint64_t>(header->count, indexed_upto + max_messages);
+            for (; indexed_upto < end; indexed_upto++)
+            {
+                Message m = get(indexed_upto);
+                trigrams(m.text, m.length, grams);
+                for (uint32_t g : grams)
+                    delta[g].push_back(indexed_upto);
+                delta_messages++;
+            }
+            if (delta_messages >= CHECKPOINT_EVERY && !index_pending())
+                checkpoint();
+        }
+
+        // Returns matching message ids, newest first
+        std::vector<uint64_t> search(std::string query, size_t limit)
+        {
+            std::vector<uint64_t> hits;
+            for (char &c : query)
+                c = lower(c);
+            if (query.empty())
+                return hits;
+
+            // Messages not yet covered by the index are scanned directly
+            for (uint64_t i = header->count; i > indexed_upto && hits.size() < limit; i--)
+                if (matches(i - 1, query))
+                    hits.push_back(i - 1);
+
+            if (query.size() < 3)
+            {
+                for (uint64_t i = indexed_upto; i > 0 && hits.size() < limit; i--)
+                    if (matches(i - 1, query))
+                        hits.push_back(i - 1);
+                return hits;
+            }
+
+            std::vector<uint32_t> grams;
+            trigrams(query.data(), query.size(), grams);
+            std::vector<Postings> lists;
+            for (uint32_t g : grams)
+            {
+                lists.push_back(postings(g));
+                if (lists.back().size() == 0)
+                    return hits;
+            }
+            std::sort(lists.begin(), lists.end(), [](const Postings &a, const Postings &b)
+                      { return a.size() < b.size(); });
+
+            // Walk the rarest list backwards so the newest hits come first and we can stop at limit
+            Postings &rarest = lists[0];
+            for (size_t i = rarest.size(); i > 0 && hits.size() < limit; i--)
+            {
+                uint32_t id = rarest.at(i - 1);
+                bool all = true;
+                for (size_t l = 1; l < lists.size() && all; l++)
+                    all = lists[l].contains(id);
+                if (all && matches(id, query))
+                    hits.push_back(id);
+            }
+            return hits;
+        }
+
+    private:
+        struct Segment
+        {
+            char *base;
+        };
+
+        struct IndexHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t count;
+            uint64_t reserved[6];
+        };
+
+        struct TrigramHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t covered;
+            uint64_t n_keys;
+            uint64_t n_postings;
+        };
+
+        struct TrigramKey
+        {
+            uint32_t gram;
+            uint32_t count;
+            uint64_t first;
+        };
+
+        // A posting list is the checkpoint part followed by the delta part, both sorted by id
+        struct Postings
+        {
+            const uint32_t *ck = nullptr;
+            size_t ck_n = 0;
+            const std::vector<uint32_t> *delta = nullptr;
+
+            size_t size() const { return ck_n + (delta ? delta->size() : 0); }
+            uint32_t at(size_t i) const { return i < ck_n ? ck[i] : (*delta)[i - ck_n]; }
+            bool contains(uint32_t id) const
+            {
+                if (std::binary_search(ck, ck + ck_n, id))
+                    return true;
+                return delta && std::binary_search(delta->begin(), delta->end(), id);
+            }
+        };
+
+        static const uint32_t INDEX_MAGIC = 0x78646e66;   // "fndx"
+        static const uint32_t TRIGRAM_MAGIC = 0x6d726766; // "fgrm"
+
+        std::string dir;
+        int index_fd;
+        char *index_base;
+        IndexHeader *header;
+        IndexEntry *entries;
+        uint64_t index_capacity;
+
+        std::vector<Segment> segments;
+        uint32_t tail_offset = 0;
+
+        char *ck_base = nullptr;
+        size_t ck_size = 0;
+        TrigramHeader *ck_header = nullptr;
+        TrigramKey *ck_keys = nullptr;
+        uint32_t *ck_postings = nullptr;
+
+        std::unordered_map<uint32_t, std::vector<uint32_t>> delta;
+        uint64_t delta_messages = 0;
+        uint64_t indexed_upto = 0;
+
+        static char lower(char c) { return (c >= 'A' && c <= 'Z') ? c + 32 : c; }
+
+        static void trigrams(const char *text, size_t length, std::vector<uint32_t> &out)
+        {
+            out.clear();
+            for (size_t i = 0; i + 2 < length; i++)
+                out.push_back((uint8_t)lower(text[i]) << 16 | (uint8_t)lower(text[i + 1]) << 8 | (uint8_t)lower(text[i + 2]));
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+        }
+
+        bool matches(uint64_t id, const std::string &query)
+        {
+            Message m = get(id);
+            if (m.length < query.size())
+                return false;
+            for (size_t i = 0; i + query.size() <= m.length; i++)
+            {
+                size_t j = 0;
+                while (j < query.size() && lower(m.text[i + j]) == query[j])
+                    j++;
+                if (j == query.size())
+                    return true;
+            }
+            return false;
+        }
+
+        std::string path(const char *name) { return dir + "/" + name; }
+
+        size_t index_map_size() { return sizeof(IndexHeader) + index_capacity * sizeof(IndexEntry); }
+
+        void map_index()
+        {
+            index_base = (char *)mmap(nullptr, index_map_size(), PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+            if (index_base == MAP_FAILED)
+            {
+                perror("[ChatLog] mmap index");
+                exit(1);
+            }
+            header = (IndexHeader *)index_base;
+            entries = (IndexEntry *)(index_base + sizeof(IndexHeader));
+        }
+
+        void open_index()
+        {
+            index_fd = open(path("index.bin").c_str(), O_RDWR | O_CREAT, 0600);
+            if (index_fd < 0)
+            {
+                perror("[ChatLog] open index");
+                exit(1);
+            }
+            struct stat st;
+            fstat(index_fd, &st);
+            bool fresh = st.st_size < (off_t)sizeof(IndexHeader);
+            if (fresh)
+            {
+                index_capacity = 1 << 16;
+                ftruncate(index_fd, index_map_size());
+            }
+            else
+                index_capacity = (st.st_size - sizeof(IndexHeader)) / sizeof(IndexEntry);
+            map_index();
+            if (fresh)
+                *header = {INDEX_MAGIC, 1, 0, {0}};
+
+            if (header->count > 0)
+            {
+                IndexEntry &last = entries[header->count - 1];
+                segments.resize(last.segment + 1, {nullptr});
+                tail_offset = last.offset + last.length;
+            }
+        }
+
+        void grow_index()
+        {
+            munmap(index_base, index_map_size());
+            index_capacity *= 2;
+            ftruncate(index_fd, index_map_size());
+            map_index();
+        }
+
+        char *segment(uint32_t seg)
+        {
+            if (segments[seg].base)
+                return segments[seg].base;
+            std::string name = fmt::format("{}/seg-{:08x}.log", dir, seg);
+            int fd = open(name.c_str(), O_RDWR | O_CREAT, 0600);
+            if (fd < 0)
+            {
+                perror("[ChatLog] open segment");
+                exit(1);
+            }
+            ftruncate(fd, SEGMENT_SIZE);
+            char *base = (char *)mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED)
+            {
+                perror("[ChatLog] mmap segment");
+                exit(1);
+            }
+            segments[seg].base = base;
+            return base;
+        }
+
+        void open_trigrams()
+        {
+            int fd = open(path("trigram.bin").c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat st;
+            fstat(fd, &st);
+            if (st.st_size >= (off_t)sizeof(TrigramHeader))
+            {
+                ck_size = st.st_size;
+                ck_base = (char *)mmap(nullptr, ck_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (ck_base == MAP_FAILED)
+                    ck_base = nullptr;
+            }
+            close(fd);
+            if (!ck_base)
+                return;
+            ck_header = (TrigramHeader *)ck_base;
+            if (ck_header->magic != TRIGRAM_MAGIC || ck_header->covered > header->count)
+            { // Stale or foreign checkpoint, rebuild from scratch
+                munmap(ck_base, ck_size);
+                ck_base = nullptr;
+                ck_header = nullptr;
+                return;
+            }
+            ck_keys = (TrigramKey *)(ck_base + sizeof(TrigramHeader));
+            ck_postings = (uint32_t *)(ck_keys + ck_header->n_keys);
+            indexed_upto = ck_header->covered;
+        }
+
+        Postings postings(uint32_t gram)
+        {
+            Postings p;
+            if (ck_header)
+            {
+                TrigramKey *end = ck_keys + ck_header->n_keys;
+                TrigramKey *k = std::lower_bound(ck_keys, end, gram, [](const TrigramKey &key, uint32_t g)
+                                                 { return key.gram < g; });
+                if (k != end && k->gram == gram)
+                {
+                    p.ck = ck_postings + k->first;
+                    p.ck_n = k->count;
+                }
+            }
+            auto it = delta.find(gram);
+            if (it != delta.end())
+                p.delta = &it->second;
+            return p;
+        }
+
+        // Merge the mapped checkpoint and the delta into a new checkpoint file
+        void checkpoint()
+        {
+            std::vector<uint32_t> grams;
+            grams.reserve(delta.size());
+            for (auto &kv : delta)
+                grams.push_back(kv.first);
+            std::sort(grams.begin(), grams.end());
+
+            size_t n_ck = ck_header ? ck_header->n_keys : 0;
+            std::vector<TrigramKey> keys;
+            keys.reserve(n_ck + grams.size());
+            size_t i = 0, j = 0;
+            uint64_t first = 0;
+            while (i < n_ck || j < grams.size())
+            {
+                TrigramKey k;
+                if (j == grams.size() || (i < n_ck && ck_keys[i].gram < grams[j]))
+                    k = {ck_keys[i].gram, ck_keys[i++].count, first};
+                else if (i == n_ck || grams[j] < ck_keys[i].gram)
+                    k = {grams[j], (uint32_t)delta[grams[j]].size(), first}, j++;
+                else
+                    k = {grams[j], ck_keys[i++].count + (uint32_t)delta[grams[j]].size(), first}, j++;
+                first += k.count;
+                keys.push_back(k);
+            }
+
+            std::string tmp = path("trigram.bin.tmp");
+            FILE *f = fopen(tmp.c_str(), "wb");
+            if (!f)
+            {
+                perror("[ChatLog] checkpoint");
+                return;
+            }
+            TrigramHeader h = {TRIGRAM_MAGIC, 1, indexed_upto, keys.size(), first};
+            fwrite(&h, sizeof(h), 1, f);
+            fwrite(keys.data(), sizeof(TrigramKey), keys.size(), f);
+            for (TrigramKey &k : keys)
+            {
+                Postings p = postings(k.gram);
+                if (p.ck_n)
+                    fwrite(p.ck, sizeof(uint32_t), p.ck_n, f);
+                if (p.delta)
+                    fwrite(p.delta->data(), sizeof(uint32_t), p.delta->size(), f);
+            }
+            fclose(f);
+            rename(tmp.c_str(), path("trigram.bin").c_str());
+
+            if (ck_base)
+                munmap(ck_base, ck_size);
+            ck_base = nullptr;
+            ck_header = nullptr;
+            delta.clear();
+            delta_messages = 0;
+            uint64_t upto = indexed_upto;
+            open_trigrams();
+            indexed_upto = std::max(indexed_upto, upto);
+        }
+    };
+}
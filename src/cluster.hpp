@@ -0,0 +1,474 @@
+#pragma once
+#include "loop.hpp"
+#include "resolver.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+/* ** Cluster links **
+ *  Daemons of a cluster are configured with the same list of nodes, name=host:port each, and
+ *  keep one TCP link per pair, the node listed first dials. A link carries records
+ *     [u8 kind][u32 length][frames]
+ *  whose frames are in the api frame format: COMMANDS as the controller writes them, EVENTS as
+ *  the daemon writes them. Records are batched per link and flushed once per loop iteration.
+ *  A link holds at most MAX_LINK_BYTES the socket didn't take, frames beyond that are dropped
+ *  whole and onFull reports it, again with the count once the link drained to half of it.
+ *
+ *  Keys are placed on a consistent hash ring, POINTS virtual points per node. A node that
+ *  joins or leaves only moves the keys of its own arcs.
+ */
+namespace Api
+{
+    class Ring
+    {
+    public:
+        static const int POINTS = 64;
+
+        // 32 bit FNV-1a with a murmur finalizer, spreads short keys over the whole ring
+        static uint32_t hash(const char *data, size_t length)
+        {
+            uint32_t h = 2166136261u;
+            for (size_t i = 0; i < length; i++)
+                h = (h ^ (unsigned char)data[i]) * 16777619u;
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35;
+            h ^= h >> 16;
+            return h;
+        }
+        static uint32_t hash(const std::string &key) { return hash(key.data(), key.size()); }
+
+        void build(const std::vector<std::string> &names, const std::vector<bool> &members)
+        {
+            points.clear();
+            for (size_t node = 0; node < names.size(); node++)
+                if (members[node])
+                    for (int i = 0; i < POINTS; i++)
+                        points.push_back({hash(names[node] + "#" + std::to_string(i)), (int)node});
+            std::sort(points.begin(), points.end());
+        }
+
+        // The node owning key, -1 on an empty ring
+        int lookup(uint32_t key) const
+        {
+            if (points.empty())
+                return -1;
+            auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(key, -1));
+            return it == points.end() ? points.front().second : it->second;
+        }
+
+    private:
+        std::vector<std::pair<uint32_t, int>> points;
+    };
+
+    class Cluster
+    {
+    public:
+        enum Kind : uint8_t
+        {
+            HELLO,
+            COMMANDS,
+            EVENTS
+        };
+        static const size_t RECORD_HEADER = 1 + sizeof(uint32_t);
+        static const uint64_t RETRY_MS = 1000;
+        static const size_t MAX_LINK_BYTES = 64 << 20;
+
+        // Frames of one record, valid during the call only
+        std::function<void(int from, Kind kind, const char *frames, size_t length)> onRecord;
+        std::function<void(int node, bool up)> onLink;
+        // full when the link starts dropping frames, !full with the count once it drained
+        std::function<void(int node, bool full, uint64_t dropped)> onFull;
+
+        int self = -1;
+        // Owns keys that must never move, over every configured node
+        Ring fixed;
+        // Places new work, over the nodes that are reachable right now
+        Ring live;
+
+        Cluster(Loop &loop, Resolver &resolver) : loop(loop), resolver(resolver) {}
+
+        bool enabled() const { return self >= 0; }
+        int size() const { return nodes.size(); }
+        const std::string &name(int node) const { return nodes[node]->name; }
+
+        // nodeList is name=host:port,... in the same order on every node, false if it doesn't parse
+        bool configure(const std::string &nodeList, const std::string &selfName)
+        {
+            size_t at = 0;
+            while (at <= nodeList.size())
+            {
+                size_t comma = std::min(nodeList.find(',', at), nodeList.size());
+                std::string entry = nodeList.substr(at, comma - at);
+                size_t eq = entry.find('='), colon = entry.rfind(':');
+                if (eq == std::string::npos || colon == std::string::npos || colon < eq)
+                    return false;
+                auto node = std::make_unique<Node>();
+                node->name = entry.substr(0, eq);
+                node->host = entry.substr(eq + 1, colon - eq - 1);
+                node->port = atoi(entry.c_str() + colon + 1);
+                if (node->name == selfName)
+                    self = nodes.size();
+                nodes.push_back(std::move(node));
+                at = comma + 1;
+            }
+            if (self < 0)
+                return false;
+            std::vector<std::string> names;
+            for (auto &node : nodes)
+                names.push_back(node->name);
+            fixed.build(names, std::vector<bool>(nodes.size(), true));
+            rebuild_live();
+            return true;
+        }
+
+        // Loop thread only, listens on this node's port and dials the nodes listed after it
+        bool start()
+        {
+            Node &me = *nodes[self];
+            listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int yes = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port = htons(me.port);
+            if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+            {
+                close(listenFd);
+                listenFd = -1;
+                return false;
+            }
+            listenWatch.fd = listenFd;
+            listenWatch.onEvents = [this](uint32_t)
+            { on_accept(); };
+            loop.add(&listenWatch, EPOLLIN);
+            for (int node = self + 1; node < size(); node++)
+                dial(node);
+            return true;
+        }
+
+        bool up(int node) const { return node == self || nodes[node]->link; }
+
+        // Loop thread only, one frame given as data followed by more, appended to the open record
+        // of the link. False if it was dropped, while the link is down or full
+        bool send(int node, Kind kind, const char *data, size_t length, const char *more = nullptr, size_t moreLength = 0)
+        {
+            Link *link = nodes[node]->link;
+            if (!link)
+                return false;
+            if (link->out.size() - link->sent + RECORD_HEADER + length + moreLength > MAX_LINK_BYTES)
+            {
+                if (!link->dropped++ && onFull)
+                    onFull(node, true, 0);
+                return false;
+            }
+            if (link->out.empty())
+                loop.post([this, node]
+                          {
+                              if (Link *link = nodes[node]->link)
+                                  flush(link); });
+            if (!link->recordOpen || link->recordKind != kind)
+            { // Start a record, the length is patched while it grows
+                link->recordAt = link->out.size();
+                link->recordKind = kind;
+                link->recordOpen = true;
+                link->out.push_back(kind);
+                link->out.resize(link->out.size() + sizeof(uint32_t));
+            }
+            link->out.insert(link->out.end(), data, data + length);
+            link->out.insert(link->out.end(), more, more + moreLength);
+            uint32_t recordLength = link->out.size() - link->recordAt - RECORD_HEADER;
+            memcpy(&link->out[link->recordAt + 1], &recordLength, sizeof(recordLength));
+            return true;
+        }
+
+    private:
+        struct Link
+        {
+            int fd = -1;
+            // -1 until the HELLO of an accepted link arrived
+            int node = -1;
+            bool connecting = false, waiting = false;
+            Watch watch;
+            std::vector<char> in, out;
+            size_t sent = 0, recordAt = 0;
+            Kind recordKind = HELLO;
+            // The record at recordAt takes more frames, none of it was sent yet
+            bool recordOpen = false;
+            // Frames dropped since the link filled up
+            uint64_t dropped = 0;
+        };
+
+        struct Node
+        {
+            std::string name, host;
+            int port;
+            Link *link = nullptr;
+            Timer retry;
+        };
+
+        Loop &loop;
+        Resolver &resolver;
+        std::vector<std::unique_ptr<Node>> nodes;
+        std::vector<std::unique_ptr<Link>> links;
+        int listenFd = -1;
+        Watch listenWatch;
+
+        void rebuild_live()
+        {
+            std::vector<std::string> names;
+            std::vector<bool> members;
+            for (int node = 0; node < size(); node++)
+            {
+                names.push_back(nodes[node]->name);
+                members.push_back(up(node));
+            }
+            live.build(names, members);
+        }
+
+        Link *add_link(int fd, int node)
+        {
+            links.push_back(std::make_unique<Link>());
+            Link *link = links.back().get();
+            link->fd = fd;
+            link->node = node;
+            link->watch.fd = fd;
+            link->watch.onEvents = [this, link](uint32_t events)
+            { on_events(link, events); };
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            return link;
+        }
+
+        // The name is resolved off the loop, the connect continues on it
+        void dial(int node)
+        {
+            resolver.resolve(nodes[node]->host, [this, node](bool ok, struct in_addr ip)
+                             {
+                                 if (loop.in_loop())
+                                     connect_to(node, ok, ip);
+                                 else
+                                     loop.post([this, node, ok, ip]
+                                               { connect_to(node, ok, ip); }); });
+        }
+
+        void connect_to(int node, bool resolved, struct in_addr ip)
+        {
+            if (nodes[node]->link)
+                return;
+            int fd = -1;
+            if (resolved)
+            {
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_addr = ip;
+                addr.sin_port = htons(nodes[node]->port);
+                fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            if (fd < 0)
+                return retry(node);
+            Link *link = add_link(fd, node);
+            link->connecting = true;
+            loop.add(&link->watch, EPOLLOUT);
+        }
+
+        void retry(int node)
+        {
+            nodes[node]->retry.callback = [this, node]
+            {
+                if (!nodes[node]->link)
+                    dial(node);
+            };
+            loop.arm(&nodes[node]->retry, RETRY_MS);
+        }
+
+        void on_accept()
+        {
+            while (true)
+            {
+                int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                    return;
+                Link *link = add_link(fd, -1);
+                loop.add(&link->watch, EPOLLIN);
+            }
+        }
+
+        // A link counts once both sides know who is on the other end
+        void attach(Link *link)
+        {
+            Node &node = *nodes[link->node];
+            if (node.link)
+                drop(node.link);
+            node.link = link;
+            rebuild_live();
+            onLink(link->node, true);
+        }
+
+        void drop(Link *link)
+        {
+            if (link->fd < 0)
+                return;
+            loop.remove(&link->watch);
+            close(link->fd);
+            link->fd = -1;
+            bool attached = link->node >= 0 && nodes[link->node]->link == link;
+            if (attached)
+            {
+                nodes[link->node]->link = nullptr;
+                rebuild_live();
+            }
+            int node = link->node;
+            bool dialer = node > self;
+            // Freed after the current epoll batch, an event for it may still be pending
+            loop.post([this, link]
+                      { std::erase_if(links, [link](auto &owned)
+                                      { return owned.get() == link; }); });
+            if (attached)
+                onLink(node, false);
+            if (attached && dialer)
+                retry(node);
+        }
+
+        void on_events(Link *link, uint32_t events)
+        {
+            if (link->connecting)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                int node = link->node;
+                if (err)
+                {
+                    link->node = -1;
+                    drop(link);
+                    return retry(node);
+                }
+                link->connecting = false;
+                loop.modify(&link->watch, EPOLLIN);
+                char hello[RECORD_HEADER + sizeof(uint32_t)] = {HELLO};
+                uint32_t length = sizeof(uint32_t), me = self;
+                memcpy(hello + 1, &length, sizeof(length));
+                memcpy(hello + RECORD_HEADER, &me, sizeof(me));
+                link->out.assign(hello, hello + sizeof(hello));
+                flush(link);
+                if (link->fd >= 0)
+                    attach(link);
+                return;
+            }
+            if (events & EPOLLOUT)
+                flush(link);
+            if (link->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                receive(link);
+        }
+
+        void receive(Link *link)
+        {
+            char buf[1 << 16];
+            // Bounded number of reads per wakeup so one busy node can't starve the loop
+            for (int i = 0; i < 16; i++)
+            {
+                ssize_t m = read(link->fd, buf, sizeof(buf));
+                if (m == 0 || (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    return drop(link);
+                if (m < 0)
+                    break;
+                link->in.insert(link->in.end(), buf, buf + m);
+            }
+            size_t at = 0;
+            while (link->in.size() - at >= RECORD_HEADER)
+            {
+                uint32_t length;
+                memcpy(&length, &link->in[at + 1], sizeof(length));
+                if (link->in.size() - at - RECORD_HEADER < length)
+                    break;
+                Kind kind = (Kind)link->in[at];
+                const char *frames = &link->in[at + RECORD_HEADER];
+                at += RECORD_HEADER + length;
+                if (kind == HELLO)
+                {
+                    uint32_t node;
+                    if (length != sizeof(node) || link->node >= 0)
+                        return drop(link);
+                    memcpy(&node, frames, sizeof(node));
+                    if ((int)node >= size() || (int)node == self)
+                        return drop(link);
+                    link->node = node;
+                    attach(link);
+                }
+                else if (link->node >= 0)
+                    onRecord(link->node, kind, frames, length);
+                if (link->fd < 0)
+                    return;
+            }
+            link->in.erase(link->in.begin(), link->in.begin() + at);
+        }
+
+        void flush(Link *link)
+        {
+            while (link->sent < link->out.size())
+            {
+                ssize_t m = ::send(link->fd, link->out.data() + link->sent, link->out.size() - link->sent, MSG_NOSIGNAL);
+                if (m < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        if (!link->waiting)
+                            loop.modify(&link->watch, EPOLLIN | EPOLLOUT);
+                        link->waiting = true;
+                        // What went out is freed once it is half of the buffer
+                        if (link->sent > link->out.size() / 2)
+                        {
+                            link->out.erase(link->out.begin(), link->out.begin() + link->sent);
+                            link->sent = 0;
+                        }
+                        drained(link);
+                        return;
+                    }
+                    return drop(link);
+                }
+                link->sent += m;
+                link->recordOpen = false;
+            }
+            link->out.clear();
+            link->sent = 0;
+            link->recordAt = 0;
+            if (link->waiting)
+                loop.modify(&link->watch, EPOLLIN);
+            link->waiting = false;
+            drained(link);
+        }
+
+        void drained(Link *link)
+        {
+            if (!link->dropped || link->out.size() - link->sent > MAX_LINK_BYTES / 2)
+                return;
+            uint64_t dropped = link->dropped;
+            link->dropped = 0;
+            if (onFull)
+                onFull(link->node, false, dropped);
+        }
+    };
+}
@@ -0,0 +1,282 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+/* ** Link compression **
+ *  A streaming LZ77 codec in the spirit of LZ4 for connections that enabled it with
+ *  SET_COMPRESSION. Nothing on the wire announces it, so both ends have to run this codec
+ *  from the same byte of the stream on. The byte stream on the socket is a sequence of blocks
+ *     [u8 BlockType][u16 raw length][u16 stored length][stored bytes]
+ *  of at most BLOCK raw bytes. Matches may reach WINDOW bytes back into earlier blocks, so
+ *  small messages of a chatty text protocol still compress against what came before.
+ *
+ *  An LZ block is a run of sequences as in LZ4: a token with the literal length in the high
+ *  and the match length - MIN_MATCH in the low nibble, 255-continued when 15, the literals,
+ *  a u16 offset and the match length continuation. The last sequence has literals only.
+ *
+ *  A block that doesn't shrink by an eighth goes out STORED. After BYPASS_STREAK stored
+ *  blocks in a row the encoder stops trying for BYPASS_SKIP blocks, so incompressible
+ *  streams cost a memcpy into the window and nothing more.
+ *  Loop thread only, one Codec per connection holds both directions.
+ */
+namespace Api
+{
+    enum BlockType
+    {
+        STORED,
+        LZ
+    };
+
+    class Codec
+    {
+    public:
+        static constexpr size_t BLOCK = 32 << 10;
+        static constexpr size_t WINDOW = 64 << 10;
+        static constexpr size_t HEADER = 5;
+        static constexpr int MIN_MATCH = 4;
+        static constexpr int HASH_BITS = 13;
+        static constexpr int BYPASS_STREAK = 4;
+        static constexpr int BYPASS_SKIP = 16;
+
+        struct Stats
+        {
+            uint64_t rawOut = 0, wireOut = 0, rawIn = 0, wireIn = 0;
+            uint64_t encodeNs = 0, decodeNs = 0;
+            uint64_t blocksOut = 0, blocksStored = 0;
+        };
+        Stats stats;
+
+        // The socket bytes for data
+        std::vector<char> encode(const char *data, size_t length)
+        {
+            uint64_t start = now_ns();
+            std::vector<char> wire;
+            wire.reserve(length + (length / BLOCK + 1) * HEADER);
+            for (size_t done = 0; done < length;)
+            {
+                size_t n = std::min(BLOCK, length - done);
+                encode_block(data + done, n, wire);
+                done += n;
+            }
+            stats.rawOut += length;
+            stats.wireOut += wire.size();
+            stats.encodeNs += now_ns() - start;
+            return wire;
+        }
+
+        // Appends the plain bytes of every block completed by data, false if the stream is corrupt
+        bool decode(const char *data, size_t length, std::vector<char> &out)
+        {
+            uint64_t start = now_ns();
+            stats.wireIn += length;
+            pending.insert(pending.end(), data, data + length);
+            size_t at = 0;
+            bool ok = true;
+            while (ok && pending.size() - at >= HEADER)
+            {
+                uint16_t raw, stored;
+                memcpy(&raw, &pending[at + 1], sizeof(raw));
+                memcpy(&stored, &pending[at + 3], sizeof(stored));
+                if (pending.size() - at - HEADER < stored)
+                    break;
+                size_t before = out.size();
+                ok = decode_block((BlockType)pending[at], &pending[at + HEADER], stored, raw, out);
+                stats.rawIn += out.size() - before;
+                at += HEADER + stored;
+            }
+            pending.erase(pending.begin(), pending.begin() + at);
+            stats.decodeNs += now_ns() - start;
+            return ok;
+        }
+
+    private:
+        // Encoder history and positions in it, + 1 so 0 is empty
+        std::vector<char> encWindow;
+        std::vector<uint32_t> table = std::vector<uint32_t>(1 << HASH_BITS);
+        int storedStreak = 0, skip = 0;
+        // Decoder history and the incomplete tail of the stream
+        std::vector<char> decWindow;
+        std::vector<char> pending;
+
+        static uint64_t now_ns()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+
+        static uint32_t read32(const char *p)
+        {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static uint32_t hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+        static void put_length(std::vector<char> &wire, size_t length)
+        {
+            for (; length >= 255; length -= 255)
+                wire.push_back((char)255);
+            wire.push_back((char)length);
+        }
+
+        static void put_sequence(std::vector<char> &wire, const char *literals, size_t literalLength, size_t offset, size_t matchLength)
+        {
+            size_t matchCode = matchLength ? matchLength - MIN_MATCH : 0;
+            wire.push_back((char)(std::min<size_t>(literalLength, 15) << 4 | std::min<size_t>(matchCode, 15)));
+            if (literalLength >= 15)
+                put_length(wire, literalLength - 15);
+            wire.insert(wire.end(), literals, literals + literalLength);
+            if (!matchLength)
+                return;
+            wire.push_back((char)(offset & 0xFF));
+            wire.push_back((char)(offset >> 8));
+            if (matchCode >= 15)
+                put_length(wire, matchCode - 15);
+        }
+
+        // Cuts the history back to WINDOW bytes once it holds twice that, so the move is rare
+        static size_t slide(std::vector<char> &window)
+        {
+            if (window.size() <= 2 * WINDOW)
+                return 0;
+            size_t shift = window.size() - WINDOW;
+            window.erase(window.begin(), window.begin() + shift);
+            return shift;
+        }
+
+        void encode_block(const char *data, size_t length, std::vector<char> &wire)
+        {
+            if (size_t shift = slide(encWindow))
+                for (uint32_t &position : table)
+                    position = position > shift ? position - shift : 0;
+            size_t base = encWindow.size();
+            encWindow.insert(encWindow.end(), data, data + length);
+
+            size_t header = wire.size();
+            wire.resize(header + HEADER);
+            bool compressed = false;
+            if (skip > 0)
+                skip--;
+            else
+            {
+                compress(base, wire);
+                compressed = wire.size() - header - HEADER < length - length / 8;
+                if (!compressed)
+                    wire.resize(header + HEADER);
+            }
+            if (compressed)
+                storedStreak = 0;
+            else
+            {
+                wire.insert(wire.end(), data, data + length);
+                stats.blocksStored++;
+                if (++storedStreak >= BYPASS_STREAK)
+                {
+                    storedStreak = 0;
+                    skip = BYPASS_SKIP;
+                }
+            }
+            stats.blocksOut++;
+            uint16_t raw = length, stored = wire.size() - header - HEADER;
+            wire[header] = compressed ? LZ : STORED;
+            memcpy(&wire[header + 1], &raw, sizeof(raw));
+            memcpy(&wire[header + 3], &stored, sizeof(stored));
+        }
+
+        void compress(size_t base, std::vector<char> &wire)
+        {
+            const char *src = encWindow.data();
+            size_t end = encWindow.size(), ip = base, anchor = base;
+            // The last bytes are always literals, so 4 byte reads never pass the end
+            size_t limit = end - base > 12 ? end - 12 : base;
+            while (ip < limit)
+            {
+                uint32_t sequence = read32(src + ip);
+                uint32_t &slot = table[hash(sequence)];
+                size_t ref = slot;
+                slot = ip + 1;
+                if (!ref || ip - (ref - 1) > 0xFFFF || read32(src + ref - 1) != sequence)
+                {
+                    ip++;
+                    continue;
+                }
+                ref--;
+                size_t length = MIN_MATCH;
+                while (ip + length < end - 5 && src[ref + length] == src[ip + length])
+                    length++;
+                put_sequence(wire, src + anchor, ip - anchor, ip - ref, length);
+                ip += length;
+                anchor = ip;
+            }
+            put_sequence(wire, src + anchor, end - anchor, 0, 0);
+        }
+
+        static bool get_length(const char *&p, const char *end, size_t &length)
+        {
+            while (true)
+            {
+                if (p >= end)
+                    return false;
+                unsigned char byte = *p++;
+                length += byte;
+                if (byte != 255)
+                    return true;
+            }
+        }
+
+        bool decode_block(BlockType type, const char *p, size_t stored, size_t raw, std::vector<char> &out)
+        {
+            slide(decWindow);
+            decWindow.reserve(2 * WINDOW + 0x10000);
+            size_t base = decWindow.size();
+            const char *end = p + stored;
+            if (type == STORED)
+            {
+                if (stored != raw)
+                    return false;
+                decWindow.insert(decWindow.end(), p, end);
+            }
+            else if (type == LZ)
+            {
+                while (p < end)
+                {
+                    unsigned char token = *p++;
+                    size_t literalLength = token >> 4;
+                    if (literalLength == 15 && !get_length(p, end, literalLength))
+                        return false;
+                    if ((size_t)(end - p) < literalLength || decWindow.size() - base + literalLength > raw)
+                        return false;
+                    decWindow.insert(decWindow.end(), p, p + literalLength);
+                    p += literalLength;
+                    if (p == end)
+                        break;
+                    if (end - p < 2)
+                        return false;
+                    size_t offset = (unsigned char)p[0] | (unsigned char)p[1] << 8;
+                    p += 2;
+                    size_t matchLength = token & 15;
+                    if (matchLength == 15 && !get_length(p, end, matchLength))
+                        return false;
+                    matchLength += MIN_MATCH;
+                    if (!offset || offset > decWindow.size() || decWindow.size() - base + matchLength > raw)
+                        return false;
+                    // Byte by byte, a match may overlap what it produces
+                    size_t from = decWindow.size() - offset;
+                    for (size_t i = 0; i < matchLength; i++)
+                        decWindow.push_back(decWindow[from + i]);
+                }
+            }
+            else
+                return false;
+            if (decWindow.size() - base != raw)
+                return false;
+            out.insert(out.end(), decWindow.begin() + base, decWindow.end());
+            return true;
+        }
+    };
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include "loop.hpp"
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <vector>
+#include <new>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+/* ** Coroutines **
+ *  Sequential code on the event loop without a thread per task.
+ *     Task       fire and forget, starts right away and frees itself when it finishes
+ *     Async<T>   lazy result, `co_await f()` runs f and resumes the caller when it returns
+ *     Stream     co_await recv() / send() on a non-blocking fd, suspends on EAGAIN
+ *     Sleep      co_await Sleep(loop, ms)
+ *  Coroutine frames come from FramePool, a per thread free list per size class, so starting
+ *  a coroutine after warm-up doesn't allocate. Awaiters live inside the frames.
+ *
+ *  Everything here runs on the loop thread, handles are only resumed from it.
+ */
+namespace Api
+{
+    class FramePool
+    {
+    public:
+        static const size_t GRANULE = 64;
+        static const size_t CLASSES = 64; // Frames up to 4 KB are recycled
+
+        ~FramePool()
+        {
+            for (Node *&head : free)
+                while (head)
+                {
+                    Node *next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+        }
+
+        void *allocate(size_t size)
+        {
+            size_t c = (size + GRANULE - 1) / GRANULE;
+            if (c >= CLASSES)
+                return ::operator new(size);
+            if (Node *node = free[c])
+            {
+                free[c] = node->next;
+                return node;
+            }
+            return ::operator new(c * GRANULE);
+        }
+
+        void release(void *frame, size_t size)
+        {
+            size_t c = (size + GRANULE - 1) / GRANULE;
+            if (c >= CLASSES)
+                return ::operator delete(frame);
+            Node *node = (Node *)frame;
+            node->next = free[c];
+            free[c] = node;
+        }
+
+    private:
+        struct Node
+        {
+            Node *next;
+        };
+        Node *free[CLASSES] = {};
+    };
+
+    inline thread_local FramePool framePool;
+
+    struct PooledFrame
+    {
+        static void *operator new(size_t size) { return framePool.allocate(size); }
+        static void operator delete(void *frame, size_t size) { framePool.release(frame, size); }
+    };
+
+    struct Task
+    {
+        struct promise_type : PooledFrame
+        {
+            Task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    template <typename T>
+    class Async
+    {
+    public:
+        struct promise_type : PooledFrame
+        {
+            T value{};
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+
+            Async get_return_object() { return Async(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            struct Final
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> self) noexcept { return self.promise().continuation; }
+                void await_resume() noexcept {}
+            };
+            Final final_suspend() noexcept { return {}; }
+            void return_value(T result) { value = std::move(result); }
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        Async(Async &&other) : handle(std::exchange(other.handle, {})) {}
+        ~Async()
+        {
+            if (handle)
+                handle.destroy();
+        }
+
+        bool await_ready() { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+        {
+            handle.promise().continuation = caller;
+            return handle;
+        }
+        T await_resume() { return std::move(handle.promise().value); }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+        explicit Async(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    };
+
+    // An operation that waits for fd readiness, whoever owns the fd's Watch retries it
+    struct IoWait
+    {
+        std::coroutine_handle<> handle;
+        // Operations queued behind this one on the same fd
+        IoWait *next = nullptr;
+        // True once the operation finished, false to keep waiting
+        virtual bool attempt() = 0;
+        virtual void fail() = 0;
+        // Appends the bytes a write still has to write
+        virtual void unwritten(std::vector<char> &) const {}
+    };
+
+    // Retries the first waiting operation of slot, resumes it when it is done
+    inline bool io_progress(IoWait *&slot)
+    {
+        IoWait *wait = slot;
+        if (!wait || !wait->attempt())
+            return false;
+        slot = wait->next;
+        wait->handle.resume();
+        return true;
+    }
+
+    class Stream
+    {
+    public:
+        Stream(Loop &loop, int fd) : fd(fd), loop(loop)
+        {
+            watch.fd = fd;
+            watch.onEvents = [this](uint32_t)
+            {
+                if (io_progress(pending))
+                    update();
+            };
+        }
+        ~Stream()
+        {
+            if (added)
+                loop.remove(&watch);
+        }
+
+        // Reads up to length bytes, 0 at EOF, -1 on error or cancel()
+        auto recv(char *buf, size_t length) { return Op(this, buf, length, false); }
+        // Writes all length bytes, returns length, -1 on error or cancel()
+        auto send(const char *buf, size_t length) { return Op(this, (char *)buf, length, true); }
+
+        // Resumes a suspended operation with -1
+        void cancel()
+        {
+            IoWait *wait = pending;
+            if (!wait)
+                return;
+            pending = nullptr;
+            update();
+            wait->fail();
+            wait->handle.resume();
+        }
+
+        int fd;
+        // For a socket that stays blocking, every call passes MSG_DONTWAIT instead
+        bool dontwait = false;
+
+    private:
+        struct Op : IoWait
+        {
+            Stream *stream;
+            char *buf;
+            size_t length, done = 0;
+            bool write;
+            ssize_t result = 0;
+
+            Op(Stream *stream, char *buf, size_t length, bool write) : stream(stream), buf(buf), length(length), write(write) {}
+
+            bool attempt() override
+            {
+                while (true)
+                {
+                    ssize_t m;
+                    if (stream->dontwait)
+                        m = write ? ::send(stream->fd, buf + done, length - done, MSG_DONTWAIT | MSG_NOSIGNAL) : ::recv(stream->fd, buf, length, MSG_DONTWAIT);
+                    else
+                        m = write ? ::write(stream->fd, buf + done, length - done) : ::read(stream->fd, buf, length);
+                    if (m < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                            return false;
+                        result = -1;
+                        return true;
+                    }
+                    if (!write)
+                    {
+                        result = m;
+                        return true;
+                    }
+                    done += m;
+                    if (done == length)
+                    {
+                        result = length;
+                        return true;
+                    }
+                }
+            }
+            void fail() override { result = -1; }
+
+            bool await_ready() { return attempt(); }
+            void await_suspend(std::coroutine_handle<> caller)
+            {
+                handle = caller;
+                stream->pending = this;
+                stream->update();
+            }
+            ssize_t await_resume() { return result; }
+        };
+
+        Loop &loop;
+        Watch watch;
+        IoWait *pending = nullptr;
+        bool added = false;
+        bool pollable = true;
+
+        void update()
+        {
+            if (!added && pollable)
+            { // epoll refuses regular files, they never return EAGAIN so nothing waits on them
+                struct stat st;
+                pollable = fstat(fd, &st) < 0 || !S_ISREG(st.st_mode);
+            }
+            if (!pollable)
+                return;
+            uint32_t events = 0;
+            if (pending)
+                events = ((Op *)pending)->write ? EPOLLOUT : EPOLLIN;
+            if (!added)
+                added = loop.add(&watch, events);
+            else
+                loop.modify(&watch, events);
+        }
+    };
+
+    // co_await Sleep(loop, ms)
+    struct Sleep
+    {
+        Loop &loop;
+        uint64_t ms;
+        Timer timer;
+
+        Sleep(Loop &loop, uint64_t ms) : loop(loop), ms(ms) {}
+        bool await_ready() { return ms == 0; }
+        void await_suspend(std::coroutine_handle<> caller)
+        {
+            timer.callback = [caller]
+            { caller.resume(); };
+            loop.arm(&timer, ms);
+        }
+        void await_resume() {}
+    };
+}
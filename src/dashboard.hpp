@@ -0,0 +1,258 @@
+#pragma once
+#include <ncurses.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <fmt/core.h>
+#include "stats.hpp"
+
+/* ** Connection dashboard **
+ *  The Gui side panel as a table of the daemon's connections, fed by STATS frames.
+ *  A frame only updates rows, drawing happens at most every DRAW_INTERVAL ms from the Gui
+ *  loop, so a burst of frames costs one redraw and keystrokes never wait behind it.
+ *
+ *  Only the rows that fit are sorted and formatted, and every cell is compared with what was
+ *  drawn there before, so a redraw writes the cells that changed and nothing else. Columns
+ *  are dropped from the right when the panel is too narrow for them.
+ */
+namespace funny
+{
+    class Dashboard
+    {
+    public:
+        enum Column
+        {
+            ID,
+            STATE,
+            IN_RATE,
+            OUT_RATE,
+            QUEUED,
+            IN,
+            OUT,
+            PEER,
+            // Raw bytes per socket byte sent, of a compressed connection
+            RATIO,
+            COLUMNS
+        };
+
+        static const int DRAW_INTERVAL = 100;
+        static constexpr const char *TITLES[COLUMNS] = {"id", "st", "in/s", "out/s", "queue", "in", "out", "peer", "zip"};
+        static constexpr int WIDTHS[COLUMNS] = {3, 4, 6, 6, 6, 6, 6, 21, 5};
+
+        Column sortColumn = ID;
+        bool descending = false;
+
+        // Takes the message of a STATS frame
+        void apply(const char *message, size_t length)
+        {
+            if (length < Api::STATS_HEADER)
+                return;
+            uint64_t clock;
+            memcpy(&clock, message, sizeof(clock));
+            std::array<bool, 256> seen = {};
+            for (size_t at = Api::STATS_HEADER; at + sizeof(Api::StatsRecord) <= length; at += sizeof(Api::StatsRecord))
+            {
+                Api::StatsRecord record;
+                memcpy(&record, message + at, sizeof(record));
+                Row &row = rows[record.id];
+                seen[record.id] = true;
+                if (record.state == Api::CLOSED)
+                {
+                    row.live = false;
+                    continue;
+                }
+                // A connection seen for the first time, or a new one on a reused id, has no rate yet
+                bool known = row.live && record.bytesIn >= row.record.bytesIn && record.bytesOut >= row.record.bytesOut && clock > row.clock;
+                row.inRate = known ? (record.bytesIn - row.record.bytesIn) * 1000.0 / (clock - row.clock) : 0;
+                row.outRate = known ? (record.bytesOut - row.record.bytesOut) * 1000.0 / (clock - row.clock) : 0;
+                row.record = record;
+                row.clock = clock;
+                row.live = true;
+            }
+            // Unchanged since the last frame, nothing moved
+            for (int id = 0; id < 256; id++)
+                if (!seen[id])
+                    rows[id].inRate = rows[id].outRate = 0;
+            dirty = true;
+        }
+
+        void sort_by(Column column)
+        {
+            descending = column == sortColumn ? !descending : (column >= IN_RATE && column <= OUT) || column == RATIO;
+            sortColumn = column;
+            dirty = true;
+        }
+
+        void next_sort() { sort_by((Column)((sortColumn + 1) % COLUMNS)); }
+
+        // The next draw writes every cell
+        void invalidate()
+        {
+            drawn.clear();
+            dirty = true;
+        }
+
+        // ms until draw is due, -1 if nothing changed
+        long due_in() const
+        {
+            if (!dirty)
+                return -1;
+            return std::max(0L, DRAW_INTERVAL - (long)(now_ms() - lastDraw));
+        }
+
+        void draw(WINDOW *win)
+        {
+            int height = getmaxy(win) - 2, width = getmaxx(win) - 2;
+            if (height < 1 || width < WIDTHS[ID])
+                return;
+            if ((int)drawn.size() != height || drawnWidth != width)
+            {
+                werase(win);
+                box(win, 0, 0);
+                drawn.assign(height, std::vector<std::string>(COLUMNS));
+                drawnWidth = width;
+                drawnTitle.clear();
+            }
+            int columns = 0, used = 0;
+            while (columns < COLUMNS && used + WIDTHS[columns] <= width)
+                used += WIDTHS[columns++] + 1;
+
+            std::vector<const Row *> live;
+            for (const Row &row : rows)
+                if (row.live)
+                    live.push_back(&row);
+            size_t shown = std::min<size_t>(live.size(), height - 1);
+            // Ties keep id order, so rows don't swap places between draws
+            std::partial_sort(live.begin(), live.begin() + shown, live.end(), [this](const Row *a, const Row *b)
+                              {
+                                  if (less(*a, *b) || less(*b, *a))
+                                      return descending ? less(*b, *a) : less(*a, *b);
+                                  return a->record.id < b->record.id; });
+
+            std::string title = fmt::format(" connections {} ", live.size());
+            if (title != drawnTitle)
+            {
+                mvwhline(win, 0, 1, ACS_HLINE, width);
+                mvwaddnstr(win, 0, 2, title.c_str(), width - 2);
+                drawnTitle = title;
+            }
+            for (int line = 0; line < height; line++)
+                for (int column = 0, x = 1; column < columns; x += WIDTHS[column++] + 1)
+                {
+                    std::string cell;
+                    if (line == 0)
+                        cell = fmt::format("{}{}", TITLES[column], column == sortColumn ? (descending ? "v" : "^") : "");
+                    else if ((size_t)line <= shown)
+                        cell = format(*live[line - 1], (Column)column);
+                    cell.resize(WIDTHS[column], ' ');
+                    if (cell == drawn[line][column])
+                        continue;
+                    drawn[line][column] = cell;
+                    mvwaddnstr(win, line + 1, x, cell.c_str(), WIDTHS[column]);
+                }
+            wnoutrefresh(win);
+            lastDraw = now_ms();
+            dirty = false;
+        }
+
+    private:
+        struct Row
+        {
+            Api::StatsRecord record = {};
+            uint64_t clock = 0;
+            double inRate = 0, outRate = 0;
+            bool live = false;
+        };
+        std::array<Row, 256> rows;
+        // The text of every cell on screen, header first
+        std::vector<std::vector<std::string>> drawn;
+        std::string drawnTitle;
+        int drawnWidth = 0;
+        bool dirty = false;
+        uint64_t lastDraw = 0;
+
+        static uint64_t now_ms()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+        }
+
+        // Fits bytes into 6 characters, up to 999 as they are, then 1.0K to 999.9K, 1.0M and so on
+        static std::string human(double bytes)
+        {
+            const char *units = " KMGT";
+            int unit = 0;
+            while (bytes >= 1000 && unit < 4)
+            {
+                bytes /= 1024;
+                unit++;
+            }
+            return unit ? fmt::format("{:.1f}{}", bytes, units[unit]) : fmt::format("{}", (uint64_t)bytes);
+        }
+
+        static double ratio(const Row &row) { return row.record.wireOut ? (double)row.record.rawOut / row.record.wireOut : 0; }
+
+        bool less(const Row &a, const Row &b) const
+        {
+            switch (sortColumn)
+            {
+            case STATE:
+                return a.record.state < b.record.state;
+            case IN_RATE:
+                return a.inRate < b.inRate;
+            case OUT_RATE:
+                return a.outRate < b.outRate;
+            case QUEUED:
+                return a.record.queued < b.record.queued;
+            case IN:
+                return a.record.bytesIn < b.record.bytesIn;
+            case OUT:
+                return a.record.bytesOut < b.record.bytesOut;
+            case PEER:
+                return std::make_pair(ntohl(a.record.ip), a.record.port) < std::make_pair(ntohl(b.record.ip), b.record.port);
+            case RATIO:
+                return ratio(a) < ratio(b);
+            default:
+                return a.record.id < b.record.id;
+            }
+        }
+
+        static std::string format(const Row &row, Column column)
+        {
+            const char *states[] = {"conn", "wait", "open", "gone"};
+            switch (column)
+            {
+            case ID:
+                return fmt::format("{}", row.record.id);
+            case STATE:
+                return states[std::min<int>(row.record.state, Api::CLOSED)];
+            case IN_RATE:
+                return human(row.inRate);
+            case OUT_RATE:
+                return human(row.outRate);
+            case QUEUED:
+                return human(row.record.queued);
+            case IN:
+                return human(row.record.bytesIn);
+            case OUT:
+                return human(row.record.bytesOut);
+            case PEER:
+            {
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &row.record.ip, ip, sizeof(ip));
+                return fmt::format("{}:{}", ip, row.record.port);
+            }
+            case RATIO:
+                return row.record.wireOut ? fmt::format("{:.1f}", ratio(row)) : "-";
+            default:
+                return "";
+            }
+        }
+    };
+}
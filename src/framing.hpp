@@ -0,0 +1,261 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* ** Peer message framing **
+ *  Splits the byte stream of a peer into whole messages before they become api frames.
+ *     RAW         every read is forwarded as is (the old behaviour)
+ *     NEWLINE     messages end with '\n', the delimiter is stripped
+ *     LENGTH_U16  big endian u16 length prefix, the prefix is stripped
+ *     LENGTH_U32  big endian u32 length prefix, the prefix is stripped
+ *     FIXED       every `size` bytes are one message
+ *  A message that can't fit into MAX_MESSAGE_LENGTH is a framing error.
+ *
+ *  Newline search is vectorised with AVX2 or SSE2, picked once at runtime.
+ */
+namespace Api
+{
+    enum FramingMode : uint8_t
+    {
+        RAW,
+        NEWLINE,
+        LENGTH_U16,
+        LENGTH_U32,
+        FIXED
+    };
+
+    namespace simd
+    {
+        inline const char *find_byte_scalar(const char *p, const char *end, char c)
+        {
+            const void *r = memchr(p, c, end - p);
+            return r ? (const char *)r : end;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        __attribute__((target("sse2"))) inline const char *find_byte_sse2(const char *p, const char *end, char c)
+        {
+            __m128i needle = _mm_set1_epi8(c);
+            for (; end - p >= 16; p += 16)
+            {
+                int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+            return find_byte_scalar(p, end, c);
+        }
+
+        __attribute__((target("avx2"))) inline const char *find_byte_avx2(const char *p, const char *end, char c)
+        {
+            __m256i needle = _mm256_set1_epi8(c);
+            for (; end - p >= 64; p += 64)
+            { // Two vectors per iteration, one branch for both
+                __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle);
+                __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), needle);
+                uint64_t mask = (uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+                if (mask)
+                    return p + __builtin_ctzll(mask);
+            }
+            for (; end - p >= 32; p += 32)
+            {
+                int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle));
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+            return find_byte_sse2(p, end, c);
+        }
+#endif
+
+        using FindByte = const char *(*)(const char *, const char *, char);
+
+        inline FindByte pick_find_byte()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return find_byte_avx2;
+            if (__builtin_cpu_supports("sse2"))
+                return find_byte_sse2;
+#endif
+            return find_byte_scalar;
+        }
+
+        // Returns end if c is not found
+        inline const char *find_byte(const char *p, const char *end, char c)
+        {
+            static const FindByte impl = pick_find_byte();
+            return impl(p, end, c);
+        }
+    }
+
+    class Framer
+    {
+    public:
+        FramingMode mode = RAW;
+        uint32_t size = 0;
+
+        Framer() = default;
+        Framer(FramingMode mode, uint32_t size) : mode(mode), size(size) {}
+
+        // Calls emit(message, length) for every complete message, returns false on a framing error
+        template <typename Func>
+        bool feed(const char *data, size_t length, uint32_t maxMessage, Func emit)
+        {
+            if (mode == RAW)
+            {
+                emit(data, length);
+                return true;
+            }
+            // Only the incomplete tail of a read is ever copied: the message it starts is completed
+            // from the front of data, the rest of data is scanned where it is
+            if (!pending.empty())
+            {
+                size_t used = 0;
+                while (size_t lacking = missing(maxMessage))
+                {
+                    if (lacking == SIZE_MAX)
+                        return false;
+                    if (used == length)
+                        return pending.size() <= maxMessage + 4;
+                    size_t take = std::min(lacking, length - used);
+                    if (mode == NEWLINE)
+                        take = std::min<size_t>(simd::find_byte(data + used, data + length, '\n') - (data + used) + 1, length - used);
+                    pending.insert(pending.end(), data + used, data + used + take);
+                    used += take;
+                }
+                std::vector<char> work;
+                work.swap(pending);
+                if (!scan(work.data(), work.size(), maxMessage, emit))
+                    return false;
+                data += used;
+                length -= used;
+            }
+            return scan(data, length, maxMessage, emit);
+        }
+
+        size_t buffered() const { return pending.size(); }
+
+        // The incomplete tail, for handing a connection to another process
+        const std::vector<char> &buffered_bytes() const { return pending; }
+        void restore(const char *data, size_t length) { pending.assign(data, data + length); }
+
+    private:
+        std::vector<char> pending;
+
+        // Bytes the first message in pending lacks as far as pending tells, 0 once it is
+        // complete and SIZE_MAX if it can't be framed
+        size_t missing(uint32_t maxMessage) const
+        {
+            switch (mode)
+            {
+            case NEWLINE:
+                return pending.back() == '\n' ? 0 : 1;
+            case LENGTH_U16:
+            case LENGTH_U32:
+            {
+                size_t prefix = mode == LENGTH_U16 ? 2 : 4;
+                if (pending.size() < prefix)
+                    return prefix - pending.size();
+                size_t messageLength;
+                if (mode == LENGTH_U16)
+                {
+                    uint16_t n;
+                    memcpy(&n, pending.data(), 2);
+                    messageLength = ntohs(n);
+                }
+                else
+                {
+                    uint32_t n;
+                    memcpy(&n, pending.data(), 4);
+                    messageLength = ntohl(n);
+                }
+                if (messageLength > maxMessage)
+                    return SIZE_MAX;
+                return prefix + messageLength > pending.size() ? prefix + messageLength - pending.size() : 0;
+            }
+            case FIXED:
+                if (size == 0 || size > maxMessage)
+                    return SIZE_MAX;
+                return size > pending.size() ? size - pending.size() : 0;
+            default:
+                return SIZE_MAX;
+            }
+        }
+
+        template <typename Func>
+        bool scan(const char *data, size_t length, uint32_t maxMessage, Func emit)
+        {
+            const char *p = data, *end = data + length;
+            while (p < end)
+            {
+                const char *message = p;
+                size_t messageLength;
+                switch (mode)
+                {
+                case NEWLINE:
+                {
+                    const char *nl = simd::find_byte(p, end, '\n');
+                    if (nl == end)
+                        goto incomplete;
+                    messageLength = nl - p;
+                    p = nl + 1;
+                    break;
+                }
+                case LENGTH_U16:
+                case LENGTH_U32:
+                {
+                    size_t prefix = mode == LENGTH_U16 ? 2 : 4;
+                    if ((size_t)(end - p) < prefix)
+                        goto incomplete;
+                    if (mode == LENGTH_U16)
+                    {
+                        uint16_t n;
+                        memcpy(&n, p, 2);
+                        messageLength = ntohs(n);
+                    }
+                    else
+                    {
+                        uint32_t n;
+                        memcpy(&n, p, 4);
+                        messageLength = ntohl(n);
+                    }
+                    if (messageLength > maxMessage)
+                        return false;
+                    if ((size_t)(end - p) < prefix + messageLength)
+                        goto incomplete;
+                    message = p + prefix;
+                    p = message + messageLength;
+                    break;
+                }
+                case FIXED:
+                    if (size == 0 || size > maxMessage)
+                        return false;
+                    if ((size_t)(end - p) < size)
+                        goto incomplete;
+                    messageLength = size;
+                    p += size;
+                    break;
+                default:
+                    return false;
+                }
+                if (messageLength > maxMessage)
+                    return false;
+                emit(message, messageLength);
+                continue;
+            incomplete:
+                if ((size_t)(end - p) > maxMessage + 4)
+                    return false;
+                pending.assign(p, end);
+                return true;
+            }
+            return true;
+        }
+    };
+}
@@ -0,0 +1,1357 @@
+#include "main.hpp"
+#include "handoff.hpp"
+#include "cluster.hpp"
+#include "funny.h"
+#include <algorithm>
+#include <ranges>
+#include <thread>
+#include <getopt.h>
+#include <signal.h>
+
+namespace Api
+{
+    // Outbound connect, completed on the loop thread
+    void connection_dial(const std::string &host, int port, struct in_addr ip, int home)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr = ip;
+
+        std::shared_ptr<Connection> connection = connection_new(host, port);
+        connection->home = home;
+        MagicType id = connection_register(connection);
+        if (id == MAX_CONNECTIONS)
+        {
+            api_connect_failed(CONNECTION_LIMIT, host, port, home);
+            return;
+        }
+        std::string target = fmt::format("{}:{}", host, port);
+        capture.record(Capture::SOCKET_DIAL, id, target.data(), target.size());
+        connection->peer = target;
+        connection->setAccepted();
+        connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        connection->watch.fd = connection->fd;
+        if (connection->fd >= 0)
+            loop.poller.tune_socket(connection->fd);
+        if (connection->fd < 0 ||
+            (connect(connection->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS))
+        {
+            loop.post([connection]
+                      { connection_close(connection, CONNECT_REFUSED); });
+            return;
+        }
+
+        connection_await_connect(connection);
+    }
+
+    // Never blocks the loop, names are resolved through the resolver cache
+    void connection_connect(const std::string &host, int port, int home = LOCAL_HOME)
+    {
+        resolver.resolve(host, [host, port, home](bool ok, struct in_addr ip)
+                         {
+                             // Answers from the resolver thread continue on the loop, where controllers expect them
+                             auto dial = [host, port, home, ok, ip]
+                             {
+                                 if (ok)
+                                     connection_dial(host, port, ip, home);
+                                 else
+                                     api_connect_failed(RESOLVE_FAILED, host, port, home);
+                             };
+                             if (loop.in_loop())
+                                 dial();
+                             else
+                                 loop.post(dial); });
+    }
+
+    Cluster cluster(loop, resolver);
+
+    // Dials here or on the cluster node the target is placed on, commands from other nodes were placed already
+    void connection_place(const std::string &host, int port, int home)
+    {
+        if (cluster.enabled() && home == LOCAL_HOME)
+        {
+            std::string address = fmt::format("{}:{}", host, port);
+            int owner = cluster.live.lookup(Ring::hash(address));
+            if (owner != cluster.self)
+            {
+                std::vector<char> frame = make_buffer(Magic::CONNECT, address.data(), address.size());
+                cluster.send(owner, Cluster::COMMANDS, frame.data(), frame.size());
+                return;
+            }
+        }
+        connection_connect(host, port, home);
+    }
+
+    // The node owning the connection a controller frame is for, LOCAL_HOME if it is handled here
+    int cluster_route(const Frame &frame)
+    {
+        if (!cluster.enabled())
+            return LOCAL_HOME;
+        int connId = MAX_CONNECTIONS;
+        if (frame.magic < MAX_CONNECTIONS)
+            connId = frame.magic;
+        else if (frame.magic == Magic::DISCONNECT || frame.magic == Magic::ACCEPT_CONNECT)
+            connId = (MagicType)frame.length;
+        else if (frame.magic == Magic::SET_WEIGHT)
+            connId = frame.length & 0xFF;
+        else if ((frame.magic == Magic::SET_FRAMING || frame.magic == Magic::SUBSCRIBE || frame.magic == Magic::UNSUBSCRIBE ||
+                  frame.magic == Magic::SET_CORK || frame.magic == Magic::SET_COMPRESSION || frame.magic == Magic::MULTIPLEX ||
+                  frame.magic == Magic::SESSION || frame.magic == Magic::SET_PEER) &&
+                 frame.length > 0)
+            connId = (MagicType)frame.message[0];
+        if (connId >= MAX_CONNECTIONS)
+            return LOCAL_HOME;
+        char key = connId;
+        int owner = cluster.fixed.lookup(Ring::hash(&key, 1));
+        return owner == cluster.self ? LOCAL_HOME : owner;
+    }
+
+    // Sends a controller frame as is to the node that handles it
+    void cluster_forward(int node, const Frame &frame)
+    {
+        char prefix[PREFIX_SIZE];
+        memcpy(prefix, &frame.magic, MAGIC_TYPE_SIZE);
+        memcpy(prefix + MAGIC_TYPE_SIZE, &frame.length, MESSAGE_LENGTH_TYPE_SIZE);
+        cluster.send(node, Cluster::COMMANDS, prefix, PREFIX_SIZE, frame.message, api_in_special(frame.magic) ? 0 : frame.length);
+    }
+
+    // [u8 host length][host][u16 port] entries
+    void connect_many(const char *message, MessageLengthType length, int home)
+    {
+        const char *iter = message, *end = message + length;
+        while (iter < end)
+        {
+            unsigned char hostLength = *iter++;
+            if (end - iter < hostLength + 2)
+            {
+                log_error("  Truncated CONNECT_MANY entry");
+                return;
+            }
+            std::string host(iter, hostLength);
+            iter += hostLength;
+            unsigned short port;
+            memcpy(&port, iter, sizeof(port));
+            iter += sizeof(port);
+            connection_place(host, port, home);
+        }
+    }
+
+    // Every controller frame but peer messages, home is where the connection reports to once accepted
+    void api_command(const Frame &frame, int home)
+    {
+        MessageLengthType messageLength = frame.length;
+        const char *messageBuffer = frame.message;
+        MagicType connId;
+        std::shared_ptr<Connection> connection;
+        switch (frame.magic)
+        {
+        case Magic::CONNECT:
+        {
+            std::string address(messageBuffer, messageLength);
+            char *host = strtok(address.data(), ":");
+            char *portText = host ? strtok(NULL, ":") : NULL;
+            if (!portText)
+            {
+                log_error("  Invalid CONNECT address");
+                break;
+            }
+            connection_place(host, atoi(portText), home);
+            break;
+        }
+        case Magic::CONNECT_MANY:
+        {
+            connect_many(messageBuffer, messageLength, home);
+            break;
+        }
+        case Magic::SET_FRAMING:
+        {
+            uint32_t size = 0;
+            if (messageLength < 2 + sizeof(size))
+            {
+                log_error("  Truncated SET_FRAMING");
+                break;
+            }
+            connId = messageBuffer[0];
+            Framer framer((FramingMode)messageBuffer[1], 0);
+            memcpy(&framer.size, messageBuffer + 2, sizeof(size));
+            connection = connection_get(connId);
+            if (!connection || framer.mode > FIXED)
+            {
+                log_error("  Invalid SET_FRAMING for connection {}", connId);
+                break;
+            }
+            // The tail of the old framing is no message of the new one
+            connection->framer = framer;
+            break;
+        }
+        case Magic::SET_CORK:
+        {
+            uint32_t bytes, delay;
+            if (messageLength < 1 + sizeof(bytes) + sizeof(delay))
+            {
+                log_error("  Truncated SET_CORK");
+                break;
+            }
+            connId = messageBuffer[0];
+            memcpy(&bytes, messageBuffer + 1, sizeof(bytes));
+            memcpy(&delay, messageBuffer + 1 + sizeof(bytes), sizeof(delay));
+            connection = connection_get(connId);
+            if (!connection || connection->datagram || connection->channel)
+            {
+                log_error("  Invalid SET_CORK for connection {}", connId);
+                break;
+            }
+            connection_set_cork(connection, bytes, delay);
+            break;
+        }
+        case Magic::SET_COMPRESSION:
+        {
+            connId = messageLength ? messageBuffer[0] : (MagicType)MAX_CONNECTIONS;
+            connection = connection_get(connId);
+            if (!connection || connection->datagram || connection->channel || connection->session || messageLength < 2 || (unsigned char)messageBuffer[1] > 1)
+            {
+                log_error("  Invalid SET_COMPRESSION for connection {}", connId);
+                break;
+            }
+            connection_set_compression(connection, messageBuffer[1]);
+            break;
+        }
+        case Magic::MULTIPLEX:
+        {
+            connId = messageLength ? messageBuffer[0] : (MagicType)MAX_CONNECTIONS;
+            connection = connection_get(connId);
+            char op = messageLength >= 2 ? messageBuffer[1] : 0;
+            if (!connection || connection->datagram || connection->channel || connection->session || (op != 1 && op != 2) || (op == 2 && !connection->mux))
+            {
+                log_error("  Invalid MULTIPLEX for connection {}", connId);
+                break;
+            }
+            if (op == 1)
+                carrier_start(connection);
+            else if (uint16_t number = connection->mux->allocate())
+            {
+                if (std::shared_ptr<Connection> channel = channel_open(connection, number, home))
+                    api_create_connect(channel->getId(), home);
+            }
+            else
+                log_error("  No free channel on connection {}", connId);
+            break;
+        }
+        case Magic::SESSION:
+        {
+            connId = messageLength ? messageBuffer[0] : (MagicType)MAX_CONNECTIONS;
+            connection = connection_get(connId);
+            // A session resumes the plain stream of its own socket
+            if (!connection || connection->datagram || connection->channel || connection->codec || connection->mux || messageLength < 2 || (unsigned char)messageBuffer[1] > 1)
+            {
+                log_error("  Invalid SESSION for connection {}", connId);
+                break;
+            }
+            session_set(connection, messageBuffer[1]);
+            break;
+        }
+        case Magic::SET_PEER:
+        {
+            connId = messageLength ? messageBuffer[0] : (MagicType)MAX_CONNECTIONS;
+            connection = connection_get(connId);
+            if (!connection || connection->datagram)
+            {
+                log_error("  Invalid SET_PEER for connection {}", connId);
+                break;
+            }
+            connection_set_peer(connection, std::string(messageBuffer + 1, messageLength - 1));
+            break;
+        }
+        case Magic::DISCONNECT:
+        {
+            connId = (MagicType)messageLength;
+            if (!connection_get(connId))
+            {
+                log_error("  Connection {} is invalid", connId);
+                break;
+            }
+            connection_destroy_by_id(connId, CONTROLLER);
+            break;
+        }
+        case Magic::ACCEPT_CONNECT: // Need this to accept incoming messages
+        {
+            connId = (MagicType)messageLength;
+            connection = connection_get(connId);
+            if (!connection)
+            {
+                log_error("  Connection {} is invalid", connId);
+                break;
+            }
+            if (connection->isAccepted())
+            {
+                log_error("  Connection {} was already accepted", connId);
+                break;
+            }
+            connection->home = home;
+            connection_accept(connection);
+            break;
+        }
+        case Magic::SET_WEIGHT:
+        {
+            connId = messageLength & 0xFF;
+            if (connId >= MAX_CONNECTIONS)
+            {
+                log_error("  Connection {} is invalid", connId);
+                break;
+            }
+            output.set_weight(connId, messageLength >> 8);
+            break;
+        }
+        case Magic::SUBSCRIBE:
+        case Magic::UNSUBSCRIBE:
+        {
+            connId = messageLength ? messageBuffer[0] : (MagicType)MAX_CONNECTIONS;
+            if (!connection_get(connId))
+            {
+                log_error("  Connection {} is invalid", connId);
+                break;
+            }
+            std::string_view pattern(messageBuffer + 1, messageLength - 1);
+            if (frame.magic == Magic::SUBSCRIBE)
+                topics.subscribe(connId, pattern);
+            else
+                topics.unsubscribe(connId, pattern);
+            break;
+        }
+        case Magic::PUBLISH:
+        {
+            unsigned char topicLength = messageLength ? messageBuffer[0] : 0;
+            if (messageLength < 1 + topicLength)
+            {
+                log_error("  Truncated PUBLISH");
+                break;
+            }
+            connection_publish(std::string_view(messageBuffer + 1, topicLength), messageBuffer + 1 + topicLength, messageLength - 1 - topicLength);
+            break;
+        }
+        default:
+        {
+            // Client should not send log messages
+            break;
+        }
+        }
+    }
+
+    // Peer message from the controller, nullptr if the connection can't take it
+    std::shared_ptr<Connection> api_message_target(const Frame &frame)
+    {
+        MagicType connId = frame.magic;
+        std::shared_ptr<Connection> connection = connection_get(connId);
+        if (!connection)
+        {
+            // A peer that went away gets it when it is back
+            if (!connection_keep_for_peer(connId, frame.message, frame.length))
+                log_error("  Connection {} is invalid", connId);
+        }
+        else if (!connection->isAccepted())
+            log_error("  Connection {} is not accepted", connId);
+        else
+            return connection;
+        return nullptr;
+    }
+
+    // Runs on the loop until the controller goes away or the channel is cancelled, then calls done
+    Task start_api(std::function<void()> done)
+    {
+        Frame frame;
+        while (co_await apiChannel.next_frame(frame))
+        {
+            int owner = cluster_route(frame);
+            if (owner != LOCAL_HOME)
+            { // The connection lives on another node, the frame goes there as is
+                cluster_forward(owner, frame);
+                continue;
+            }
+            if (frame.magic == Magic::PUBLISH && cluster.enabled())
+                // Subscribers may be on every node
+                for (int node = 0; node < cluster.size(); node++)
+                    if (node != cluster.self && cluster.up(node))
+                        cluster_forward(node, frame);
+            if (frame.magic >= MAX_CONNECTIONS)
+            {
+                api_command(frame, LOCAL_HOME);
+                continue;
+            }
+            // Send message to one of connected sockets
+            std::shared_ptr<Connection> connection;
+            {
+                TraceSpan span("id lookup", frame.magic, frame.trace);
+                connection = api_message_target(frame);
+            }
+            if (connection)
+            {
+                TraceSpan span("send", frame.magic, frame.trace);
+                std::vector<char> corked;
+                // Suspends the control channel while the peer doesn't take the bytes
+                if (!connection->corkBytes)
+                    co_await connection_send(connection, frame.message, frame.length);
+                else if (connection_cork(connection, frame.message, frame.length, corked))
+                    co_await connection_send(connection, corked.data(), corked.size());
+            }
+        }
+        done();
+    }
+
+    // Frames another node's controller wrote for connections owned here, or this node's controller is due
+    void cluster_on_record(int from, Cluster::Kind kind, const char *frames, size_t length)
+    {
+        const char *iter = frames, *end = frames + length;
+        // Events go out in runs of one magic, the way they were batched on the other node
+        const char *run = iter;
+        auto flush_run = [&]
+        {
+            if (kind == Cluster::EVENTS && run < iter)
+                api_out(std::vector<char>(run, iter));
+            run = iter;
+        };
+        while (end - iter >= PREFIX_SIZE)
+        {
+            Frame frame;
+            memcpy(&frame.magic, iter, MAGIC_TYPE_SIZE);
+            memcpy(&frame.length, iter + MAGIC_TYPE_SIZE, MESSAGE_LENGTH_TYPE_SIZE);
+            frame.message = iter + PREFIX_SIZE;
+            bool special = kind == Cluster::COMMANDS ? api_in_special(frame.magic) : api_out_special(frame.magic);
+            size_t size = PREFIX_SIZE + (special ? 0 : frame.length);
+            if ((size_t)(end - iter) < size)
+            {
+                log_error("  Truncated cluster record from {}", cluster.name(from));
+                break;
+            }
+            if (kind == Cluster::EVENTS)
+            {
+                if (run < iter && (MagicType)*run != frame.magic)
+                    flush_run();
+            }
+            else if (frame.magic >= MAX_CONNECTIONS)
+                api_command(frame, from);
+            else if (std::shared_ptr<Connection> connection = api_message_target(frame))
+                connection_send_now(connection, frame.message, frame.length);
+            iter += size;
+        }
+        flush_run();
+    }
+
+    // nodeList and name as given with --cluster and --node, false if they don't fit
+    bool cluster_configure(const std::string &nodeList, const std::string &name)
+    {
+        if (!cluster.configure(nodeList, name))
+            return false;
+        for (int id = 0; id < MAX_CONNECTIONS; id++)
+        {
+            char key = id;
+            foreignIds[id] = cluster.fixed.lookup(Ring::hash(&key, 1)) != cluster.self;
+        }
+        cluster.onRecord = cluster_on_record;
+        cluster.onLink = [](int node, bool up)
+        {
+            log_info("Cluster node {} {}", cluster.name(node), up ? "joined" : "left");
+            if (up)
+                return;
+            // Connections claimed by the controller of a node that left go with it
+            std::vector<std::shared_ptr<Connection>> orphans;
+            connectionsLock.lock();
+            for (auto &connection : connections)
+                if (connection && connection->home == node)
+                    orphans.push_back(connection);
+            connectionsLock.unlock();
+            for (auto &connection : orphans)
+                connection_close(connection, CONTROLLER);
+        };
+        cluster.onFull = [](int node, bool full, uint64_t dropped)
+        {
+            if (full)
+                log_error("  Cluster link to {} holds {} bytes, frames for it are dropped", cluster.name(node), (size_t)Cluster::MAX_LINK_BYTES);
+            else
+                log_info("Cluster link to {} drained, {} frames were dropped", cluster.name(node), dropped);
+        };
+        api_forward = [](int home, std::vector<char> buf)
+        {
+            cluster.send(home, Cluster::EVENTS, buf.data(), buf.size());
+            return (int)buf.size();
+        };
+        return true;
+    }
+
+    // Resets a peer right away instead of a FIN after whatever it sent
+    void reject_fast(int fd)
+    {
+        struct linger reset = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+
+    void on_new_connection(int listenFd)
+    {
+        // Bounded like reads, a flood of peers can't keep the loop in accept
+        for (int i = 0; i < admission.read_budget() * 4 && !admission.accept_paused(); i++)
+        {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept4(listenFd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            if (admission.rejecting())
+            {
+                reject_fast(fd);
+                close(fd);
+                continue;
+            }
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+            std::shared_ptr<Connection> connection = connection_new(ip, ntohs(addr.sin_port));
+            connection->fd = fd;
+            connection->watch.fd = fd;
+            loop.poller.tune_socket(fd);
+            MagicType id = connection_register(connection);
+            if (id == MAX_CONNECTIONS)
+            {
+                log_error("  Connection limit reached ({}), rejecting {}:{}", (int)MAX_CONNECTIONS, ip, connection->port);
+                reject_fast(fd);
+                continue;
+            }
+            std::string peer = fmt::format("{}:{}", ip, connection->port);
+            capture.record(Capture::SOCKET_OPEN, id, peer.data(), peer.size());
+            connection_start(connection);
+            api_req_connect(id);
+        }
+    }
+
+    // Returns the listening socket, -1 if port can't be bound
+    int listen_on(int port)
+    {
+        // Initialize server socket..
+        int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int yes = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        // Bind the server to a port.
+        if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            log_info("Binding failed: {} : {}", errno, strerror(errno));
+            close(listenFd);
+            return -1;
+        }
+
+        // Start Listening the server.
+        if (listen(listenFd, SOMAXCONN) < 0)
+        {
+            log_info("Listening failed: {} : {}", errno, strerror(errno));
+            close(listenFd);
+            return -1;
+        }
+        return listenFd;
+    }
+
+    // A link on the resume port until its RESUME record is complete
+    struct ResumeAttempt
+    {
+        int fd;
+        struct sockaddr_in addr;
+        char record[Session::HEADER + Session::TOKEN];
+        size_t fill = 0;
+        Watch watch;
+        Timer timer;
+    };
+    const uint64_t RESUME_TIMEOUT = 5000;
+    std::unordered_map<int, std::shared_ptr<ResumeAttempt>> resumeAttempts;
+    Watch resumeWatch;
+
+    // Loop thread only, the fd is the caller's again
+    void resume_forget(int fd)
+    {
+        auto found = resumeAttempts.find(fd);
+        std::shared_ptr<ResumeAttempt> attempt = found->second;
+        resumeAttempts.erase(found);
+        loop.remove(&attempt->watch);
+        loop.cancel(&attempt->timer);
+        // Keep the object alive until the current epoll batch is dispatched
+        loop.post([attempt] {});
+    }
+
+    void resume_reject(int fd)
+    {
+        resume_forget(fd);
+        reject_fast(fd);
+        close(fd);
+    }
+
+    void resume_read(int fd)
+    {
+        ResumeAttempt &attempt = *resumeAttempts[fd];
+        // The record and nothing more, what follows it is the session's
+        ssize_t m = recv(fd, attempt.record + attempt.fill, sizeof(attempt.record) - attempt.fill, 0);
+        if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (m <= 0)
+            return resume_reject(fd);
+        attempt.fill += m;
+        if (attempt.fill < sizeof(attempt.record))
+            return;
+        uint64_t peerHas;
+        std::shared_ptr<Connection> connection;
+        if (Session::parse_resume(attempt.record, peerHas))
+            connection = session_find(attempt.record + Session::HEADER);
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &attempt.addr.sin_addr, ip, sizeof(ip));
+        struct sockaddr_in addr = attempt.addr;
+        resume_forget(fd);
+        if (!connection)
+        {
+            log_error("  Resumption from {}:{} for no session", ip, ntohs(addr.sin_port));
+            reject_fast(fd);
+            close(fd);
+        }
+        else if (!session_attach(connection, fd, addr, peerHas))
+        {
+            log_error("  Connection {} can't resume from offset {}", connection->getId(), peerHas);
+            reject_fast(fd);
+            close(fd);
+        }
+    }
+
+    void on_resume_connection(int listenFd)
+    {
+        for (int i = 0; i < admission.read_budget() * 4; i++)
+        {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept4(listenFd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            if (admission.rejecting() || resumeAttempts.size() >= MAX_CONNECTIONS)
+            {
+                reject_fast(fd);
+                close(fd);
+                continue;
+            }
+            std::shared_ptr<ResumeAttempt> attempt = std::make_shared<ResumeAttempt>();
+            attempt->fd = fd;
+            attempt->addr = addr;
+            attempt->watch.fd = fd;
+            attempt->watch.onEvents = [fd](uint32_t)
+            { resume_read(fd); };
+            attempt->timer.callback = [fd]
+            { resume_reject(fd); };
+            resumeAttempts[fd] = attempt;
+            loop.add(&attempt->watch, EPOLLIN);
+            loop.arm(&attempt->timer, RESUME_TIMEOUT);
+        }
+    }
+
+    // Sessions resume on their own port, so no REQUEST_CONNECT is sent for a link that resumes one
+    bool resume_listen(int port)
+    {
+        resumeWatch.fd = listen_on(port);
+        if (resumeWatch.fd < 0)
+            return false;
+        resumeWatch.onEvents = [](uint32_t)
+        { on_resume_connection(resumeWatch.fd); };
+        loop.add(&resumeWatch, EPOLLIN);
+        log_info("Sessions resume on port {}", port);
+        return true;
+    }
+
+    void resume_stop()
+    {
+        if (resumeWatch.fd < 0)
+            return;
+        loop.remove(&resumeWatch);
+        close(resumeWatch.fd);
+        resumeWatch.fd = -1;
+        while (!resumeAttempts.empty())
+            resume_reject(resumeAttempts.begin()->first);
+    }
+
+    Watch listenWatch;
+    Timer admissionTimer;
+
+    // Loop thread, the controller went away or a new process asked for a handoff
+    void api_stopped(int listenFd)
+    {
+        // Connections, sockets and queued output go to the new process instead of being closed
+        if (handoffRequested && !handoff_send(listenFd))
+        { // It didn't take over, the api channel continues where it stopped
+            handoffRequested = false;
+            handoff_listen(handoffPath);
+            apiChannel.resume();
+            loop.post([listenFd]
+                      { start_api([listenFd]
+                                  { api_stopped(listenFd); }); });
+            return;
+        }
+        resume_stop();
+        loop.stop();
+    }
+
+    void arena_report()
+    {
+        size_t used = arena.slots_used(), heapFree = Arena::heap_free();
+        log_info("Memory headroom: {} of {} connection slots free (high water {}, {} from the heap), {} of {} heap bytes free",
+                 arena.slots - used, arena.slots, arena.slots_high_water(), arena.slot_fallbacks(), heapFree, Arena::heap_size());
+    }
+
+    // Slots for every connection id twice over, closing connections may still be referenced
+    bool arena_reserve(size_t heap, bool lock)
+    {
+        // allocate_shared puts the reference counts in front of the Connection
+        if (!arena.reserve(sizeof(Connection) + 64, 2 * MAX_CONNECTIONS, heap, lock))
+            return false;
+        log_info("Arena of {} connection slots, {} bytes each, on {}, {} heap bytes reserved{}", arena.slots, arena.slotSize,
+                 arena.hugePages ? "huge pages" : "transparent huge pages if available", arena.heapReserve, arena.locked ? ", locked" : "");
+        arena_report();
+        return true;
+    }
+
+    // Loop thread only, samples the load signals and acts on a change of admission level
+    void admission_sample()
+    {
+        double signals[Admission::SIGNALS];
+        size_t preAccept = 0;
+        admission.topWeight = 1;
+        for (int id = 0; id < MAX_CONNECTIONS; id++)
+            if (std::shared_ptr<Connection> connection = connection_get(id))
+            {
+                if (!connection->isAccepted())
+                    preAccept += connection->preMessageBufferUsed();
+                else if (connection->home == LOCAL_HOME)
+                    admission.topWeight = std::max(admission.topWeight, output.weight(id));
+            }
+        signals[Admission::OUTPUT_BACKLOG] = (double)output.data_bytes() / Output::MAX_DATA_BYTES;
+        signals[Admission::SEND_BACKLOG] = (double)sendBacklog / std::max<size_t>(admission.sendLimit, 1);
+        signals[Admission::PRE_ACCEPT] = (double)preAccept / std::max<size_t>(admission.preAcceptLimit, 1);
+        bool paused = admission.accept_paused();
+        if (admission.update(signals))
+        {
+            if (paused != admission.accept_paused())
+            {
+                if (paused)
+                    loop.add(&listenWatch, EPOLLIN);
+                else
+                    loop.remove(&listenWatch);
+            }
+            log_info("Admission level {}, load {:.0f}% from signal {}", (int)admission.level, admission.load * 100, (int)admission.cause);
+            api_overload(admission.level, admission.cause, admission.load, admission.shed);
+            admission.shed = 0;
+            admission.reportedAt = Loop::now_ms();
+            if (arena.enabled)
+                arena_report();
+        }
+        else if (admission.report_due(Loop::now_ms()))
+        { // Same level, the controller learns what was dropped so far
+            api_overload(admission.level, admission.cause, admission.load, admission.shed);
+            admission.shed = 0;
+            admission.reportedAt = Loop::now_ms();
+        }
+        loop.arm(&admissionTimer, Admission::INTERVAL);
+    }
+
+    Timer statsTimer;
+    uint64_t statsInterval = 0;
+    // What the last STATS frames said about each connection id
+    std::array<StatsRecord, MAX_CONNECTIONS> statsSent;
+    std::bitset<MAX_CONNECTIONS> statsLive;
+
+    // Loop thread only, sends the connections that changed since the last sample
+    void stats_sample()
+    {
+        std::vector<char> records(STATS_HEADER);
+        auto add = [&records](const StatsRecord &record)
+        {
+            const char *bytes = (const char *)&record;
+            records.insert(records.end(), bytes, bytes + sizeof(record));
+        };
+        for (int id = 0; id < MAX_CONNECTIONS; id++)
+        {
+            std::shared_ptr<Connection> connection = connection_get(id);
+            if (!connection || connection->isClosed())
+            {
+                if (statsLive[id])
+                {
+                    statsSent[id].state = CLOSED;
+                    add(statsSent[id]);
+                    statsLive[id] = false;
+                }
+                continue;
+            }
+            StatsRecord record = {};
+            record.id = id;
+            record.state = !connection->established ? CONNECTING : connection->isAccepted() ? OPEN
+                                                                                           : PRE_ACCEPT;
+            record.port = connection->port;
+            inet_pton(AF_INET, connection->ip.c_str(), &record.ip);
+            record.bytesIn = connection->bytesIn;
+            record.bytesOut = connection->bytesOut;
+            record.queued = std::min<size_t>(connection->queued, UINT32_MAX);
+            if (connection->codec)
+            {
+                const Codec::Stats &stats = connection->codec->stats;
+                record.rawIn = stats.rawIn;
+                record.wireIn = stats.wireIn;
+                record.rawOut = stats.rawOut;
+                record.wireOut = stats.wireOut;
+            }
+            if (statsLive[id] && record == statsSent[id])
+                continue;
+            statsSent[id] = record;
+            statsLive[id] = true;
+            add(record);
+        }
+        if (records.size() > STATS_HEADER)
+            api_stats(Loop::now_ms(), records);
+        loop.arm(&statsTimer, statsInterval);
+    }
+
+    Timer loopReportTimer;
+    uint64_t loopReportInterval = 0;
+
+    // Loop thread only, what busy polling costs and what it buys
+    void loop_report()
+    {
+        Poller::Report report = loop.poller.take();
+        log_info("Loop: {} wake-ups spinning, {} yielding, {} blocked, {} empty polls, {:.0f}% cpu, post to run p50 {} ns p99 {} ns",
+                 report.wakeups[Poller::SPIN], report.wakeups[Poller::YIELD], report.wakeups[Poller::BLOCK], report.emptyPolls,
+                 report.cpu * 100, report.postP50Ns, report.postP99Ns);
+        if (report.refusedSockets)
+            log_info("  SO_BUSY_POLL refused on {} sockets, raising it above net.core.busy_read needs CAP_NET_ADMIN", report.refusedSockets);
+        if (loopReportInterval)
+            loop.arm(&loopReportTimer, loopReportInterval);
+    }
+
+    void serve_on(int listenFd)
+    {
+        output.onDrained = [](int connId)
+        { loop.post([connId]
+                    { connection_resume(connId); }); };
+
+        listenWatch.fd = listenFd;
+        listenWatch.onEvents = [listenFd](uint32_t)
+        { on_new_connection(listenFd); };
+        loop.add(&listenWatch, EPOLLIN);
+        admissionTimer.callback = admission_sample;
+        loop.arm(&admissionTimer, Admission::INTERVAL);
+    }
+
+    // The stdio daemon, the controller talks frames over API_IN_FILENO and API_OUT_FILENO
+    int main(int argc, char **argv)
+    {
+        static struct option longOptions[] = {
+            {"idle-timeout", required_argument, 0, 'i'},
+            {"pre-accept-timeout", required_argument, 0, 'p'},
+            {"connect-timeout", required_argument, 0, 'c'},
+            {"heartbeat", required_argument, 0, 'h'},
+            {"heartbeat-payload", required_argument, 0, 'H'},
+            {"resolve-ttl", required_argument, 0, 'r'},
+            {"framing", required_argument, 0, 'f'},
+            {"conn-budget", required_argument, 0, 'b'},
+            {"handoff", required_argument, 0, 'o'},
+            {"takeover", required_argument, 0, 't'},
+            {"capture", required_argument, 0, 'C'},
+            {"udp", required_argument, 0, 'u'},
+            {"cluster", required_argument, 0, 'K'},
+            {"node", required_argument, 0, 'N'},
+            {"outbox", required_argument, 0, 'O'},
+            {"outbox-size", required_argument, 0, 'S'},
+            {"outbox-age", required_argument, 0, 'A'},
+            {"trace", required_argument, 0, 'T'},
+            {"trace-sample", required_argument, 0, 's'},
+            {"pre-accept-memory", required_argument, 0, 'P'},
+            {"send-backlog", required_argument, 0, 'B'},
+            {"arena", no_argument, 0, 'a'},
+            {"arena-heap", required_argument, 0, 'm'},
+            {"arena-lock", no_argument, 0, 'L'},
+            {"stats-interval", required_argument, 0, 'I'},
+            {"busy-poll", required_argument, 0, 'y'},
+            {"busy-cpu", required_argument, 0, 'U'},
+            {"loop-report", required_argument, 0, 'R'},
+            {"resume-port", required_argument, 0, 'e'},
+            {"session-linger", required_argument, 0, 'g'},
+            {"session-window", required_argument, 0, 'w'},
+            {0, 0, 0, 0}};
+        std::string takeoverPath, clusterNodes, clusterName, tracePath;
+        uint32_t traceEvery = 100;
+        bool arenaEnabled = false, arenaLock = false;
+        // Room for everything the output stage, the peer sends, pre-accept storage and one read per connection may hold
+        size_t arenaHeap = 0;
+        int opt;
+        while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+        {
+            switch (opt)
+            {
+            case 'i':
+                options.idle_timeout = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                options.pre_accept_timeout = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                options.connect_timeout = strtoull(optarg, NULL, 10);
+                break;
+            case 'h':
+                options.heartbeat_interval = strtoull(optarg, NULL, 10);
+                break;
+            case 'H':
+                options.heartbeat_payload = optarg;
+                break;
+            case 'r':
+                resolver.ttl = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+            {
+                char *modeText = strtok(optarg, ":");
+                std::string mode = modeText ? modeText : "";
+                char *size = modeText ? strtok(NULL, ":") : NULL;
+                const char *modes[] = {"raw", "newline", "u16", "u32", "fixed"};
+                int i = 0;
+                while (i <= FIXED && mode != modes[i])
+                    i++;
+                if (i > FIXED || (i == FIXED && !size))
+                {
+                    fprintf(stderr, "--framing expects raw, newline, u16, u32 or fixed:SIZE\n");
+                    return 1;
+                }
+                options.framing = Framer((FramingMode)i, size ? atoi(size) : 0);
+                break;
+            }
+            case 'b':
+                output.budget = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                handoffPath = optarg;
+                break;
+            case 't':
+                takeoverPath = optarg;
+                break;
+            case 'C':
+                if (!capture.open(optarg))
+                    return 1;
+                break;
+            case 'u':
+                options.udp_port = atoi(optarg);
+                break;
+            case 'K':
+                clusterNodes = optarg;
+                break;
+            case 'N':
+                clusterName = optarg;
+                break;
+            case 'O':
+                if (!outbox.open(optarg))
+                    return 1;
+                break;
+            case 'S':
+                outbox.maxBytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'A':
+                outbox.maxAge = strtoull(optarg, NULL, 10);
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            case 's':
+                traceEvery = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                admission.preAcceptLimit = strtoull(optarg, NULL, 10);
+                break;
+            case 'B':
+                admission.sendLimit = strtoull(optarg, NULL, 10);
+                break;
+            case 'a':
+                arenaEnabled = true;
+                break;
+            case 'm':
+                arenaEnabled = true;
+                arenaHeap = strtoull(optarg, NULL, 10);
+                break;
+            case 'L':
+                arenaEnabled = arenaLock = true;
+                break;
+            case 'I':
+                statsInterval = strtoull(optarg, NULL, 10);
+                break;
+            case 'y':
+                loop.poller.busy = true;
+                loop.poller.spinUs = strtoul(optarg, NULL, 10);
+                break;
+            case 'U':
+                loop.poller.cpu = atoi(optarg);
+                break;
+            case 'R':
+                loopReportInterval = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                options.resume_port = atoi(optarg);
+                break;
+            case 'g':
+                options.session_linger = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                options.session_window = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [--idle-timeout ms] [--pre-accept-timeout ms] [--connect-timeout ms] "
+                                "[--heartbeat ms] [--heartbeat-payload text] [--resolve-ttl ms] [--framing mode] [--conn-budget bytes] "
+                                "[--handoff path] [--takeover path] [--capture path] [--udp port] [--cluster name=host:port,... --node name] "
+                                "[--outbox dir] [--outbox-size bytes] [--outbox-age ms] [--trace path] [--trace-sample n] [--pre-accept-memory bytes] [--send-backlog bytes] [--arena] [--arena-heap bytes] [--arena-lock] [--stats-interval ms] [--busy-poll us] [--busy-cpu n] [--loop-report ms] "
+                                "[--resume-port port] [--session-linger ms] [--session-window bytes] [port]\n",
+                        argv[0]);
+                return 1;
+            }
+        }
+        if (optind < argc)
+            options.listen_port = atoi(argv[optind]);
+        if (!tracePath.empty())
+            tracer.open(tracePath, traceEvery);
+        tracer.name_thread("loop");
+        if (arenaEnabled)
+        {
+            if (!arenaHeap)
+                arenaHeap = Output::MAX_DATA_BYTES + admission.sendLimit + admission.preAcceptLimit + (size_t)MAX_CONNECTIONS * MAX_FULL_MESSAGE_SIZE;
+            if (!arena_reserve(arenaHeap, arenaLock))
+                return 1;
+        }
+        if ((!clusterNodes.empty() || !clusterName.empty()) && !cluster_configure(clusterNodes, clusterName))
+        {
+            fprintf(stderr, "--cluster expects name=host:port,... and --node one of its names\n");
+            return 1;
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        int listenFd;
+        if (!takeoverPath.empty())
+        { // Inherit the listening socket, the api pipes and all connections of the running daemon
+            listenFd = handoff_takeover(takeoverPath);
+            if (listenFd < 0)
+                return 1;
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            getsockname(listenFd, (struct sockaddr *)&addr, &len);
+            options.listen_port = ntohs(addr.sin_port);
+        }
+        else
+        {
+            listenFd = listen_on(options.listen_port);
+            if (listenFd < 0)
+                return 1;
+        }
+
+        if (capture.enabled)
+            output.onWrite = [](const struct iovec *iov, int count)
+            { capture.record(Capture::API_OUT, 0, iov, count); };
+
+        serve_on(listenFd);
+        if (statsInterval)
+        {
+            statsTimer.callback = stats_sample;
+            loop.arm(&statsTimer, statsInterval);
+        }
+        if (loopReportInterval)
+        {
+            loopReportTimer.callback = loop_report;
+            loop.arm(&loopReportTimer, loopReportInterval);
+        }
+
+        if (!handoffPath.empty())
+            handoff_listen(handoffPath);
+
+        log_info("TCP Server started on port {}", options.listen_port);
+        if ((options.udp_port || handoffUdpFd >= 0) && !udp_serve(options.udp_port, handoffUdpFd))
+            return 1;
+        if (options.resume_port && !resume_listen(options.resume_port))
+            return 1;
+        if (cluster.enabled())
+        {
+            if (!cluster.start())
+            {
+                log_info("Cluster binding failed: {} : {}", errno, strerror(errno));
+                return 1;
+            }
+            log_info("Cluster node {} of {}, owns {} connection ids", clusterName, cluster.size(), MAX_CONNECTIONS - foreignIds.count());
+        }
+
+        // The control channel is read on the loop, next to the sockets
+        if (!apiChannel.nonblocking())
+        {
+            log_error("Can't read the api channel without blocking: {} : {}", errno, strerror(errno));
+            return 1;
+        }
+        loop.post([listenFd]
+                  { start_api([listenFd]
+                              { api_stopped(listenFd); }); });
+        loop.run();
+        if (handoffRequested)
+            return 0;
+
+        // Close the server before exiting the program.
+        close(listenFd);
+        if (arena.enabled)
+            arena_report();
+        if (loop.poller.busy || loopReportInterval)
+        {
+            loopReportInterval = 0;
+            loop_report();
+        }
+        output.close();
+        capture.close();
+        // The writer thread is gone, its spans are complete
+        tracer.write();
+
+        return 0;
+    }
+
+}
+
+namespace funny
+{
+    using namespace Api;
+
+    int main(int argc, char **argv) { return Api::main(argc, argv); }
+
+    int serve(int port, Controller &embedder)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        controller = &embedder;
+        int listenFd = listen_on(port);
+        if (listenFd < 0)
+            return 1;
+        options.listen_port = port;
+        serve_on(listenFd);
+        log_info("TCP Server started on port {}", port);
+        loop.run();
+        loop.cancel(&admissionTimer);
+        loop.remove(&listenWatch);
+        close(listenFd);
+        controller = nullptr;
+        return 0;
+    }
+
+    void stop() { loop.stop(); }
+
+    void busy_poll(uint32_t spinUs, int cpu)
+    {
+        loop.poller.busy = spinUs > 0;
+        loop.poller.spinUs = spinUs;
+        loop.poller.cpu = cpu;
+    }
+
+    // Runs func on the loop, right away when called from it
+    template <typename Func>
+    void on_loop(Func func)
+    {
+        if (loop.in_loop())
+            func();
+        else
+            loop.post(std::move(func));
+    }
+
+    void connect(const std::string &host, int port)
+    {
+        on_loop([host, port]
+                { connection_connect(host, port); });
+    }
+
+    void accept(Conn conn)
+    {
+        on_loop([conn]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection && !connection->isAccepted())
+                        connection_accept(connection); });
+    }
+
+    void disconnect(Conn conn) { connection_destroy_by_id(conn, CONTROLLER); }
+
+    bool send(Conn conn, std::span<const char> data)
+    {
+        std::shared_ptr<Connection> connection = connection_get(conn);
+        if (!connection || !connection->isAccepted())
+            return false;
+        if (loop.in_loop())
+            connection_send_now(connection, data.data(), data.size());
+        else
+            loop.post([connection, bytes = std::vector<char>(data.begin(), data.end())]
+                      { connection_send_now(connection, bytes.data(), bytes.size()); });
+        return true;
+    }
+
+    void set_framing(Conn conn, int mode, uint32_t size)
+    {
+        if (mode > FIXED)
+            return;
+        on_loop([conn, mode, size]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection)
+                        connection->framer = Framer((FramingMode)mode, size); });
+    }
+
+    void set_cork(Conn conn, uint32_t bytes, uint32_t delay)
+    {
+        on_loop([conn, bytes, delay]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection && !connection->datagram && !connection->channel)
+                        connection_set_cork(connection, bytes, delay); });
+    }
+
+    void set_compression(Conn conn, bool enabled)
+    {
+        on_loop([conn, enabled]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection && !connection->datagram && !connection->channel && !connection->session)
+                        connection_set_compression(connection, enabled); });
+    }
+
+    void set_session(Conn conn, bool enabled)
+    {
+        on_loop([conn, enabled]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection && !connection->datagram && !connection->channel && !connection->codec && !connection->mux)
+                        session_set(connection, enabled); });
+    }
+
+    void set_peer(Conn conn, const std::string &name)
+    {
+        on_loop([conn, name]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection && !connection->datagram)
+                        connection_set_peer(connection, name); });
+    }
+
+    void multiplex(Conn conn)
+    {
+        on_loop([conn]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    if (connection && !connection->datagram && !connection->channel && !connection->session)
+                        carrier_start(connection); });
+    }
+
+    void open_channel(Conn conn)
+    {
+        on_loop([conn]
+                {
+                    std::shared_ptr<Connection> connection = connection_get(conn);
+                    uint16_t number = connection && connection->mux ? connection->mux->allocate() : 0;
+                    if (!number)
+                        return;
+                    if (std::shared_ptr<Connection> channel = channel_open(connection, number, LOCAL_HOME))
+                        api_create_connect(channel->getId()); });
+    }
+
+    void set_weight(Conn conn, int weight)
+    {
+        if (conn < MAX_CONNECTIONS)
+            output.set_weight(conn, weight);
+    }
+
+    void subscribe(Conn conn, const std::string &pattern)
+    {
+        on_loop([conn, pattern]
+                {
+                    if (connection_get(conn))
+                        topics.subscribe(conn, pattern); });
+    }
+
+    void unsubscribe(Conn conn, const std::string &pattern)
+    {
+        on_loop([conn, pattern]
+                { topics.unsubscribe(conn, pattern); });
+    }
+
+    void publish(const std::string &topic, std::span<const char> data)
+    {
+        if (loop.in_loop())
+            connection_publish(topic, data.data(), data.size());
+        else
+            loop.post([topic, bytes = std::vector<char>(data.begin(), data.end())]
+                      { connection_publish(topic, bytes.data(), bytes.size()); });
+    }
+
+    // Forwards to the C callbacks
+    class CallbackController : public Controller
+    {
+    public:
+        funny_callbacks callbacks;
+        void *user;
+
+        void on_request_connect(Conn conn) override
+        {
+            if (callbacks.on_request_connect)
+                callbacks.on_request_connect(user, conn);
+        }
+        void on_create_connect(Conn conn) override
+        {
+            if (callbacks.on_create_connect)
+                callbacks.on_create_connect(user, conn);
+        }
+        void on_message(Conn conn, std::span<const char> message) override
+        {
+            if (callbacks.on_message)
+                callbacks.on_message(user, conn, message.data(), message.size());
+        }
+        void on_disconnect(Conn conn, int reason) override
+        {
+            if (callbacks.on_disconnect)
+                callbacks.on_disconnect(user, conn, reason);
+        }
+        void on_connect_failed(int reason, const std::string &host, int port) override
+        {
+            if (callbacks.on_connect_failed)
+                callbacks.on_connect_failed(user, reason, host.c_str(), port);
+        }
+        void on_log(bool error, std::span<const char> text) override
+        {
+            if (callbacks.on_log)
+                callbacks.on_log(user, error, text.data(), text.size());
+        }
+        void on_overload(int level, int cause) override
+        {
+            if (callbacks.on_overload)
+                callbacks.on_overload(user, level, cause);
+        }
+    };
+}
+
+extern "C"
+{
+    int funny_serve(int port, const funny_callbacks *callbacks, void *user)
+    {
+        funny::CallbackController controller;
+        controller.callbacks = *callbacks;
+        controller.user = user;
+        return funny::serve(port, controller);
+    }
+    void funny_stop(void) { funny::stop(); }
+    void funny_busy_poll(uint32_t spin_us, int cpu) { funny::busy_poll(spin_us, cpu); }
+    void funny_connect(const char *host, int port) { funny::connect(host, port); }
+    void funny_accept(int conn) { funny::accept(conn); }
+    void funny_disconnect(int conn) { funny::disconnect(conn); }
+    int funny_send(int conn, const char *data, size_t length) { return funny::send(conn, {data, length}); }
+    void funny_set_framing(int conn, int mode, uint32_t size) { funny::set_framing(conn, mode, size); }
+    void funny_set_weight(int conn, int weight) { funny::set_weight(conn, weight); }
+    void funny_set_cork(int conn, uint32_t bytes, uint32_t delay) { funny::set_cork(conn, bytes, delay); }
+    void funny_set_compression(int conn, int enabled) { funny::set_compression(conn, enabled); }
+    void funny_set_session(int conn, int enabled) { funny::set_session(conn, enabled); }
+    void funny_set_peer(int conn, const char *name) { funny::set_peer(conn, name); }
+    void funny_multiplex(int conn) { funny::multiplex(conn); }
+    void funny_open_channel(int conn) { funny::open_channel(conn); }
+    void funny_subscribe(int conn, const char *pattern) { funny::subscribe(conn, pattern); }
+    void funny_unsubscribe(int conn, const char *pattern) { funny::unsubscribe(conn, pattern); }
+    void funny_publish(const char *topic, const char *data, size_t length) { funny::publish(topic, {data, length}); }
+}
@@ -0,0 +1,53 @@
+#ifndef FUNNY_H
+#define FUNNY_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* ** libfunny C ABI **
+ *  Same semantics as the C++ API in funny.hpp. Callbacks may be NULL, user is passed back
+ *  to every callback. Buffers handed to callbacks are valid during the call only.
+ */
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct funny_callbacks
+    {
+        void (*on_request_connect)(void *user, int conn);
+        void (*on_create_connect)(void *user, int conn);
+        void (*on_message)(void *user, int conn, const char *data, size_t length);
+        void (*on_disconnect)(void *user, int conn, int reason);
+        void (*on_connect_failed)(void *user, int reason, const char *host, int port);
+        void (*on_log)(void *user, int error, const char *text, size_t length);
+        void (*on_overload)(void *user, int level, int cause);
+    } funny_callbacks;
+
+    /* Runs the loop on the calling thread until funny_stop(), non-zero if port can't be bound */
+    int funny_serve(int port, const funny_callbacks *callbacks, void *user);
+    void funny_stop(void);
+    /* Before funny_serve, see funny::busy_poll */
+    void funny_busy_poll(uint32_t spin_us, int cpu);
+
+    void funny_connect(const char *host, int port);
+    void funny_accept(int conn);
+    void funny_disconnect(int conn);
+    /* 0 if conn is not an accepted connection */
+    int funny_send(int conn, const char *data, size_t length);
+    void funny_set_framing(int conn, int mode, uint32_t size);
+    void funny_set_weight(int conn, int weight);
+    void funny_set_cork(int conn, uint32_t bytes, uint32_t delay);
+    void funny_set_compression(int conn, int enabled);
+    void funny_set_session(int conn, int enabled);
+    void funny_set_peer(int conn, const char *name);
+    void funny_multiplex(int conn);
+    void funny_open_channel(int conn);
+
+    void funny_subscribe(int conn, const char *pattern);
+    void funny_unsubscribe(int conn, const char *pattern);
+    void funny_publish(const char *topic, const char *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
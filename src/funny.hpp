@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <span>
+#include <string>
+
+/* ** libfunny **
+ *  The networking core as a library. A controller either talks the frame protocol over
+ *  stdin/stdout (funny::main, the funny_cpp daemon) or lives in the same process and
+ *  implements funny::Controller. In-process controllers get every peer message as a span
+ *  straight out of the read buffer, no frame is built and nothing crosses a pipe.
+ *
+ *  Callbacks run on the loop thread, the thread inside funny::serve. Commands may be called
+ *  from any thread, from the loop thread they take effect immediately. send() writes what
+ *  the socket takes at once and copies only a rest that has to wait.
+ *
+ *  There is one core per process. The C ABI is in funny.h.
+ */
+namespace funny
+{
+    using Conn = uint8_t;
+
+    class Controller
+    {
+    public:
+        virtual ~Controller() = default;
+        // A peer connected, nothing it sends is delivered before accept(conn)
+        virtual void on_request_connect(Conn /* conn */) {}
+        // An outbound connect() finished
+        virtual void on_create_connect(Conn /* conn */) {}
+        // Valid during the call only
+        virtual void on_message(Conn /* conn */, std::span<const char> /* message */) {}
+        // reason is an Api::DisconnectReason
+        virtual void on_disconnect(Conn /* conn */, int /* reason */) {}
+        virtual void on_connect_failed(int /* reason */, const std::string & /* host */, int /* port */) {}
+        virtual void on_log(bool /* error */, std::span<const char> /* text */) {}
+        // level is an Api::Admission::Level, cause the Api::Admission::Signal that set it
+        virtual void on_overload(int /* level */, int /* cause */) {}
+    };
+
+    // Listens on port and runs the loop on the calling thread until stop(), 1 if port can't be bound
+    int serve(int port, Controller &controller);
+    void stop();
+    // Before serve, spins spinUs and yields before blocking for events, 0 always blocks. cpu >= 0 pins the loop thread
+    void busy_poll(uint32_t spinUs, int cpu);
+
+    void connect(const std::string &host, int port);
+    void accept(Conn conn);
+    void disconnect(Conn conn);
+    // False if conn is not an accepted connection
+    bool send(Conn conn, std::span<const char> data);
+    // mode is an Api::FramingMode, size is used by FIXED
+    void set_framing(Conn conn, int mode, uint32_t size);
+    // Gathers sends until bytes or delay us, bytes 0 sends each at once, see SET_CORK in api.hpp
+    void set_cork(Conn conn, uint32_t bytes, uint32_t delay);
+    // Compresses the stream both ways from now on, see SET_COMPRESSION in api.hpp
+    void set_compression(Conn conn, bool enabled);
+    // Keeps conn resumable by its peer when the link drops, see SESSION in api.hpp
+    void set_session(Conn conn, bool enabled);
+    // Names the peer of an inbound conn for the outbox, see SET_PEER in api.hpp
+    void set_peer(Conn conn, const std::string &name);
+    // Makes conn a carrier of channels, see MULTIPLEX in api.hpp
+    void multiplex(Conn conn);
+    // A channel on the carrier conn, reported with on_create_connect
+    void open_channel(Conn conn);
+    // 0 resets to 1
+    void set_weight(Conn conn, int weight);
+
+    // Topic patterns as in topics.hpp, publish() sends data to every matching accepted connection
+    void subscribe(Conn conn, const std::string &pattern);
+    void unsubscribe(Conn conn, const std::string &pattern);
+    void publish(const std::string &topic, std::span<const char> data);
+
+    // The stdio daemon
+    int main(int argc, char **argv);
+}
@@ -7,8 +7,12 @@
 // #include <stdlib.h>
 // #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <fmt/core.h>
 #include <magic_enum.hpp>
+#include "chatlog.hpp"
+#include "dashboard.hpp"
 
 #ifndef CTRL
 #define CTRL(x) ((x) & 037)
@@ -48,7 +52,7 @@ namespace funny
     class Gui
     {
     public:
-        Gui()
+        Gui() : history(ChatLog::default_path())
         {
             root_win = initscr();
             start_color();
@@ -82,6 +86,7 @@ namespace funny
 
             // hide_panel(command_panel);
             update_panels();
+            draw_history();
             wrefresh(root_win);
             // wrefresh(command_win);
 
@@ -100,6 +105,7 @@ namespace funny
                 {
                     show_panel(side_panel);
                     wresize(main_win, LINES - y_ratio, COLS - x_ratio);
+                    dashboard.invalidate();
                 }
                 else
                 {
@@ -112,6 +118,12 @@ namespace funny
                 wrefresh(main_win);
             };
 
+            // Sort the dashboard by the next column, or the other way round
+            keybinds['o'] = [this]()
+            { dashboard.next_sort(); };
+            keybinds['O'] = [this]()
+            { dashboard.sort_by(dashboard.sortColumn); };
+
             keybinds['c'] = [this]()
             {
                 set_mode(Mode::CHAT);
@@ -162,9 +174,16 @@ namespace funny
             case Mode::COMMAND:
                 if (typing_command)
                 {
-                    wclear(main_win);
-                    waddnstr(main_win, command_buffer.data(), command_buffer.size());
-                    wrefresh(main_win);
+                    std::string command(command_buffer.begin(), command_buffer.end());
+                    if (command.rfind("search ", 0) == 0)
+                        draw_search(command.substr(7));
+                    else
+                    {
+                        wclear(main_win);
+                        waddnstr(main_win, command_buffer.data(), command_buffer.size());
+                        wrefresh(main_win);
+                    }
+                    wclear(command_win);
                     waddstr(command_win, mode.text().c_str());
                     wrefresh(command_win);
                     command_buffer.clear();
@@ -173,15 +192,12 @@ namespace funny
                 }
                 break;
             case Mode::CHAT:
-                wclear(main_win);
-                box(main_win, 0, 0);
-                wmove(main_win, 1, 1);
-                waddstr(main_win, chat_buffer.data());
+                history.append(ChatLog::SELF, chat_buffer.data(), chat_buffer.size());
+                draw_history();
                 chat_buffer.clear();
                 wclear(chat_win);
                 wborder(chat_win, 0, 0, 0, ' ', 0, 0, ' ', ' ');
                 // box(chat_win, 0, 0);
-                wrefresh(main_win);
                 wrefresh(chat_win);
                 wrefresh(root_win);
                 break;
@@ -191,6 +207,49 @@ namespace funny
             return 0;
         }
 
+        // Draws messages newest at the bottom, as many as fit into main_win
+        void draw_messages(const std::vector<uint64_t> &ids, const char *title)
+        {
+            int rows = getmaxy(main_win) - 2;
+            int cols = getmaxx(main_win) - 2;
+            wclear(main_win);
+            box(main_win, 0, 0);
+            if (title)
+                mvwaddnstr(main_win, 0, 2, title, cols - 2);
+            int row = std::min<int>(rows, ids.size());
+            for (uint64_t id : ids)
+            {
+                if (row <= 0)
+                    break;
+                ChatLog::Message m = history.get(id);
+                time_t secs = m.timestamp_us / 1000000;
+                struct tm t;
+                localtime_r(&secs, &t);
+                std::string line = fmt::format("[{:02}:{:02}:{:02}] ", t.tm_hour, t.tm_min, t.tm_sec);
+                line += m.conn == ChatLog::SELF ? "me" : fmt::format("#{}", m.conn);
+                line += ": ";
+                line.append(m.text, m.length);
+                mvwaddnstr(main_win, row--, 1, line.c_str(), cols);
+            }
+            wrefresh(main_win);
+        }
+
+        void draw_history()
+        {
+            std::vector<uint64_t> ids;
+            uint64_t n = history.size();
+            for (uint64_t i = n; i > 0 && ids.size() < (size_t)getmaxy(main_win); i--)
+                ids.push_back(i - 1);
+            draw_messages(ids, nullptr);
+        }
+
+        void draw_search(const std::string &query)
+        {
+            std::vector<uint64_t> hits = history.search(query, getmaxy(main_win));
+            std::string title = fmt::format(" search: {} ({} shown) ", query, hits.size());
+            draw_messages(hits, title.c_str());
+        }
+
         bool key_backspace()
         {
             switch (mode)
@@ -284,9 +343,6 @@ namespace funny
             fd_set set;
             struct timeval tv;
 
-            tv.tv_sec = 10;
-            tv.tv_usec = 0;
-
             // int ch, x, y;
             while (!stopped)
             {
@@ -294,25 +350,54 @@ namespace funny
 
                 FD_ZERO(&set);
                 FD_SET(fileno(stdin), &set);
+                if (message_fd >= 0)
+                    FD_SET(message_fd, &set);
+
+                // Poll while the history index is catching up so indexing only runs between keystrokes,
+                // wake up for the dashboard when its draw is due
+                long draw_in = panel_hidden(side_panel) ? -1 : dashboard.due_in();
+                tv.tv_sec = history.index_pending() ? 0 : 10;
+                tv.tv_usec = 0;
+                if (draw_in >= 0 && draw_in < tv.tv_sec * 1000)
+                {
+                    tv.tv_sec = draw_in / 1000;
+                    tv.tv_usec = draw_in % 1000 * 1000;
+                }
 
-                int res = select(fileno(stdin) + 1, &set, NULL, NULL, &tv);
+                int res = select(std::max(fileno(stdin), message_fd) + 1, &set, NULL, NULL, &tv);
 
                 if (res > 0)
                 {
-                    char c;
-                    // printf("Input available\n");
-                    read(fileno(stdin), &c, 1);
-                    if (handle_ch(c))
-                        break;
+                    // Keystrokes first, a busy message pipe can't hold them up
+                    if (FD_ISSET(fileno(stdin), &set))
+                    {
+                        char c;
+                        // printf("Input available\n");
+                        read(fileno(stdin), &c, 1);
+                        if (handle_ch(c))
+                            break;
+                    }
+                    if (message_fd >= 0 && FD_ISSET(message_fd, &set) && !read_messages())
+                        message_fd = -1;
                 }
                 else if (res < 0)
                 {
+                    if (errno == EINTR) // SIGWINCH
+                        continue;
                     perror("select error");
                     break;
                 }
                 else
                 {
                     // printf("Select timeout\n");
+                    if (history.index_pending())
+                        history.index_step(4096);
+                }
+                if (!panel_hidden(side_panel) && dashboard.due_in() == 0)
+                {
+                    dashboard.draw(side_win);
+                    update_panels();
+                    doupdate();
                 }
             }
             tcsetattr(fileno(stdin), TCSANOW, &oldSettings);
@@ -328,16 +413,69 @@ namespace funny
 
         void close() { stopped = true; }
 
+        // Incoming messages are read from fd as [connection id][u16 length][payload] frames,
+        // the layout Api::api_message writes, so fd may be the daemon's api output. STATS frames
+        // go to the dashboard, REQUEST_CONNECT, CREATE_CONNECT and DISCONNECT carry no payload.
+        // fd is switched to non-blocking, its read end belongs to the Gui.
+        void attach_messages(int fd)
+        {
+            message_fd = fd;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        // Reads what is there and handles every complete frame, false at end of input
+        bool read_messages()
+        {
+            size_t fill = message_buffer.size();
+            message_buffer.resize(fill + MESSAGE_READ);
+            int m = read(message_fd, message_buffer.data() + fill, MESSAGE_READ);
+            message_buffer.resize(fill + std::max(m, 0));
+            if (m == 0 || (m < 0 && errno != EAGAIN && errno != EINTR))
+                return false;
+            size_t at = 0;
+            bool chat = false;
+            while (message_buffer.size() - at >= 3)
+            {
+                unsigned char magic = message_buffer[at];
+                unsigned short length;
+                memcpy(&length, &message_buffer[at + 1], sizeof(length));
+                // REQUEST_CONNECT, CREATE_CONNECT and DISCONNECT
+                bool special = magic == 253 || magic == 251 || magic == 255;
+                size_t size = 3 + (special ? 0 : length);
+                if (message_buffer.size() - at < size)
+                    break;
+                const char *message = &message_buffer[at + 3];
+                if (magic == Api::STATS_MAGIC)
+                    dashboard.apply(message, length);
+                else if (!special)
+                {
+                    history.append(magic, message, length);
+                    chat = true;
+                }
+                at += size;
+            }
+            message_buffer.erase(message_buffer.begin(), message_buffer.begin() + at);
+            if (chat)
+                draw_history();
+            return true;
+        }
+
     private:
         WINDOW *root_win, *chat_win, *side_win, *main_win, *command_win;
         PANEL *side_panel, *command_panel;
         Mode mode;
         bool typing_command = false;
         bool stopped = false;
+        int message_fd = -1;
+        static const int MESSAGE_READ = 64 << 10;
+        // Frames read but not complete yet
+        std::vector<char> message_buffer;
         int y_ratio, x_ratio, text_color = COLOR_RED;
         std::vector<char> chat_buffer, command_buffer;
         chtype transparent_color_pair, command_color_pair;
         std::map<char, std::function<void()>> keybinds;
+        ChatLog history;
+        Dashboard dashboard;
     };
 
 }
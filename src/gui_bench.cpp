@@ -0,0 +1,285 @@
+#include "gui.hpp"
+#include <pty.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/* ** Gui render benchmark **
+ *  Runs funny::Gui in a child process on a pseudo-terminal and replays scripted workloads.
+ *  Keystrokes are written to the pty master, incoming messages go through the Gui message pipe.
+ *  After every event the benchmark waits until the terminal output settles and records
+ *    - latency from the event until the first and the last byte of terminal output
+ *    - bytes of terminal output per event
+ *    - child CPU time per event (utime + stime from /proc/<pid>/stat)
+ *
+ *  usage: funny_gui_bench [-n events] [-s settle_us] [workload...]
+ *  workloads: typing paste flood resize search stats (default: all)
+ *  stats feeds the side panel STATS frames for STATS_CONNECTIONS connections, a few of them busy
+ */
+
+struct Sample
+{
+    long first_us;
+    long last_us;
+    long bytes;
+};
+
+static int master_fd, message_fd;
+static pid_t child;
+static long settle_us = 2000;
+
+static long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long child_cpu_us()
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", child);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    // Fields 14 and 15 (utime, stime) follow the parenthesised command name
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (p)
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    return (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+// Drains terminal output until nothing arrived for settle_us
+static Sample settle(long start)
+{
+    Sample s = {-1, -1, 0};
+    char buf[65536];
+    struct pollfd pfd = {master_fd, POLLIN, 0};
+    while (poll(&pfd, 1, s.bytes ? settle_us / 1000 + 1 : 1000) > 0)
+    {
+        int m = read(master_fd, buf, sizeof(buf));
+        if (m <= 0)
+            break;
+        long t = now_us() - start;
+        if (s.first_us < 0)
+            s.first_us = t;
+        s.last_us = t;
+        s.bytes += m;
+    }
+    return s;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        int m = write(fd, buf, len);
+        if (m <= 0)
+            return;
+        buf += m;
+        len -= m;
+    }
+}
+
+static Sample key(const char *keys, size_t len)
+{
+    long start = now_us();
+    write_all(master_fd, keys, len);
+    return settle(start);
+}
+
+static Sample message(unsigned char conn, const std::string &text)
+{
+    std::string frame(3, 0);
+    unsigned short length = text.size();
+    frame[0] = conn;
+    memcpy(&frame[1], &length, sizeof(length));
+    frame += text;
+    long start = now_us();
+    write_all(message_fd, frame.data(), frame.size());
+    return settle(start);
+}
+
+static const int STATS_CONNECTIONS = 230;
+
+// Frame i of a daemon where every connection moves steadily and every tenth speeds up
+static Sample stats(int i)
+{
+    std::string text(Api::STATS_HEADER, 0);
+    uint64_t clock = (uint64_t)(i + 1) * 100;
+    memcpy(&text[0], &clock, sizeof(clock));
+    for (int id = 0; id < STATS_CONNECTIONS; id++)
+    {
+        Api::StatsRecord record = {};
+        record.id = id;
+        record.state = Api::OPEN;
+        record.ip = htonl(0x7F000001);
+        record.port = 40000 + id;
+        record.bytesIn = (uint64_t)(i + 1) * 100 + (id % 10 ? 0 : (uint64_t)i * i * (1000 + id));
+        record.bytesOut = record.bytesIn / 2;
+        record.queued = id % 10 ? 0 : i % 7 * 4096;
+        text.append((const char *)&record, sizeof(record));
+    }
+    return message(Api::STATS_MAGIC, text);
+}
+
+static Sample resize(int rows, int cols)
+{
+    struct winsize ws = {(unsigned short)rows, (unsigned short)cols, 0, 0};
+    long start = now_us();
+    ioctl(master_fd, TIOCSWINSZ, &ws);
+    kill(child, SIGWINCH);
+    return settle(start);
+}
+
+static long percentile(std::vector<long> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void report(const char *name, std::vector<Sample> &samples, long cpu_us)
+{
+    std::vector<long> first, last;
+    long bytes = 0, silent = 0;
+    for (Sample &s : samples)
+    {
+        if (s.first_us < 0)
+        {
+            silent++;
+            continue;
+        }
+        first.push_back(s.first_us);
+        last.push_back(s.last_us);
+        bytes += s.bytes;
+    }
+    size_t n = samples.size();
+    long max_us = last.empty() ? 0 : *std::max_element(last.begin(), last.end());
+    printf("%-8s events=%-6zu first_byte_us p50=%-6ld p99=%-6ld settled_us p50=%-6ld p99=%-6ld max=%-6ld "
+           "bytes/event=%-8.1f cpu_us/event=%-8.1f silent=%ld\n",
+           name, n, percentile(first, 0.5), percentile(first, 0.99), percentile(last, 0.5),
+           percentile(last, 0.99), max_us, n ? (double)bytes / n : 0,
+           n ? (double)cpu_us / n : 0, silent);
+}
+
+template <typename Func>
+static void run(const char *name, int events, Func func)
+{
+    std::vector<Sample> samples;
+    samples.reserve(events);
+    long cpu = child_cpu_us();
+    for (int i = 0; i < events; i++)
+        samples.push_back(func(i));
+    report(name, samples, child_cpu_us() - cpu);
+}
+
+int main(int argc, char **argv)
+{
+    int events = 500;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+    {
+        if (opt == 'n')
+            events = atoi(optarg);
+        else if (opt == 's')
+            settle_us = atol(optarg);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n events] [-s settle_us] [typing|paste|flood|resize|search|stats...]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::vector<std::string> workloads(argv + optind, argv + argc);
+    if (workloads.empty())
+        workloads = {"typing", "paste", "flood", "resize", "search", "stats"};
+
+    char history[] = "/tmp/funny_gui_bench.XXXXXX";
+    if (!mkdtemp(history))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv("FUNNY_HISTORY", history, 1);
+    setenv("TERM", "xterm-256color", 0);
+
+    int pipefd[2];
+    pipe(pipefd);
+    struct winsize ws = {40, 120, 0, 0};
+    child = forkpty(&master_fd, NULL, NULL, &ws);
+    if (child < 0)
+    {
+        perror("forkpty");
+        return 1;
+    }
+    if (child == 0)
+    {
+        ::close(pipefd[1]);
+        funny::Gui gui = funny::Gui();
+        gui.attach_messages(pipefd[0]);
+        gui.loop();
+        return 0;
+    }
+    ::close(pipefd[0]);
+    message_fd = pipefd[1];
+    settle(now_us()); // initial paint
+
+    for (std::string &w : workloads)
+    {
+        if (w == "typing")
+        {
+            key("c", 1);
+            run("typing", events, [](int i)
+                { char c = 'a' + i % 26; return key(&c, 1); });
+            key("\n\x1b", 2);
+        }
+        else if (w == "paste")
+        {
+            std::string paste(4096, 'p');
+            key("c", 1);
+            run("paste", events / 50 + 1, [&paste](int)
+                { return key(paste.data(), paste.size()); });
+            key("\n\x1b", 2);
+        }
+        else if (w == "flood")
+            run("flood", events, [](int i)
+                { return message(i % 200, "incoming message " + std::to_string(i)); });
+        else if (w == "resize")
+            run("resize", events / 10 + 1, [](int i)
+                { return i % 2 ? resize(40, 120) : resize(24, 80); });
+        else if (w == "stats")
+        {
+            // The dashboard draws on its own interval, give it room to
+            long settle = settle_us;
+            settle_us = std::max(settle_us, (long)funny::Dashboard::DRAW_INTERVAL * 1500);
+            run("stats", events / 10 + 1, stats);
+            settle_us = settle;
+        }
+        else if (w == "search")
+            run("search", events / 10 + 1, [](int i)
+                { std::string cmd = ":search message " + std::to_string(i) + "\n"; return key(cmd.data(), cmd.size()); });
+        else
+            fprintf(stderr, "unknown workload %s\n", w.c_str());
+    }
+
+    key("\x1bq", 2);
+    ::close(message_fd);
+    int status;
+    waitpid(child, &status, 0);
+    std::string rm = std::string("rm -rf ") + history;
+    system(rm.c_str());
+    return 0;
+}
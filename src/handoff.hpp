@@ -0,0 +1,414 @@
+#pragma once
+#include "main.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* ** Hot restart **
+ *  A daemon started with --handoff PATH listens on a unix socket. A new binary started with
+ *  --takeover PATH connects to it and receives, via SCM_RIGHTS, the listening socket, both
+ *  api pipe ends, the udp socket and every connection socket together with its id, state,
+ *  framing tail, pre-accept buffer, output weight, cork, cluster home, outbox peer name and
+ *  subscriptions. Udp peers come along by address. Peers and the controller keep their
+ *  sockets and ids.
+ *
+ *  A compressed, multiplexed or resumable stream can't continue without its codec's history,
+ *  its channels or what its session kept, none of which is transferred. While one is open the
+ *  handoff is refused and the old process keeps serving.
+ *
+ *  The old process stops the api channel at a frame boundary, flushes its output queue and
+ *  only then sends its state, so the new process never writes to the controller before the
+ *  old one is done. Api bytes read ahead but not yet handled travel along, and so do the
+ *  bytes of a connection that its socket didn't take yet, pending sends and corked ones.
+ *  Datagrams still queued on the udp socket are lost. The new process reads everything
+ *  before it takes a single connection; the old one exits once it acknowledged and goes on
+ *  serving if the transfer broke off.
+ *
+ *  Stream layout: HandoffHeader + [listen, api in, api out, udp] fds and the unread api
+ *  bytes, then per connection HandoffRecord + its fd, none for a udp peer, followed by ip,
+ *  pre-accept bytes, framing tail, peer name, subscriptions as [u16 length][pattern] and
+ *  unsent bytes. One ack byte back, 1 if the new process took over.
+ */
+namespace Api
+{
+    struct HandoffHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t count;
+        uint32_t apiLength;
+        // The udp socket is the fourth fd
+        uint32_t udp;
+    };
+
+    struct HandoffRecord
+    {
+        uint8_t id;
+        uint8_t accepted;
+        uint8_t established;
+        uint8_t framing;
+        uint32_t framingSize;
+        uint16_t port;
+        uint8_t weight;
+        uint8_t ipLength;
+        uint8_t datagram;
+        uint32_t preLength;
+        uint32_t pendingLength;
+        int32_t home;
+        uint32_t corkBytes;
+        uint32_t corkDelay;
+        uint16_t peerLength;
+        uint16_t subscriptionCount;
+        uint32_t subscriptionsLength;
+        uint32_t unsentLength;
+    };
+
+    const uint32_t HANDOFF_MAGIC = 0x48594e46; // "FNYH"
+    const uint32_t HANDOFF_VERSION = 4;
+    const int HANDOFF_MAX_FDS = 4;
+
+    bool handoffRequested = false;
+    std::string handoffPath;
+    int handoffFd = -1, handoffPeer = -1;
+    // Taken over from the old process, -1 if it served no udp
+    int handoffUdpFd = -1;
+    Watch handoffWatch;
+
+    bool handoff_send_fds(int sock, const void *data, size_t length, const int *fds, int count)
+    {
+        char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct iovec iov = {(void *)data, length};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (count > 0)
+        {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+        }
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)length)
+            return false;
+        return true;
+    }
+
+    // Reads exactly length bytes, fds travel with the first segment of the message. Those that
+    // weren't sent stay -1
+    bool handoff_recv_fds(int sock, void *data, size_t length, int *fds, int count)
+    {
+        char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        char *iter = (char *)data;
+        std::fill(fds, fds + count, -1);
+        bool gotFds = false;
+        while (length > 0)
+        {
+            struct iovec iov = {iter, length};
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t m = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (m <= 0)
+                return false;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && !gotFds)
+                {
+                    int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * std::min(received, count));
+                    gotFds = true;
+                }
+            iter += m;
+            length -= m;
+        }
+        return true;
+    }
+
+    bool handoff_send_all(int sock, const char *data, size_t length) { return buffer_send_all(sock, data, length); }
+
+    // Connections that can't be handed over, see above
+    int handoff_blockers()
+    {
+        int count = 0;
+        connectionsLock.lock();
+        for (auto &connection : connections)
+            if (connection && !connection->isClosed() && (connection->codec || connection->mux || connection->channel || connection->session))
+                count++;
+        connectionsLock.unlock();
+        return count;
+    }
+
+    // Old process, loop thread: the next binary connected
+    void handoff_on_request()
+    {
+        int peer = accept4(handoffFd, NULL, NULL, SOCK_CLOEXEC);
+        if (peer < 0 || handoffRequested)
+        {
+            if (peer >= 0)
+                close(peer);
+            return;
+        }
+        if (int blockers = handoff_blockers())
+        { // The new process reads end of file and gives up
+            log_error("  Handoff refused, {} compressed, multiplexed or resumable connections can't be transferred", blockers);
+            close(peer);
+            return;
+        }
+        handoffPeer = peer;
+        loop.remove(&handoffWatch);
+        close(handoffFd);
+        // Free the path right away, the new process listens on it once it took over
+        unlink(handoffPath.c_str());
+        log_info("Handing over to a new process");
+        handoffRequested = true;
+        apiChannel.cancel();
+    }
+
+    void handoff_listen(const std::string &path)
+    {
+        handoffPath = path;
+        handoffFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+        if (bind(handoffFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(handoffFd, 1) < 0)
+        {
+            log_error("  Handoff socket {} failed: {}", path, strerror(errno));
+            close(handoffFd);
+            handoffFd = -1;
+            return;
+        }
+        handoffWatch.fd = handoffFd;
+        handoffWatch.onEvents = [](uint32_t)
+        { handoff_on_request(); };
+        loop.add(&handoffWatch, EPOLLIN);
+    }
+
+    // Old process, loop thread, after start_api stopped. True once the new process took over,
+    // otherwise this one goes on serving
+    bool handoff_send(int listenFd)
+    {
+        int sock = handoffPeer;
+        handoffPeer = -1;
+        // Opened between the request and the end of the api channel
+        if (int blockers = handoff_blockers())
+        {
+            log_error("  Handoff refused, {} compressed, multiplexed or resumable connections can't be transferred", blockers);
+            close(sock);
+            return false;
+        }
+        std::vector<std::shared_ptr<Connection>> live;
+        connectionsLock.lock();
+        for (auto &connection : connections)
+            if (connection && !connection->isClosed())
+                live.push_back(connection);
+        connectionsLock.unlock();
+        output.close();
+
+        std::vector<char> unread = apiChannel.buffered();
+        HandoffHeader header = {HANDOFF_MAGIC, HANDOFF_VERSION, (uint32_t)live.size(), (uint32_t)unread.size(), udp.fd >= 0};
+        int fds[HANDOFF_MAX_FDS] = {listenFd, API_IN_FILENO, API_OUT_FILENO, udp.fd};
+        bool ok = handoff_send_fds(sock, &header, sizeof(header), fds, header.udp ? 4 : 3) &&
+                  handoff_send_all(sock, unread.data(), unread.size());
+        for (auto &connection : live)
+        {
+            if (!ok)
+                break;
+            std::vector<char> pre;
+            connection->iteratePreMessageBufferChunks([&pre](char *iter, int length)
+                                                      { pre.insert(pre.end(), iter, iter + length); });
+            const std::vector<char> &pending = connection->framer.buffered_bytes();
+            const std::vector<std::string> &patterns = topics.subscriptions(connection->getId());
+            std::vector<char> subscriptions;
+            for (const std::string &pattern : patterns)
+            {
+                uint16_t length = pattern.size();
+                subscriptions.insert(subscriptions.end(), (char *)&length, (char *)&length + sizeof(length));
+                subscriptions.insert(subscriptions.end(), pattern.begin(), pattern.end());
+            }
+            // What waits for the socket goes first, what was corked after it
+            std::vector<char> unsent;
+            for (IoWait *wait = connection->sendWait; wait; wait = wait->next)
+                wait->unwritten(unsent);
+            unsent.insert(unsent.end(), connection->corked.begin(), connection->corked.end());
+            HandoffRecord record = {connection->getId(), connection->isAccepted(), connection->established,
+                                    connection->framer.mode, connection->framer.size, (uint16_t)connection->port,
+                                    (uint8_t)output.weight(connection->getId()), (uint8_t)connection->ip.size(), connection->datagram,
+                                    (uint32_t)pre.size(), (uint32_t)pending.size(), connection->home,
+                                    (uint32_t)connection->corkBytes, connection->corkDelay, (uint16_t)connection->peer.size(),
+                                    (uint16_t)patterns.size(), (uint32_t)subscriptions.size(), (uint32_t)unsent.size()};
+            ok = handoff_send_fds(sock, &record, sizeof(record), &connection->fd, connection->datagram ? 0 : 1) &&
+                 handoff_send_all(sock, connection->ip.data(), connection->ip.size()) &&
+                 handoff_send_all(sock, pre.data(), pre.size()) &&
+                 handoff_send_all(sock, pending.data(), pending.size()) &&
+                 handoff_send_all(sock, connection->peer.data(), connection->peer.size()) &&
+                 handoff_send_all(sock, subscriptions.data(), subscriptions.size()) &&
+                 handoff_send_all(sock, unsent.data(), unsent.size());
+            // Pre-accept bytes were taken out of the connection to send them
+            if (!pre.empty())
+                connection->addToPreMessageBuffer(pre.data(), pre.size());
+        }
+        char ack = 0;
+        ok = ok && buffer_read_all(sock, &ack, 1) && ack == 1;
+        close(sock);
+        if (!ok)
+        {
+            output.reopen();
+            log_error("  Handoff failed, serving on");
+            return false;
+        }
+        for (auto &connection : live)
+            if (!connection->datagram)
+                loop.remove(&connection->watch);
+        udp.close();
+        return true;
+    }
+
+    // What the new process read of one connection
+    struct HandoffConnection
+    {
+        HandoffRecord record;
+        int fd;
+        std::string ip, peer;
+        std::vector<char> pre, pending, subscriptions, unsent;
+    };
+
+    bool handoff_recv_connection(int sock, HandoffConnection &c)
+    {
+        if (!handoff_recv_fds(sock, &c.record, sizeof(c.record), &c.fd, 1))
+            return false;
+        if (c.fd < 0 && !c.record.datagram)
+            return false;
+        c.ip.resize(c.record.ipLength);
+        c.peer.resize(c.record.peerLength);
+        c.pre.resize(c.record.preLength);
+        c.pending.resize(c.record.pendingLength);
+        c.subscriptions.resize(c.record.subscriptionsLength);
+        c.unsent.resize(c.record.unsentLength);
+        return buffer_read_all(sock, c.ip.data(), c.ip.size()) && buffer_read_all(sock, c.pre.data(), c.pre.size()) &&
+               buffer_read_all(sock, c.pending.data(), c.pending.size()) && buffer_read_all(sock, c.peer.data(), c.peer.size()) &&
+               buffer_read_all(sock, c.subscriptions.data(), c.subscriptions.size()) &&
+               buffer_read_all(sock, c.unsent.data(), c.unsent.size());
+    }
+
+    // New process, false if the id is taken
+    bool handoff_restore(HandoffConnection &c)
+    {
+        HandoffRecord &record = c.record;
+        std::shared_ptr<Connection> connection = connection_new(c.ip, record.port);
+        connection->fd = c.fd;
+        connection->watch.fd = c.fd;
+        connection->datagram = record.datagram;
+        connection->setAccepted(record.accepted);
+        connection->framer = Framer((FramingMode)record.framing, record.framingSize);
+        connection->framer.restore(c.pending.data(), c.pending.size());
+        connection->addToPreMessageBuffer(c.pre.data(), c.pre.size());
+        connection->home = record.home;
+        connection->peer = c.peer;
+        if (!connection_register_as(connection, record.id))
+            return false;
+        output.set_weight(record.id, record.weight);
+        connection_set_cork(connection, record.corkBytes, record.corkDelay);
+        for (size_t at = 0; at + sizeof(uint16_t) <= c.subscriptions.size();)
+        {
+            uint16_t length;
+            memcpy(&length, &c.subscriptions[at], sizeof(length));
+            at += sizeof(length);
+            topics.subscribe(record.id, std::string_view(&c.subscriptions[at], std::min<size_t>(length, c.subscriptions.size() - at)));
+            at += length;
+        }
+        if (record.datagram)
+        {
+            connection->remote.sin_family = AF_INET;
+            connection->remote.sin_port = htons(record.port);
+            inet_pton(AF_INET, c.ip.c_str(), &connection->remote.sin_addr);
+            connection->established = true;
+            udpPeers[(uint64_t)connection->remote.sin_addr.s_addr << 16 | connection->remote.sin_port] = connection;
+            loop.post([connection, unsent = std::move(c.unsent)]() mutable
+                      {
+                          connection->touch();
+                          connection_arm_timers(connection);
+                          if (!unsent.empty())
+                              connection_send_copy(connection, std::move(unsent)); });
+        }
+        else if (record.established)
+            loop.post([connection, unsent = std::move(c.unsent)]() mutable
+                      {
+                          connection_start(connection);
+                          if (!unsent.empty())
+                              connection_send_copy(connection, std::move(unsent)); });
+        else
+            connection_await_connect(connection);
+        return true;
+    }
+
+    // New process, before the loop runs. Returns the inherited listening socket, -1 on failure.
+    // Nothing is taken over unless every connection arrived, the old process keeps them otherwise
+    int handoff_takeover(const std::string &path)
+    {
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        HandoffHeader header;
+        int fds[HANDOFF_MAX_FDS];
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            !handoff_recv_fds(sock, &header, sizeof(header), fds, HANDOFF_MAX_FDS) || header.magic != HANDOFF_MAGIC ||
+            header.version != HANDOFF_VERSION || header.apiLength > ApiChannel::BUFFER || fds[0] < 0 || fds[1] < 0 || fds[2] < 0)
+        {
+            fprintf(stderr, "[handoff] takeover from %s failed: %s\n", path.c_str(), strerror(errno));
+            for (int fd : fds)
+                if (fd >= 0)
+                    close(fd);
+            close(sock);
+            return -1;
+        }
+        std::vector<char> unread(header.apiLength);
+        std::vector<HandoffConnection> received(header.count);
+        std::bitset<MAX_CONNECTIONS> ids;
+        bool ok = buffer_read_all(sock, unread.data(), unread.size());
+        for (HandoffConnection &c : received)
+        {
+            c.fd = -1;
+            ok = ok && handoff_recv_connection(sock, c) && c.record.id < MAX_CONNECTIONS && !ids[c.record.id];
+            if (ok)
+                ids.set(c.record.id);
+        }
+        char ack = ok;
+        if (write(sock, &ack, 1) != 1)
+            ok = false;
+        close(sock);
+        if (!ok)
+        {
+            fprintf(stderr, "[handoff] transfer from %s broke off, the old process keeps serving\n", path.c_str());
+            for (HandoffConnection &c : received)
+                if (c.fd >= 0)
+                    close(c.fd);
+            for (int fd : fds)
+                if (fd >= 0)
+                    close(fd);
+            return -1;
+        }
+        dup2(fds[1], API_IN_FILENO);
+        dup2(fds[2], API_OUT_FILENO);
+        close(fds[1]);
+        close(fds[2]);
+        handoffUdpFd = fds[3];
+        apiChannel.restore(unread.data(), unread.size());
+
+        int restored = 0;
+        for (HandoffConnection &c : received)
+            if (handoff_restore(c))
+                restored++;
+        log_info("Took over {} connections", restored);
+        return fds[0];
+    }
+}
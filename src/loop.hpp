@@ -0,0 +1,156 @@
+#pragma once
+#include "timer_wheel.hpp"
+#include "poller.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <thread>
+
+/* ** Event loop **
+ *  One epoll reactor thread owns all sockets and the timer wheel (1 tick = 1 ms).
+ *  Other threads hand work to it with post(), which wakes the loop through an eventfd.
+ *  Posted functions run after the events of the current epoll batch were dispatched,
+ *  so releasing an object from a posted function never invalidates a pending event.
+ *  How the thread waits for events is up to its Poller, set it up before run().
+ */
+namespace Api
+{
+    struct Watch
+    {
+        int fd = -1;
+        std::function<void(uint32_t events)> onEvents;
+    };
+
+    class Loop
+    {
+    public:
+        static const int MAX_EVENTS = 256;
+
+        Poller poller;
+
+        Loop()
+        {
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epollFd < 0 || wakeFd < 0)
+            {
+                perror("[Loop] epoll/eventfd");
+                exit(1);
+            }
+            wakeWatch.fd = wakeFd;
+            wakeWatch.onEvents = [this](uint32_t)
+            {
+                uint64_t v;
+                while (read(wakeFd, &v, sizeof(v)) > 0)
+                    ;
+            };
+            add(&wakeWatch, EPOLLIN);
+            start = now_ms();
+        }
+        ~Loop()
+        {
+            close(wakeFd);
+            close(epollFd);
+        }
+
+        // add/modify/remove may be called from any thread
+        bool add(Watch *watch, uint32_t events) { return ctl(EPOLL_CTL_ADD, watch, events); }
+        bool modify(Watch *watch, uint32_t events) { return ctl(EPOLL_CTL_MOD, watch, events); }
+        void remove(Watch *watch) { epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->fd, nullptr); }
+
+        void post(std::function<void()> func)
+        {
+            postedLock.lock();
+            if (posted.empty())
+                firstPost = Poller::now_ns();
+            posted.push_back(std::move(func));
+            postedLock.unlock();
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+
+        // Timers may only be touched from the loop thread, use post() elsewhere
+        void arm(Timer *timer, uint64_t ms) { timers.arm(timer, ms + (tick() - timers.ticks())); }
+        void cancel(Timer *timer) { timers.cancel(timer); }
+
+        void stop()
+        {
+            post([this]
+                 { stopped = true; });
+        }
+
+        // True on the thread inside run()
+        bool in_loop() const { return std::this_thread::get_id() == runner; }
+
+        void run()
+        {
+            runner = std::this_thread::get_id();
+            poller.start();
+            struct epoll_event events[MAX_EVENTS];
+            while (!stopped)
+            {
+                int n = poller.wait(epollFd, events, MAX_EVENTS, (int)timers.next_timeout());
+                for (int i = 0; i < n; i++)
+                {
+                    Watch *watch = (Watch *)events[i].data.ptr;
+                    watch->onEvents(events[i].events);
+                }
+                run_posted();
+                timers.advance(tick() + 1);
+            }
+        }
+
+        static uint64_t now_ms()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        }
+
+    private:
+        int epollFd, wakeFd;
+        Watch wakeWatch;
+        TimerWheel timers;
+        uint64_t start;
+        bool stopped = false;
+        std::thread::id runner;
+        std::vector<std::function<void()>> posted, running;
+        std::mutex postedLock;
+        // When the oldest function in posted was posted
+        uint64_t firstPost = 0;
+
+        uint64_t tick() { return now_ms() - start; }
+
+        bool ctl(int op, Watch *watch, uint32_t events)
+        {
+            struct epoll_event ev;
+            ev.events = events;
+            ev.data.ptr = watch;
+            if (epoll_ctl(epollFd, op, watch->fd, &ev) < 0)
+            {
+                perror("[Loop] epoll_ctl");
+                return false;
+            }
+            return true;
+        }
+
+        void run_posted()
+        {
+            postedLock.lock();
+            running.swap(posted);
+            uint64_t since = firstPost;
+            postedLock.unlock();
+            if (!running.empty())
+                poller.post_latency(Poller::now_ns() - since);
+            for (auto &func : running)
+                func();
+            running.clear();
+        }
+    };
+}
@@ -1,18 +1,70 @@
+#pragma once
 #include "api.hpp"
-#include "tcpsocket.hpp"
+#include "loop.hpp"
+#include "resolver.hpp"
+#include "framing.hpp"
+#include "coro.hpp"
+#include "udp.hpp"
+#include "outbox.hpp"
+#include "topics.hpp"
+#include "admission.hpp"
+#include "arena.hpp"
+#include "compress.hpp"
+#include "mux.hpp"
+#include "session.hpp"
 #include <mutex>
 #include <functional>
 #include <vector>
+#include <array>
+#include <memory>
+#include <atomic>
 #include <algorithm>
+#include <unordered_map>
+#include <bitset>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 namespace Api
 {
+    // Timeouts are in milliseconds, 0 disables
+    struct Options
+    {
+        int listen_port = 8888;
+        uint64_t idle_timeout = 0;
+        uint64_t pre_accept_timeout = 60000;
+        uint64_t connect_timeout = 10000;
+        uint64_t heartbeat_interval = 0;
+        std::string heartbeat_payload = "\n";
+        Framer framing;
+        // 0 disables the udp transport
+        int udp_port = 0;
+        // How long a session waits for its peer to resume and how much it keeps for it, 0
+        // resume_port takes no resumptions
+        uint64_t session_linger = 30000;
+        size_t session_window = 1 << 20;
+        int resume_port = 0;
+    };
+
+    Options options;
+    Loop loop;
+    Resolver resolver;
+    UdpSocket udp(loop);
+    Outbox outbox;
+    TopicIndex<MAX_CONNECTIONS> topics;
+    Admission admission;
+    // Loop thread only, bytes copied for peers that haven't taken them yet
+    size_t sendBacklog = 0;
 
     class Connection
     {
     private:
-        std::array<char, MAX_PRE_MESSAGE_LENGTH> preMessageBuffer;
+        // MAX_PRE_MESSAGE_LENGTH bytes, taken by the first bytes that arrive before the accept
+        // and given back once they were delivered
+        std::unique_ptr<char[]> preMessageBuffer;
+        size_t preMessageBufferFill = 0;
 
         MagicType id;
         std::mutex id_lock;
@@ -24,48 +76,60 @@ namespace Api
     public:
         std::string ip;
         int port;
-        TCPSocket<> *socket;
-        char *preMessageBufferFreeSpace = preMessageBuffer.begin();
+        int fd = -1;
+        // False while an outbound connect is in flight
+        bool established = false;
+        // A udp peer, it has no fd of its own and every datagram is read as one chunk
+        bool datagram = false;
+        struct sockaddr_in remote;
+        // Loop thread only, where the connection's frames go
+        int home = LOCAL_HOME;
+        // The outbox keeps messages for this name while the peer is away
+        std::string peer;
+        Watch watch;
+        // Loop thread only
+        Framer framer = options.framing;
+        bool readThrottled = false;
+        // The suspended connection_send, resumed from watch on EPOLLOUT
+        IoWait *sendWait = nullptr;
+        // Loop thread only, while corkBytes is set sends gather in corked until it holds
+        // corkBytes or corkDelay us have passed since the first of them
+        std::vector<char> corked;
+        size_t corkBytes = 0;
+        uint32_t corkDelay = 0;
+        // Loop thread only, set while SET_COMPRESSION has the stream compressed both ways
+        std::unique_ptr<Codec> codec;
+        // Loop thread only, socket bytes since the connection was made and bytes copied for
+        // the peer that it hasn't taken yet, sent as STATS
+        uint64_t bytesIn = 0, bytesOut = 0;
+        size_t queued = 0;
+        // Set on a channel of carrier, which has no socket of its own. Loop thread only, the
+        // bytes either side may still send on it and what waits for the peer's window
+        uint16_t channel = 0;
+        std::weak_ptr<Connection> carrier;
+        uint32_t sendWindow = 0, receiveWindow = 0;
+        std::vector<char> channelPending;
+        // Loop thread only, set on a carrier of channels
+        std::unique_ptr<Mux> mux;
+        // Loop thread only, set while SESSION keeps the connection resumable. fd is -1 while
+        // the session is suspended
+        std::unique_ptr<Session> session;
         std::mutex preMessageBufferLock;
 
+        // Loop thread only
+        Timer idleTimer, preAcceptTimer, connectTimer, heartbeatTimer, corkTimer, ackTimer, lingerTimer;
+        // Written by the loop and api threads, checked lazily when idleTimer fires
+        std::atomic<uint64_t> lastActivity{0};
+
         Connection(std::string ip, int port)
         {
-            // preMessageBuffer.begin()
             this->ip = ip;
             this->port = port;
         }
         ~Connection()
         {
-            if (!isClosed())
-                socket->Close();
-        }
-        void createSocket()
-        {
-            (*socket) = TCPSocket<>([](int errorCode, std::string errorMessage)
-                                    { log_info("Socket creation error: %d : %s", errorCode, errorMessage); });
-
-            socket->onRawMessageReceived = [this](const char *message, int length)
-            {
-                api_message(getId(), message, length);
-            };
-
-            socket->onSocketClosed = [this](int errorCode)
-            {
-                log_info("Connection %d closed: %d", getId(), errorCode);
-                this->setClosed();
-            };
-
-            socket->Connect(
-                ip, port, [this] { // TODO Send accept to api out
-                    log_info("Connection %d accepted", getId());
-                    this->setAccepted();
-                },
-                [this](int errorCode, std::string errorMessage)
-                {
-                    // TODO Connection refused
-                    this->setAccepted(false);
-                    log_info("Connection failed: %d : %s", errorCode, errorMessage);
-                });
+            if (fd >= 0)
+                close(fd);
         }
 
         void setId(MagicType newId)
@@ -84,10 +148,7 @@ namespace Api
             return idCopy;
         }
 
-        void sendMessage(char *messageBuffer, MessageLengthType messageLength)
-        {
-            buffer_send_socket_all(socket, messageBuffer, messageLength);
-        }
+        void touch() { lastActivity.store(Loop::now_ms(), std::memory_order_relaxed); }
 
         void setClosed()
         {
@@ -125,70 +186,1373 @@ namespace Api
         void iteratePreMessageBufferChunks(Func func)
         {
             preMessageBufferLock.lock();
-            int m = ((uintptr_t)preMessageBufferFreeSpace) / MAX_MESSAGE_LENGTH;
-            char *iter = preMessageBuffer.begin();
-            for (int i = 0; i < m; i++)
+            for (size_t done = 0; done < preMessageBufferFill;)
             {
-                iter += i * MAX_MESSAGE_LENGTH;
-                func(iter, MAX_MESSAGE_LENGTH);
+                int n = std::min<size_t>(preMessageBufferFill - done, MAX_MESSAGE_LENGTH);
+                func(preMessageBuffer.get() + done, n);
+                done += n;
             }
-            int n = ((uintptr_t)preMessageBufferFreeSpace) - m * MAX_MESSAGE_LENGTH;
-            if (n > 0)
+            preMessageBuffer.reset();
+            preMessageBufferFill = 0;
+            preMessageBufferLock.unlock();
+        }
+
+        size_t preMessageBufferUsed()
+        {
+            std::lock_guard<std::mutex> guard(preMessageBufferLock);
+            return preMessageBufferFill;
+        }
+
+        bool addToPreMessageBuffer(const char *buffer, int length)
+        {
+            preMessageBufferLock.lock();
+            int d = preMessageBufferFill + length - MAX_PRE_MESSAGE_LENGTH;
+            if (d > 0)
             {
-                func(iter, n);
+                preMessageBufferLock.unlock();
+                log_info("Message buffer overflow from {}:{} by {} bytes", ip, port, d);
+                return false;
             }
+            if (!preMessageBuffer)
+                preMessageBuffer = std::make_unique<char[]>(MAX_PRE_MESSAGE_LENGTH);
+            memcpy(preMessageBuffer.get() + preMessageBufferFill, buffer, length);
+            preMessageBufferFill += length;
             preMessageBufferLock.unlock();
+            return true;
         }
 
-        void addToPreMessageBuffer(const char *buffer, int length)
+        // Datagrams keep their boundaries, each is stored behind its u16 length
+        bool addDatagramToPreMessageBuffer(const char *buffer, MessageLengthType length)
         {
+            char prefix[sizeof(length)];
+            memcpy(prefix, &length, sizeof(length));
             preMessageBufferLock.lock();
-            int d = length - (preMessageBuffer.end() - preMessageBufferFreeSpace);
-            if (d > 0)
+            bool fits = preMessageBufferFill + sizeof(length) + length <= (size_t)MAX_PRE_MESSAGE_LENGTH;
+            if (fits)
             {
-                log_info("Message buffer overflow from %s:%d by %d bytes", ip, port, d);
-                return;
+                if (!preMessageBuffer)
+                    preMessageBuffer = std::make_unique<char[]>(MAX_PRE_MESSAGE_LENGTH);
+                memcpy(preMessageBuffer.get() + preMessageBufferFill, prefix, sizeof(length));
+                memcpy(preMessageBuffer.get() + preMessageBufferFill + sizeof(length), buffer, length);
+                preMessageBufferFill += sizeof(length) + length;
+            }
+            preMessageBufferLock.unlock();
+            if (!fits)
+                log_info("Message buffer overflow from {}:{}, datagram of {} bytes dropped", ip, port, length);
+            return fits;
+        }
+
+        template <typename Func>
+        void iteratePreMessageBufferDatagrams(Func func)
+        {
+            preMessageBufferLock.lock();
+            for (size_t done = 0; done < preMessageBufferFill;)
+            {
+                MessageLengthType length;
+                char *iter = preMessageBuffer.get() + done;
+                memcpy(&length, iter, sizeof(length));
+                func(iter + sizeof(length), length);
+                done += sizeof(length) + length;
             }
-            memcpy(preMessageBufferFreeSpace, buffer, length);
-            preMessageBufferFreeSpace += length;
+            preMessageBuffer.reset();
+            preMessageBufferFill = 0;
             preMessageBufferLock.unlock();
         }
     };
 
-    std::vector<Connection> connections;
+    // From the arena while it is enabled
+    std::shared_ptr<Connection> connection_new(const std::string &ip, int port)
+    {
+        return std::allocate_shared<Connection>(ArenaAllocator<Connection>(), ip, port);
+    }
+
+    // Ids are slots, a connection keeps its id for its whole lifetime
+    std::array<std::shared_ptr<Connection>, MAX_CONNECTIONS> connections;
     std::mutex connectionsLock;
+    // Ids owned by other nodes of the cluster, never handed out here
+    std::bitset<MAX_CONNECTIONS> foreignIds;
+    // Loop thread only, the peer a closed id belonged to until the id is taken again
+    std::array<std::string, MAX_CONNECTIONS> closedPeers;
 
-    void connection_destroy_by_id(MagicType connId)
+    std::shared_ptr<Connection> connection_get(MagicType connId)
     {
+        if (connId >= MAX_CONNECTIONS)
+            return nullptr;
         connectionsLock.lock();
-        if (connId < connections.size() - 1)
-            std::iter_swap(connections.begin() + connId, connections.end() - 1);
-        // std::swap(connections[connId], connections.back());
-        connections.pop_back();
+        std::shared_ptr<Connection> connection = connections[connId];
         connectionsLock.unlock();
+        return connection;
     }
 
-    void connection_destroy(Connection connection)
+    // Returns the connection id, MAX_CONNECTIONS if every slot is taken
+    MagicType connection_register(std::shared_ptr<Connection> connection)
     {
         connectionsLock.lock();
-        MagicType id = connection.getId();
-        if (id < connections.size() - 1)
+        MagicType id = 0;
+        while (id < MAX_CONNECTIONS && (connections[id] || foreignIds[id]))
+            id++;
+        if (id < MAX_CONNECTIONS)
         {
-            std::iter_swap(connections.begin() + id, connections.end() - 1);
+            connection->setId(id);
+            connections[id] = connection;
         }
-        // std::swap(connections[id], connections.back());
-        connections.pop_back();
         connectionsLock.unlock();
+        if (id < MAX_CONNECTIONS)
+        {
+            output.set_weight(id, 0);
+            closedPeers[id].clear();
+        }
+        return id;
     }
 
-    // Returns the connection id
-    MagicType connnection_register(Connection *connection)
+    // Takes the given id, used when connections are handed over from another process
+    bool connection_register_as(std::shared_ptr<Connection> connection, MagicType id)
     {
         connectionsLock.lock();
-        MagicType id = connections.size();
-        connection->setId(id);
-        connections.push_back(*connection);
+        bool free = id < MAX_CONNECTIONS && !connections[id];
+        if (free)
+        {
+            connection->setId(id);
+            connections[id] = connection;
+        }
         connectionsLock.unlock();
-        return id;
+        return free;
+    }
+
+    // Channels are sent to, read and closed through their carrier, see the channel_ functions below
+    void channel_send(std::shared_ptr<Connection> channel, const char *buf, size_t length);
+    void channel_open_window(std::shared_ptr<Connection> channel);
+    void channel_detach(std::shared_ptr<Connection> channel, bool notify);
+    bool carrier_demux(std::shared_ptr<Connection> carrier, const char *buf, size_t length, FrameBatch &batch, bool shed);
+    // Sessions outlive their links, see the session_ functions below
+    void session_ack(std::shared_ptr<Connection> connection);
+    void session_suspend(std::shared_ptr<Connection> connection, DisconnectReason reason);
+    bool connection_encode(const std::shared_ptr<Connection> &connection, const char *buf, size_t length, std::vector<char> &out);
+
+    // Loop thread only, reads unless throttled, waits for EPOLLOUT while a send is stuck
+    void connection_update_events(std::shared_ptr<Connection> connection)
+    {
+        if (connection->isClosed() || !connection->established || connection->fd < 0)
+            return;
+        uint32_t events = connection->readThrottled ? 0 : (uint32_t)EPOLLIN;
+        if (connection->sendWait)
+            events |= EPOLLOUT;
+        loop.modify(&connection->watch, events);
+    }
+
+    void connection_log_compression(std::shared_ptr<Connection> connection)
+    {
+        const Codec::Stats &stats = connection->codec->stats;
+        log_info("Connection {} compression: sent {} bytes as {}, received {} as {}, {} of {} blocks stored, {} us encoding, {} us decoding",
+                 connection->getId(), stats.rawOut, stats.wireOut, stats.rawIn, stats.wireIn, stats.blocksStored, stats.blocksOut,
+                 stats.encodeNs / 1000, stats.decodeNs / 1000);
+    }
+
+    // Loop thread only, suspended senders fail, resumed once the caller is done
+    void connection_fail_senders(std::shared_ptr<Connection> connection)
+    {
+        while (IoWait *wait = connection->sendWait)
+        {
+            connection->sendWait = wait->next;
+            wait->fail();
+            loop.post([wait]
+                      { wait->handle.resume(); });
+        }
+    }
+
+    // Loop thread only
+    void connection_close(std::shared_ptr<Connection> connection, DisconnectReason reason)
+    {
+        if (connection->isClosed())
+            return;
+        connection->setClosed();
+        loop.remove(&connection->watch);
+        loop.cancel(&connection->idleTimer);
+        loop.cancel(&connection->preAcceptTimer);
+        loop.cancel(&connection->connectTimer);
+        loop.cancel(&connection->heartbeatTimer);
+        loop.cancel(&connection->corkTimer);
+        loop.cancel(&connection->ackTimer);
+        loop.cancel(&connection->lingerTimer);
+        if (connection->channel)
+            channel_detach(connection, reason != PEER_CLOSED);
+        if (connection->mux)
+            for (auto [number, id] : std::exchange(connection->mux->channels, {}))
+                if (std::shared_ptr<Connection> channel = connection_get(id))
+                    connection_close(channel, reason);
+        // What was gathered goes out as far as the socket takes it now, the FIN follows it
+        size_t lost = connection->corked.size();
+        if (!connection->corked.empty() && !connection->sendWait && connection->fd >= 0)
+        {
+            std::vector<char> tail;
+            if (!connection_encode(connection, connection->corked.data(), connection->corked.size(), tail))
+                tail = std::move(connection->corked);
+            size_t done = 0;
+            while (done < tail.size())
+            {
+                ssize_t m = ::send(connection->fd, tail.data() + done, tail.size() - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m <= 0)
+                    break;
+                done += m;
+            }
+            if (done > 0)
+            {
+                capture.record(Capture::SOCKET_WRITE, connection->getId(), tail.data(), done);
+                connection->bytesOut += done;
+            }
+            lost = tail.size() - done;
+        }
+        if (lost)
+            log_error("  Connection {} closed with {} corked bytes unsent", connection->getId(), lost);
+        connection->corked.clear();
+        if (connection->codec)
+            connection_log_compression(connection);
+        if (connection->session && connection->session->resumes)
+            log_info("Connection {} session: resumed {} times, {} bytes sent again", connection->getId(), connection->session->resumes, connection->session->resent);
+        if (connection->fd >= 0)
+            shutdown(connection->fd, SHUT_RDWR);
+        connection_fail_senders(connection);
+
+        MagicType id = connection->getId();
+        char reasonByte = reason;
+        capture.record(Capture::SOCKET_CLOSE, id, &reasonByte, 1);
+        connectionsLock.lock();
+        if (connections[id] == connection)
+            connections[id] = nullptr;
+        connectionsLock.unlock();
+        if (outbox.enabled() && connection->established)
+            closedPeers[id] = connection->peer;
+        topics.unsubscribe_all(id);
+        if (connection->established)
+            api_disconnect(id, reason, connection->home);
+        else
+            api_connect_failed(reason, connection->ip, connection->port, connection->home);
+        // Keep the object alive until the current epoll batch is dispatched
+        loop.post([connection] {});
+    }
+
+    void connection_destroy_by_id(MagicType connId, DisconnectReason reason)
+    {
+        loop.post([connId, reason]
+                  {
+                      std::shared_ptr<Connection> connection = connection_get(connId);
+                      if (connection)
+                          connection_close(connection, reason); });
+    }
+
+    bool connection_frame_plain(std::shared_ptr<Connection> connection, const char *buf, int length, FrameBatch &batch, bool shed)
+    {
+        MagicType id = connection->getId();
+        if (shed) // Whole messages are dropped so the framing stays intact
+            return connection->framer.feed(buf, length, MAX_MESSAGE_LENGTH, [](const char *, size_t)
+                                           { admission.shed++; });
+        if (controller) // In process, messages are handed over straight from the read buffer
+            return connection->framer.feed(buf, length, MAX_MESSAGE_LENGTH, [id](const char *message, size_t messageLength)
+                                           { controller->on_message(id, {message, messageLength}); });
+        if (connection->home != LOCAL_HOME)
+        { // Claimed by the controller of another cluster node
+            std::vector<char> frames;
+            bool ok = connection->framer.feed(buf, length, MAX_MESSAGE_LENGTH, [&frames, id](const char *message, size_t messageLength)
+                                              { append_buffer(frames, id, message, messageLength); });
+            if (!frames.empty())
+                api_forward(connection->home, std::move(frames));
+            return ok;
+        }
+        return connection->framer.feed(buf, length, MAX_MESSAGE_LENGTH, [&batch, id](const char *message, size_t messageLength)
+                                       { batch.add(id, message, messageLength); });
+    }
+
+    // Loop thread only, frames are collected into batch and written by the caller, unless shed drops them
+    bool connection_frame(std::shared_ptr<Connection> connection, const char *buf, int length, FrameBatch &batch, bool shed = false)
+    {
+        if (!connection->codec && !connection->mux && !connection->session)
+            return connection_frame_plain(connection, buf, length, batch, shed);
+        if (!connection->codec && !connection->session)
+            return carrier_demux(connection, buf, length, batch, shed);
+        std::vector<char> plain;
+        if (connection->session)
+        {
+            if (!connection->session->unwrap(buf, length, plain))
+                return false;
+            session_ack(connection);
+        }
+        else if (!connection->codec->decode(buf, length, plain))
+            return false;
+        if (connection->mux)
+            return carrier_demux(connection, plain.data(), plain.size(), batch, shed);
+        // Raw framing hands each piece over as a message, so pieces have to fit a frame
+        for (size_t done = 0; done < plain.size(); done += MAX_MESSAGE_LENGTH)
+            if (!connection_frame_plain(connection, plain.data() + done, std::min<size_t>(plain.size() - done, MAX_MESSAGE_LENGTH), batch, shed))
+                return false;
+        return true;
+    }
+
+    void connection_on_readable(std::shared_ptr<Connection> connection)
+    {
+        static char buf[MAX_MESSAGE_LENGTH];
+        static FrameBatch batch;
+        bool closing = false;
+        DisconnectReason reason;
+        MagicType id = connection->getId();
+        // The first sampled read of this wakeup, its frames leave with the batch
+        uint64_t batchTrace = 0;
+        // Bounded number of reads per wakeup so one busy peer can't starve the loop
+        int budget = admission.read_budget();
+        // Overloaded, messages of low priority peers are dropped
+        bool shed = admission.level == Admission::OVERLOADED && connection->home == LOCAL_HOME && admission.sheds(output.weight(id));
+        for (int i = 0; i < budget && !closing; i++)
+        {
+            uint64_t readStart = tracer.enabled ? Tracer::now() : 0;
+            int m = recv(connection->fd, buf, MAX_MESSAGE_LENGTH, 0);
+            if (m == 0)
+            {
+                closing = true;
+                reason = PEER_CLOSED;
+                break;
+            }
+            if (m < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+                closing = true;
+                reason = SOCKET_ERROR;
+                break;
+            }
+            connection->touch();
+            connection->bytesIn += m;
+            capture.record(Capture::SOCKET_READ, id, buf, m);
+            uint64_t trace = tracer.sample();
+            if (trace)
+            {
+                tracer.span(trace, "socket read", id, readStart);
+                batchTrace = batchTrace ? batchTrace : trace;
+            }
+            TraceScope scope(trace);
+            if (connection->isAccepted())
+            {
+                TraceSpan span("framing", id);
+                if (!connection_frame(connection, buf, m, batch, shed))
+                {
+                    closing = true;
+                    reason = FRAMING_ERROR;
+                }
+            }
+            else
+            {
+                TraceSpan span("pre-accept buffer", id);
+                if (!connection->addToPreMessageBuffer(buf, m))
+                {
+                    closing = true;
+                    reason = SOCKET_ERROR;
+                }
+            }
+        }
+        // Everything read in this wakeup goes out with one write, before a possible DISCONNECT
+        {
+            TraceScope scope(batchTrace);
+            batch.flush();
+        }
+        // A lost link suspends a session, the peer may resume it
+        if (closing && connection->session && reason != FRAMING_ERROR && options.session_linger)
+            return session_suspend(connection, reason);
+        if (closing)
+            return connection_close(connection, reason);
+        // Stop reading a connection whose output queue is over budget until the writer drained it
+        if (output.throttle(connection->getId()))
+        {
+            connection->readThrottled = true;
+            connection_update_events(connection);
+        }
+    }
+
+    // Loop thread only
+    void connection_resume(MagicType connId)
+    {
+        std::shared_ptr<Connection> connection = connection_get(connId);
+        if (!connection || connection->isClosed() || !connection->readThrottled)
+            return;
+        connection->readThrottled = false;
+        if (connection->channel)
+            return channel_open_window(connection);
+        // A suspended session reads again once it is resumed
+        if (connection->fd < 0)
+            return;
+        connection_update_events(connection);
+        connection_on_readable(connection);
+    }
+
+    void connection_arm_idle(std::shared_ptr<Connection> connection)
+    {
+        if (!options.idle_timeout)
+            return;
+        std::weak_ptr<Connection> weak = connection;
+        connection->idleTimer.callback = [weak]
+        {
+            std::shared_ptr<Connection> connection = weak.lock();
+            if (!connection)
+                return;
+            uint64_t idle = Loop::now_ms() - connection->lastActivity.load(std::memory_order_relaxed);
+            if (idle >= options.idle_timeout)
+                connection_close(connection, IDLE_TIMEOUT);
+            else
+                loop.arm(&connection->idleTimer, options.idle_timeout - idle);
+        };
+        loop.arm(&connection->idleTimer, options.idle_timeout);
+    }
+
+    // Loop thread only, false if buf goes to the socket as it is. Otherwise out holds the bytes
+    // for the socket: on a carrier buf is its own channel 0, then the stream is compressed.
+    // A session keeps buf until the peer acks it
+    bool connection_encode(const std::shared_ptr<Connection> &connection, const char *buf, size_t length, std::vector<char> &out)
+    {
+        if (connection->session)
+        {
+            out.clear();
+            connection->session->wrap(buf, length, out);
+            return true;
+        }
+        if (!connection->mux && !connection->codec)
+            return false;
+        if (!connection->mux)
+        {
+            out = connection->codec->encode(buf, length);
+            return true;
+        }
+        out.clear();
+        for (size_t done = 0; done < length; done += MAX_MESSAGE_LENGTH)
+            Mux::frame(out, MUX_DATA, 0, buf + done, std::min<size_t>(length - done, MAX_MESSAGE_LENGTH));
+        if (connection->codec)
+            out = connection->codec->encode(out.data(), out.size());
+        return true;
+    }
+
+    // Loop thread only, co_await connection_send(connection, buf, length) writes all of buf.
+    // Sends to one connection complete in the order they were started. On a compressed
+    // connection or a carrier buf is encoded right away, so the stream is encoded in that
+    // order too, unless plain is false because the bytes are encoded already
+    struct ConnectionSend : IoWait
+    {
+        std::shared_ptr<Connection> connection;
+        const char *buf;
+        size_t length, done = 0;
+        bool ok = true;
+        std::vector<char> encoded;
+
+        ConnectionSend(std::shared_ptr<Connection> connection, const char *buf, size_t length, bool plain)
+            : connection(std::move(connection)), buf(buf), length(length)
+        {
+            if (plain && connection_encode(this->connection, buf, length, encoded))
+            {
+                this->buf = encoded.data();
+                this->length = encoded.size();
+            }
+        }
+
+        bool attempt() override
+        {
+            while (done < length)
+            {
+                ssize_t m = ::send(connection->fd, buf + done, length - done, MSG_NOSIGNAL);
+                if (m < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return false;
+                    ok = false;
+                    return true;
+                }
+                done += m;
+            }
+            capture.record(Capture::SOCKET_WRITE, connection->getId(), buf, length);
+            connection->bytesOut += length;
+            connection->touch();
+            return true;
+        }
+        void fail() override { ok = false; }
+        void unwritten(std::vector<char> &out) const override { out.insert(out.end(), buf + done, buf + length); }
+
+        bool await_ready()
+        {
+            if (connection->isClosed())
+            {
+                ok = false;
+                return true;
+            }
+            if (connection->datagram)
+            { // Queued on the udp socket, never waits
+                udp.send(connection->remote, buf, length);
+                connection->bytesOut += length;
+                connection->touch();
+                return true;
+            }
+            if (connection->channel)
+            { // Waits for the peer's window on its own, the control channel doesn't
+                channel_send(connection, buf, length);
+                return true;
+            }
+            // Queue behind a send that is still in flight
+            return !connection->sendWait && attempt();
+        }
+        void await_suspend(std::coroutine_handle<> caller)
+        {
+            handle = caller;
+            IoWait **tail = &connection->sendWait;
+            while (*tail)
+                tail = &(*tail)->next;
+            *tail = this;
+            connection_update_events(connection);
+        }
+        bool await_resume() { return ok; }
+    };
+
+    ConnectionSend connection_send(std::shared_ptr<Connection> connection, const char *buf, size_t length, bool plain = true)
+    {
+        return ConnectionSend(std::move(connection), buf, length, plain);
+    }
+
+    // Like ConnectionSend, the bytes come from files with sendfile
+    struct ConnectionSendFile : IoWait
+    {
+        std::shared_ptr<Connection> connection;
+        std::vector<FileRange> ranges;
+        size_t next = 0, done = 0;
+
+        ConnectionSendFile(std::shared_ptr<Connection> connection, std::vector<FileRange> ranges)
+            : connection(std::move(connection)), ranges(std::move(ranges)) {}
+
+        bool attempt() override
+        {
+            while (next < ranges.size())
+            {
+                FileRange &range = ranges[next];
+                ssize_t m = sendfile(connection->fd, range.fd, &range.offset, range.length);
+                if (m < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return errno != EAGAIN && errno != EWOULDBLOCK;
+                }
+                if (m == 0)
+                    return true;
+                range.length -= m;
+                done += m;
+                connection->bytesOut += m;
+                if (range.length == 0)
+                    next++;
+            }
+            connection->touch();
+            return true;
+        }
+        void fail() override {}
+        void unwritten(std::vector<char> &out) const override { file_ranges_read(ranges, next, out); }
+
+        bool await_ready() { return connection->isClosed() || (!connection->sendWait && attempt()); }
+        void await_suspend(std::coroutine_handle<> caller)
+        {
+            handle = caller;
+            IoWait **tail = &connection->sendWait;
+            while (*tail)
+                tail = &(*tail)->next;
+            *tail = this;
+            connection_update_events(connection);
+        }
+        size_t await_resume() { return done; }
+    };
+
+    // Loop thread only, the backlog goes ahead of anything the controller sends from now on.
+    // The outbox keeps plain bytes, a stream that is encoded gets them encoded like any send
+    Task connection_deliver_outbox(std::shared_ptr<Connection> connection)
+    {
+        if (!outbox.enabled() || connection->peer.empty() || connection->datagram)
+            co_return;
+        std::string peer = connection->peer;
+        std::vector<FileRange> backlog = outbox.backlog(peer);
+        if (backlog.empty())
+            co_return;
+        if (!connection->codec && !connection->mux && !connection->session && !connection->channel)
+        {
+            size_t bytes = co_await ConnectionSendFile(connection, std::move(backlog));
+            outbox.delivered(peer, bytes);
+            co_return;
+        }
+        std::vector<char> bytes;
+        file_ranges_read(backlog, 0, bytes);
+        bool ok = co_await connection_send(connection, bytes.data(), bytes.size());
+        outbox.delivered(peer, ok ? bytes.size() : 0);
+    }
+
+    // Loop thread only, names the peer the outbox keeps messages for, an accepted connection
+    // gets what was kept for its name
+    void connection_set_peer(std::shared_ptr<Connection> connection, std::string peer)
+    {
+        if (connection->peer == peer)
+            return;
+        connection->peer = std::move(peer);
+        if (connection->isAccepted())
+            connection_deliver_outbox(connection);
+    }
+
+    // Loop thread only, false if connId never belonged to a peer the outbox knows
+    bool connection_keep_for_peer(MagicType connId, const char *buf, size_t length)
+    {
+        if (!outbox.enabled() || connId >= MAX_CONNECTIONS || closedPeers[connId].empty())
+            return false;
+        return outbox.append(closedPeers[connId], buf, length);
+    }
+
+    // Loop thread only, delivers what arrived before the accept, so no newer message can overtake it
+    void connection_accept(std::shared_ptr<Connection> connection)
+    {
+        loop.cancel(&connection->preAcceptTimer);
+        FrameBatch batch;
+        bool ok = true;
+        if (connection->datagram)
+            connection->iteratePreMessageBufferDatagrams([&](char *iter, MessageLengthType length)
+                                                         { ok = ok && connection_frame(connection, iter, length, batch); });
+        else
+            connection->iteratePreMessageBufferChunks([&](char *iter, MessageLengthType length)
+                                                      { ok = ok && connection_frame(connection, iter, length, batch); });
+        batch.flush();
+        connection->setAccepted();
+        if (!ok)
+            return connection_close(connection, FRAMING_ERROR);
+        if (connection->channel)
+            channel_open_window(connection);
+        connection_deliver_outbox(connection);
+    }
+
+    Task connection_send_heartbeat(std::shared_ptr<Connection> connection)
+    {
+        co_await connection_send(connection, options.heartbeat_payload.data(), options.heartbeat_payload.size());
+    }
+
+    // The bytes go to the socket as they are
+    Task connection_send_copy(std::shared_ptr<Connection> connection, std::vector<char> bytes)
+    {
+        sendBacklog += bytes.size();
+        connection->queued += bytes.size();
+        co_await connection_send(connection, bytes.data(), bytes.size(), false);
+        sendBacklog -= bytes.size();
+        connection->queued -= bytes.size();
+    }
+
+    // Loop thread only, writes what the socket takes now and copies only the rest. buf is
+    // encoded for a compressed connection or a carrier unless plain is false
+    void connection_write_now(std::shared_ptr<Connection> connection, const char *buf, size_t length, bool plain = true)
+    {
+        if (connection->datagram)
+        {
+            udp.send(connection->remote, buf, length);
+            connection->bytesOut += length;
+            connection->touch();
+            return;
+        }
+        if (connection->channel)
+            return channel_send(connection, buf, length);
+        std::vector<char> encoded;
+        if (plain && connection_encode(connection, buf, length, encoded))
+        {
+            buf = encoded.data();
+            length = encoded.size();
+        }
+        if (connection->fd < 0)
+        { // Suspended, the session keeps buf for the peer unless that is more than it may keep
+            if (connection->session->overrun)
+                connection_close(connection, SOCKET_ERROR);
+            return;
+        }
+        size_t done = 0;
+        while (!connection->sendWait && done < length)
+        {
+            ssize_t m = ::send(connection->fd, buf + done, length - done, MSG_NOSIGNAL);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0)
+                break;
+            done += m;
+        }
+        if (done > 0)
+        {
+            capture.record(Capture::SOCKET_WRITE, connection->getId(), buf, done);
+            connection->bytesOut += done;
+            connection->touch();
+        }
+        if (done < length)
+            connection_send_copy(connection, std::vector<char>(buf + done, buf + length));
     }
+
+    // Loop thread only, sends what a corked connection gathered as one write
+    void connection_uncork(std::shared_ptr<Connection> connection)
+    {
+        loop.cancel(&connection->corkTimer);
+        if (connection->corked.empty() || connection->isClosed())
+            return;
+        std::vector<char> bytes;
+        bytes.swap(connection->corked);
+        connection_write_now(connection, bytes.data(), bytes.size());
+    }
+
+    // Loop thread only, gathers buf on a corked connection. True once corkBytes are reached,
+    // then the gathered bytes were moved to out and are the caller's to send
+    bool connection_cork(std::shared_ptr<Connection> connection, const char *buf, size_t length, std::vector<char> &out)
+    {
+        if (connection->corked.empty() && connection->corkBytes > length)
+        {
+            if (connection->corkDelay)
+                // The wheel ticks in ms, a deadline is never earlier than asked for
+                loop.arm(&connection->corkTimer, (connection->corkDelay + 999) / 1000);
+            else
+                // Gathers what the controller wrote in this loop iteration
+                loop.post([weak = std::weak_ptr<Connection>(connection)]
+                          {
+                              if (std::shared_ptr<Connection> connection = weak.lock())
+                                  connection_uncork(connection); });
+        }
+        connection->corked.insert(connection->corked.end(), buf, buf + length);
+        if (connection->corked.size() < connection->corkBytes)
+            return false;
+        loop.cancel(&connection->corkTimer);
+        out.swap(connection->corked);
+        connection->corked.clear();
+        return true;
+    }
+
+    // Loop thread only, bytes 0 turns corking off and sends what was gathered
+    void connection_set_cork(std::shared_ptr<Connection> connection, size_t bytes, uint32_t delay)
+    {
+        connection->corkBytes = bytes;
+        connection->corkDelay = delay;
+        std::weak_ptr<Connection> weak = connection;
+        connection->corkTimer.callback = [weak]
+        {
+            if (std::shared_ptr<Connection> connection = weak.lock())
+                connection_uncork(connection);
+        };
+        if (!bytes)
+            connection_uncork(connection);
+    }
+
+    // Loop thread only, both directions switch at once: what was sent before goes out as it
+    // was, and the peer has to switch its reads and writes at the same point of the streams
+    void connection_set_compression(std::shared_ptr<Connection> connection, bool enabled)
+    {
+        if (enabled == (connection->codec != nullptr))
+            return;
+        connection_uncork(connection);
+        if (connection->codec)
+            connection_log_compression(connection);
+        connection->codec = enabled ? std::make_unique<Codec>() : nullptr;
+    }
+
+    // Loop thread only, like connection_write_now but gathered first on a corked connection
+    void connection_send_now(std::shared_ptr<Connection> connection, const char *buf, size_t length)
+    {
+        if (!connection->corkBytes)
+            return connection_write_now(connection, buf, length);
+        std::vector<char> bytes;
+        if (connection_cork(connection, buf, length, bytes))
+            connection_write_now(connection, bytes.data(), bytes.size());
+    }
+
+    // Loop thread only, payload goes to every accepted connection subscribed to a pattern matching topic
+    void connection_publish(std::string_view topic, const char *payload, size_t length)
+    {
+        TopicIndex<MAX_CONNECTIONS>::Set matches = topics.match(topic);
+        for (int id = 0; id < MAX_CONNECTIONS && matches.any(); id++)
+        {
+            if (!matches[id])
+                continue;
+            matches[id] = false;
+            std::shared_ptr<Connection> connection = connection_get(id);
+            if (connection && connection->isAccepted() && !connection->isClosed())
+                connection_send_now(connection, payload, length);
+        }
+    }
+
+    void connection_arm_heartbeat(std::shared_ptr<Connection> connection)
+    {
+        if (!options.heartbeat_interval)
+            return;
+        std::weak_ptr<Connection> weak = connection;
+        connection->heartbeatTimer.callback = [weak]
+        {
+            std::shared_ptr<Connection> connection = weak.lock();
+            if (!connection)
+                return;
+            if (connection->isAccepted())
+            {
+                uint64_t quiet = Loop::now_ms() - connection->lastActivity.load(std::memory_order_relaxed);
+                if (quiet >= options.heartbeat_interval && !connection->sendWait)
+                    connection_send_heartbeat(connection);
+            }
+            loop.arm(&connection->heartbeatTimer, options.heartbeat_interval);
+        };
+        loop.arm(&connection->heartbeatTimer, options.heartbeat_interval);
+    }
+
+    void connection_arm_timers(std::shared_ptr<Connection> connection)
+    {
+        connection_arm_idle(connection);
+        connection_arm_heartbeat(connection);
+        if (!connection->isAccepted() && options.pre_accept_timeout)
+        {
+            std::weak_ptr<Connection> weak = connection;
+            connection->preAcceptTimer.callback = [weak]
+            {
+                std::shared_ptr<Connection> connection = weak.lock();
+                if (connection)
+                    connection_close(connection, PRE_ACCEPT_TIMEOUT);
+            };
+            loop.arm(&connection->preAcceptTimer, options.pre_accept_timeout);
+        }
+    }
+
+    // Loop thread only, starts reading and the per connection timers
+    void connection_start(std::shared_ptr<Connection> connection)
+    {
+        std::weak_ptr<Connection> weak = connection;
+        connection->established = true;
+        connection->touch();
+        connection->watch.onEvents = [weak](uint32_t events)
+        {
+            std::shared_ptr<Connection> connection = weak.lock();
+            if (!connection)
+                return;
+            if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && io_progress(connection->sendWait))
+                connection_update_events(connection);
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                connection_on_readable(connection);
+        };
+        loop.add(&connection->watch, EPOLLIN);
+        if (connection->sendWait)
+            connection_update_events(connection);
+        connection_arm_timers(connection);
+    }
+
+    // Loop thread only, mux frames for the socket of carrier
+    void carrier_send(std::shared_ptr<Connection> carrier, std::vector<char> &frames)
+    {
+        if (carrier->codec)
+            frames = carrier->codec->encode(frames.data(), frames.size());
+        connection_write_now(carrier, frames.data(), frames.size(), false);
+    }
+
+    // Loop thread only, sends what the peer's window allows of what waits for it
+    void channel_flush(std::shared_ptr<Connection> channel)
+    {
+        std::shared_ptr<Connection> carrier = channel->carrier.lock();
+        size_t n = std::min<size_t>(channel->channelPending.size(), channel->sendWindow);
+        if (!carrier || carrier->isClosed() || channel->isClosed() || !n)
+            return;
+        std::vector<char> frames;
+        for (size_t done = 0; done < n; done += MAX_MESSAGE_LENGTH)
+            Mux::frame(frames, MUX_DATA, channel->channel, channel->channelPending.data() + done, std::min<size_t>(n - done, MAX_MESSAGE_LENGTH));
+        channel->channelPending.erase(channel->channelPending.begin(), channel->channelPending.begin() + n);
+        channel->sendWindow -= n;
+        channel->queued -= n;
+        channel->bytesOut += n;
+        sendBacklog -= n;
+        channel->touch();
+        carrier_send(carrier, frames);
+    }
+
+    void channel_send(std::shared_ptr<Connection> channel, const char *buf, size_t length)
+    {
+        channel->channelPending.insert(channel->channelPending.end(), buf, buf + length);
+        channel->queued += length;
+        sendBacklog += length;
+        channel_flush(channel);
+    }
+
+    // Loop thread only, gives the peer back the window the controller took, in steps of half
+    // of it and not while the controller's output for the channel is throttled
+    void channel_open_window(std::shared_ptr<Connection> channel)
+    {
+        std::shared_ptr<Connection> carrier = channel->carrier.lock();
+        uint32_t taken = Mux::INITIAL_WINDOW - channel->receiveWindow;
+        if (!carrier || carrier->isClosed() || !channel->isAccepted() || channel->readThrottled || taken < Mux::INITIAL_WINDOW / 2)
+            return;
+        std::vector<char> frames;
+        Mux::window(frames, channel->channel, taken);
+        channel->receiveWindow += taken;
+        carrier_send(carrier, frames);
+    }
+
+    // Loop thread only, from connection_close, notify tells the peer
+    void channel_detach(std::shared_ptr<Connection> channel, bool notify)
+    {
+        sendBacklog -= channel->channelPending.size();
+        channel->queued -= channel->channelPending.size();
+        channel->channelPending.clear();
+        std::shared_ptr<Connection> carrier = channel->carrier.lock();
+        if (!carrier || carrier->isClosed())
+            return;
+        carrier->mux->channels.erase(channel->channel);
+        if (!notify)
+            return;
+        std::vector<char> frames;
+        Mux::frame(frames, MUX_CLOSE, channel->channel, nullptr, 0);
+        carrier_send(carrier, frames);
+    }
+
+    // Loop thread only, a channel opened by the daemon if number is even, nullptr without a free id
+    std::shared_ptr<Connection> channel_open(std::shared_ptr<Connection> carrier, uint16_t number, int home)
+    {
+        std::shared_ptr<Connection> channel = connection_new(carrier->ip, carrier->port);
+        channel->channel = number;
+        channel->carrier = carrier;
+        channel->home = home;
+        channel->established = true;
+        channel->sendWindow = channel->receiveWindow = Mux::INITIAL_WINDOW;
+        MagicType id = connection_register(channel);
+        std::vector<char> frames;
+        if (id == MAX_CONNECTIONS)
+        {
+            log_error("  Connection limit reached ({}), refusing channel {} of connection {}", (int)MAX_CONNECTIONS, number, carrier->getId());
+            if (number % 2)
+            {
+                Mux::frame(frames, MUX_CLOSE, number, nullptr, 0);
+                carrier_send(carrier, frames);
+            }
+            return nullptr;
+        }
+        carrier->mux->channels[number] = id;
+        channel->touch();
+        if (number % 2 == 0)
+        {
+            channel->setAccepted();
+            Mux::frame(frames, MUX_OPEN, number, nullptr, 0);
+            carrier_send(carrier, frames);
+        }
+        connection_arm_timers(channel);
+        return channel;
+    }
+
+    // Loop thread only, bytes of a channel from its peer. Errors close the channel, not the carrier
+    void channel_receive(std::shared_ptr<Connection> channel, const char *buf, size_t length, FrameBatch &batch, bool shed)
+    {
+        if (length > channel->receiveWindow)
+        {
+            log_error("  Channel {} of connection {} sent past its window", channel->channel, channel->carrier.lock()->getId());
+            batch.flush();
+            return connection_close(channel, FRAMING_ERROR);
+        }
+        channel->receiveWindow -= length;
+        channel->bytesIn += length;
+        channel->touch();
+        if (!channel->isAccepted())
+        { // The window is smaller than the pre-accept buffer
+            channel->addToPreMessageBuffer(buf, length);
+            return;
+        }
+        if (!connection_frame_plain(channel, buf, length, batch, shed))
+        {
+            batch.flush();
+            return connection_close(channel, FRAMING_ERROR);
+        }
+        if (output.throttle(channel->getId()))
+            channel->readThrottled = true;
+        channel_open_window(channel);
+    }
+
+    // Loop thread only, the decoded stream of a carrier, false if it isn't mux frames
+    bool carrier_demux(std::shared_ptr<Connection> carrier, const char *buf, size_t length, FrameBatch &batch, bool shed)
+    {
+        return carrier->mux->feed(buf, length, [&](MuxType type, uint16_t number, const char *payload, uint16_t payloadLength)
+                                  {
+            if (number == 0)
+                return type == MUX_DATA && connection_frame_plain(carrier, payload, payloadLength, batch, shed);
+            auto found = carrier->mux->channels.find(number);
+            std::shared_ptr<Connection> channel = found == carrier->mux->channels.end() ? nullptr : connection_get(found->second);
+            uint32_t increment;
+            switch (type)
+            {
+            case MUX_OPEN:
+                // Odd numbers are the peer's
+                if (channel || number % 2 == 0)
+                    return false;
+                if ((channel = channel_open(carrier, number, LOCAL_HOME)))
+                    api_req_connect(channel->getId());
+                return true;
+            case MUX_DATA:
+                // Frames still in flight when the channel was closed here are dropped
+                if (channel)
+                    channel_receive(channel, payload, payloadLength, batch, shed);
+                return true;
+            case MUX_WINDOW:
+                if (payloadLength != sizeof(increment))
+                    return false;
+                memcpy(&increment, payload, sizeof(increment));
+                if (channel)
+                {
+                    channel->sendWindow += std::min(increment, UINT32_MAX - channel->sendWindow);
+                    channel_flush(channel);
+                }
+                return true;
+            case MUX_CLOSE:
+                if (channel)
+                {
+                    batch.flush();
+                    connection_close(channel, PEER_CLOSED);
+                }
+                return true;
+            default:
+                return false;
+            } });
+    }
+
+    // Loop thread only, carrier's stream is mux frames from now on in both directions
+    void carrier_start(std::shared_ptr<Connection> carrier)
+    {
+        if (carrier->mux)
+            return;
+        connection_uncork(carrier);
+        carrier->mux = std::make_unique<Mux>();
+    }
+
+    // Loop thread only, the stream is session records from now on in both directions, starting
+    // with the TOKEN the peer resumes with. Ending it drops what was kept for the peer
+    void session_set(std::shared_ptr<Connection> connection, bool enabled)
+    {
+        if (enabled == (connection->session != nullptr))
+            return;
+        connection_uncork(connection);
+        loop.cancel(&connection->ackTimer);
+        if (!enabled)
+        {
+            connection->session = nullptr;
+            return;
+        }
+        connection->session = std::make_unique<Session>(options.session_window);
+        std::vector<char> hello;
+        connection->session->hello(hello);
+        connection_write_now(connection, hello.data(), hello.size(), false);
+    }
+
+    // Loop thread only, acks what the peer sent once ACK_BYTES are taken, or ACK_DELAY ms later
+    void session_ack(std::shared_ptr<Connection> connection)
+    {
+        Session *session = connection->session.get();
+        if (!session || session->suspended || !session->unacked())
+            return;
+        if (session->unacked() < Session::ACK_BYTES)
+        {
+            if (!connection->ackTimer.armed())
+            {
+                std::weak_ptr<Connection> weak = connection;
+                connection->ackTimer.callback = [weak]
+                {
+                    if (std::shared_ptr<Connection> connection = weak.lock())
+                    {
+                        std::vector<char> ack;
+                        if (connection->session && !connection->session->suspended && connection->session->unacked())
+                        {
+                            connection->session->ack(ack);
+                            connection_write_now(connection, ack.data(), ack.size(), false);
+                        }
+                    }
+                };
+                loop.arm(&connection->ackTimer, Session::ACK_DELAY);
+            }
+            return;
+        }
+        loop.cancel(&connection->ackTimer);
+        std::vector<char> ack;
+        session->ack(ack);
+        connection_write_now(connection, ack.data(), ack.size(), false);
+    }
+
+    // Loop thread only, closes the socket of a session and keeps everything else
+    void session_detach(std::shared_ptr<Connection> connection)
+    {
+        loop.remove(&connection->watch);
+        loop.cancel(&connection->idleTimer);
+        loop.cancel(&connection->heartbeatTimer);
+        loop.cancel(&connection->ackTimer);
+        close(connection->fd);
+        connection->fd = connection->watch.fd = -1;
+        connection->session->suspended = true;
+        // What they were sending is kept by the session and goes out again on resume
+        connection_fail_senders(connection);
+    }
+
+    // Loop thread only, the link of a session went down. The connection keeps its id and
+    // waits session_linger ms for the peer, the controller isn't told unless it doesn't come
+    void session_suspend(std::shared_ptr<Connection> connection, DisconnectReason reason)
+    {
+        Session &session = *connection->session;
+        if (session.overrun)
+        {
+            log_info("Connection {} lost its link with more than {} bytes unacknowledged, it can't resume", connection->getId(), session.window);
+            return connection_close(connection, reason);
+        }
+        session_detach(connection);
+        std::weak_ptr<Connection> weak = connection;
+        connection->lingerTimer.callback = [weak, reason]
+        {
+            if (std::shared_ptr<Connection> connection = weak.lock())
+                connection_close(connection, reason);
+        };
+        loop.arm(&connection->lingerTimer, options.session_linger);
+        log_info("Connection {} lost its link, {} bytes unacknowledged, waiting {} ms for it to resume", connection->getId(), session.in_flight(), options.session_linger);
+    }
+
+    // Loop thread only, the session with token or nullptr
+    std::shared_ptr<Connection> session_find(const char *token)
+    {
+        for (int id = 0; id < MAX_CONNECTIONS; id++)
+        {
+            std::shared_ptr<Connection> connection = connection_get(id);
+            if (connection && connection->session && !connection->isClosed() && connection->session->matches(token))
+                return connection;
+        }
+        return nullptr;
+    }
+
+    // Loop thread only, fd is the peer's new link and the peer has the stream before peerHas.
+    // False if the session can't go on from there, fd is still the caller's then
+    bool session_attach(std::shared_ptr<Connection> connection, int fd, const struct sockaddr_in &addr, uint64_t peerHas)
+    {
+        Session &session = *connection->session;
+        std::vector<char> records;
+        uint64_t resent = session.resent;
+        if (!session.resume(peerHas, records))
+            return false;
+        // The peer came back before its old link was found dead
+        if (!session.suspended)
+            session_detach(connection);
+        loop.cancel(&connection->lingerTimer);
+        session.suspended = false;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        connection->ip = ip;
+        connection->port = ntohs(addr.sin_port);
+        connection->fd = connection->watch.fd = fd;
+        loop.poller.tune_socket(fd);
+        loop.add(&connection->watch, EPOLLIN);
+        connection_update_events(connection);
+        connection->touch();
+        connection_arm_idle(connection);
+        connection_arm_heartbeat(connection);
+        log_info("Connection {} resumed from {}:{}, {} bytes sent again", connection->getId(), ip, connection->port, session.resent - resent);
+        connection_write_now(connection, records.data(), records.size(), false);
+        return true;
+    }
+
+    // Any thread, waits on the loop for a non-blocking connect() to complete
+    void connection_await_connect(std::shared_ptr<Connection> connection)
+    {
+        std::weak_ptr<Connection> weak = connection;
+        connection->watch.onEvents = [weak](uint32_t)
+        {
+            std::shared_ptr<Connection> connection = weak.lock();
+            if (!connection || connection->isClosed())
+                return;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+                return connection_close(connection, CONNECT_REFUSED);
+            loop.cancel(&connection->connectTimer);
+            loop.remove(&connection->watch);
+            connection_start(connection);
+            api_create_connect(connection->getId(), connection->home);
+            connection_deliver_outbox(connection);
+        };
+        loop.post([connection, weak]
+                  {
+                      if (options.connect_timeout)
+                      {
+                          connection->connectTimer.callback = [weak]
+                          {
+                              std::shared_ptr<Connection> connection = weak.lock();
+                              if (connection)
+                                  connection_close(connection, CONNECT_TIMEOUT);
+                          };
+                          loop.arm(&connection->connectTimer, options.connect_timeout);
+                      }
+                      loop.add(&connection->watch, EPOLLOUT); });
+    }
+
+    // Udp peers by address, a peer that was closed gets a new id with its next datagram
+    std::unordered_map<uint64_t, std::weak_ptr<Connection>> udpPeers;
+    // Frames of one peer at a time, the output queue counts a batch against its first frame's connection
+    FrameBatch udpBatch;
+    MagicType udpBatchId = 0;
+
+    // Loop thread only
+    void udp_on_datagram(const struct sockaddr_in &from, const char *data, size_t length)
+    {
+        uint64_t key = (uint64_t)from.sin_addr.s_addr << 16 | from.sin_port;
+        std::shared_ptr<Connection> connection = udpPeers[key].lock();
+        if (!connection || connection->isClosed())
+        {
+            if (udpPeers.size() > 2 * MAX_CONNECTIONS)
+                std::erase_if(udpPeers, [](auto &peer)
+                              { return peer.second.expired(); });
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+            connection = connection_new(ip, ntohs(from.sin_port));
+            connection->datagram = true;
+            connection->remote = from;
+            MagicType id = connection_register(connection);
+            if (id == MAX_CONNECTIONS)
+            {
+                log_error("  Connection limit reached ({}), dropping datagram from {}:{}", (int)MAX_CONNECTIONS, ip, connection->port);
+                return;
+            }
+            udpPeers[key] = connection;
+            connection->established = true;
+            connection->touch();
+            connection_arm_timers(connection);
+            api_req_connect(id);
+        }
+        connection->touch();
+        connection->bytesIn += length;
+        // A peer whose output queue is over budget loses datagrams instead of stalling the shared socket
+        if (output.throttle(connection->getId()))
+            return;
+        if (!connection->isAccepted())
+        {
+            connection->addDatagramToPreMessageBuffer(data, length);
+            return;
+        }
+        if (udpBatch.size() && udpBatchId != connection->getId())
+            udpBatch.flush();
+        udpBatchId = connection->getId();
+        if (!connection_frame(connection, data, length, udpBatch))
+        {
+            udpBatch.flush();
+            connection_close(connection, FRAMING_ERROR);
+        }
+    }
+
+    // Loop thread only, serves fd if it is an inherited socket, false if port can't be bound
+    bool udp_serve(int port, int fd = -1)
+    {
+        udp.onDatagram = udp_on_datagram;
+        // Everything one recvmmsg returned goes out with one write
+        udp.onBatch = []
+        { udpBatch.flush(); };
+        if (fd >= 0)
+            udp.adopt(fd);
+        else if (!udp.open(port))
+        {
+            log_info("Udp binding failed: {} : {}", errno, strerror(errno));
+            return false;
+        }
+        log_info("UDP Server started on port {}{}{}", udp.port(), udp.gro ? ", gro" : "", udp.gso ? ", gso" : "");
+        return true;
+    }
+
+    struct Frame
+    {
+        MagicType magic;
+        MessageLengthType length;
+        // Not null terminated, valid until the next next_frame()
+        const char *message;
+        // Sampled for tracing, 0 if not
+        uint64_t trace = 0;
+    };
+
+    // The control channel, frames are read ahead from API_IN_FILENO in large chunks
+    class ApiChannel
+    {
+    public:
+        static const size_t BUFFER = 256 << 10;
+
+        ApiChannel(Loop &loop, int fd) : in(loop, fd), buf(BUFFER) {}
+
+        // False at EOF, on a read error or after cancel()
+        Async<bool> next_frame(Frame &frame)
+        {
+            while (!parse(frame))
+            {
+                if (cancelled)
+                    co_return false;
+                if (begin > 0)
+                {
+                    memmove(buf.data(), buf.data() + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                }
+                ssize_t m = co_await in.recv(buf.data() + end, buf.size() - end);
+                if (m <= 0)
+                    co_return false;
+                end += m;
+            }
+            co_return true;
+        }
+
+        // Stops the reader at the next frame boundary, loop thread only
+        void cancel()
+        {
+            cancelled = true;
+            in.cancel();
+        }
+        // Undoes cancel(), for the next reader
+        void resume() { cancelled = false; }
+
+        // Reads without blocking the loop. O_NONBLOCK on the inherited description would reach every
+        // holder of it, stdout too when both are one tty or socket, so a pipe or tty is opened
+        // again through /proc and a socket is read with MSG_DONTWAIT
+        bool nonblocking()
+        {
+            struct stat st;
+            if (fstat(in.fd, &st) < 0)
+                return false;
+            if (S_ISREG(st.st_mode))
+                return true;
+            if (S_ISSOCK(st.st_mode))
+            {
+                in.dontwait = true;
+                return true;
+            }
+            int fd = open(fmt::format("/proc/self/fd/{}", in.fd).c_str(), O_RDONLY | O_NONBLOCK);
+            if (fd < 0)
+                return false;
+            dup2(fd, in.fd);
+            close(fd);
+            return true;
+        }
+
+        // Bytes read ahead but not consumed, for handing the channel to another process
+        std::vector<char> buffered() const { return std::vector<char>(buf.begin() + begin, buf.begin() + end); }
+        void restore(const char *data, size_t length)
+        {
+            memcpy(buf.data(), data, length);
+            begin = 0;
+            end = length;
+        }
+
+    private:
+        Stream in;
+        std::vector<char> buf;
+        size_t begin = 0, end = 0;
+        bool cancelled = false;
+
+        bool parse(Frame &frame)
+        {
+            if (cancelled || end - begin < (size_t)PREFIX_SIZE)
+                return false;
+            uint64_t start = tracer.enabled ? Tracer::now() : 0;
+            memcpy(&frame.magic, &buf[begin], MAGIC_TYPE_SIZE);
+            memcpy(&frame.length, &buf[begin + MAGIC_TYPE_SIZE], MESSAGE_LENGTH_TYPE_SIZE);
+            size_t size = PREFIX_SIZE + (api_in_special(frame.magic) ? 0 : frame.length);
+            if (end - begin < size)
+                return false;
+            frame.message = &buf[begin + PREFIX_SIZE];
+            capture.record(Capture::API_IN, 0, &buf[begin], size);
+            begin += size;
+            frame.trace = tracer.sample();
+            if (frame.trace)
+                tracer.span(frame.trace, "api decode", frame.magic < MAX_CONNECTIONS ? frame.magic : -1, start);
+            return true;
+        }
+    };
+
+    ApiChannel apiChannel(loop, API_IN_FILENO);
 }
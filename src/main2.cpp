@@ -1,9 +1,27 @@
 #include "gui.hpp"
 #include <thread>
+#include <string.h>
+#include <stdlib.h>
 
+// usage: funny_gui [--messages-fd fd]
+// With --messages-fd the Gui shows the frames read from fd, for example the daemon's api output
+//   funny_gui --messages-fd 3 3< <(sleep infinity | funny --stats-interval 500 3333)
 int main(int argc, char **argv)
 {
+    int messageFd = -1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--messages-fd") && i + 1 < argc)
+            messageFd = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--messages-fd fd]\n", argv[0]);
+            return 1;
+        }
+    }
     funny::Gui gui = funny::Gui();
+    if (messageFd >= 0)
+        gui.attach_messages(messageFd);
     std::thread t1(&funny::Gui::loop, &gui);
     // while (!gui.is_stopped())
     // {
@@ -14,4 +32,4 @@ int main(int argc, char **argv)
     // }
     t1.join();
     return 0;
-}
\ No newline at end of file
+}
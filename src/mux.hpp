@@ -0,0 +1,112 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+
+/* ** Channels **
+ *  A connection switched to multiplexing with MULTIPLEX carries logical channels, each of
+ *  them a connection id of its own for the controller but without a socket. The byte stream
+ *  of the carrier, below compression, is a sequence of frames
+ *     [u8 MuxType][u16 channel][u16 length][payload]
+ *  OPEN       opens channel, odd numbers are opened by the peer and even ones by the daemon
+ *  DATA       payload is the next bytes of channel, framed by the channel's own framing
+ *  WINDOW     payload is a u32, the receiver lets the sender send that many more bytes
+ *  CLOSE      closes channel, no further frames for it follow from the sender
+ *  Channel 0 is the carrier's own stream and never closes on its own, it has no window.
+ *
+ *  Either side may send INITIAL_WINDOW bytes on a channel once it is opened and more as
+ *  WINDOW frames come back. The daemon gives the window back as the controller takes the
+ *  messages, so a channel whose controller output backs up stops only itself and its
+ *  siblings on the same socket keep moving. Bytes past the window are a protocol error.
+ */
+namespace Api
+{
+    enum MuxType : uint8_t
+    {
+        MUX_OPEN,
+        MUX_DATA,
+        MUX_WINDOW,
+        MUX_CLOSE
+    };
+
+    class Mux
+    {
+    public:
+        static const size_t HEADER = 5;
+        static const uint32_t INITIAL_WINDOW = 64 << 10;
+
+        // Open channels by number and their connection ids, loop thread only
+        std::unordered_map<uint16_t, uint8_t> channels;
+        uint16_t nextChannel = 2;
+
+        static void frame(std::vector<char> &out, MuxType type, uint16_t channel, const char *payload, uint16_t length)
+        {
+            char header[HEADER];
+            header[0] = type;
+            memcpy(header + 1, &channel, sizeof(channel));
+            memcpy(header + 3, &length, sizeof(length));
+            out.insert(out.end(), header, header + HEADER);
+            out.insert(out.end(), payload, payload + length);
+        }
+
+        static void window(std::vector<char> &out, uint16_t channel, uint32_t increment)
+        {
+            frame(out, MUX_WINDOW, channel, (const char *)&increment, sizeof(increment));
+        }
+
+        // A free even channel number, 0 if every one is taken
+        uint16_t allocate()
+        {
+            for (int tries = 0; tries < 0x8000; tries++)
+            {
+                uint16_t channel = nextChannel;
+                nextChannel = nextChannel >= 0xFFFE ? 2 : nextChannel + 2;
+                if (!channels.count(channel))
+                    return channel;
+            }
+            return 0;
+        }
+
+        // Calls func(type, channel, payload, length) for every complete frame, a frame may
+        // arrive in any number of pieces. False as soon as func does
+        template <typename Func>
+        bool feed(const char *buf, size_t length, Func func)
+        {
+            if (!pending.empty())
+            {
+                pending.insert(pending.end(), buf, buf + length);
+                size_t used = 0;
+                bool ok = parse(pending.data(), pending.size(), used, func);
+                pending.erase(pending.begin(), pending.begin() + used);
+                return ok;
+            }
+            size_t used = 0;
+            bool ok = parse(buf, length, used, func);
+            pending.assign(buf + used, buf + length);
+            return ok;
+        }
+
+    private:
+        std::vector<char> pending;
+
+        template <typename Func>
+        static bool parse(const char *buf, size_t length, size_t &used, Func func)
+        {
+            while (length - used >= HEADER)
+            {
+                uint16_t channel, payloadLength;
+                memcpy(&channel, buf + used + 1, sizeof(channel));
+                memcpy(&payloadLength, buf + used + 3, sizeof(payloadLength));
+                if (length - used - HEADER < payloadLength)
+                    break;
+                MuxType type = (MuxType)buf[used];
+                const char *payload = buf + used + HEADER;
+                used += HEADER + payloadLength;
+                if (!func(type, channel, payload, payloadLength))
+                    return false;
+            }
+            return true;
+        }
+    };
+}
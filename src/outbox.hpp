@@ -0,0 +1,290 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+
+/* ** Outbox **
+ *  With --outbox DIR, messages the controller sends to a connection that has closed are kept
+ *  for the peer it belonged to and sent before anything else once the peer is back. A peer
+ *  is its "host:port" for outbound connections. An inbound one has no name until the
+ *  controller gives it one with SET_PEER, an address alone doesn't tell two peers apart.
+ *
+ *  Each peer has a directory of append-only segment files, SEGMENT bytes each, written through
+ *  mmap. A segment is a SegmentHeader followed by the raw bytes for the peer's socket, so the
+ *  backlog goes out with sendfile. The header keeps how much was written and how much was
+ *  delivered, a restarted daemon picks the backlog up where it stopped.
+ *
+ *  Retention is per peer and per segment: the oldest segments are dropped while the peer holds
+ *  more than maxBytes, and segments last written more than maxAge ms ago are dropped.
+ *  Loop thread only.
+ */
+namespace Api
+{
+    // A piece of a file for sendfile
+    struct FileRange
+    {
+        int fd;
+        off_t offset;
+        size_t length;
+    };
+
+    // Appends the bytes of ranges from first on, for a stream that can't take them with sendfile
+    inline void file_ranges_read(const std::vector<FileRange> &ranges, size_t first, std::vector<char> &out)
+    {
+        for (size_t i = first; i < ranges.size(); i++)
+        {
+            size_t at = out.size();
+            out.resize(at + ranges[i].length);
+            ssize_t m = pread(ranges[i].fd, out.data() + at, ranges[i].length, ranges[i].offset);
+            out.resize(at + std::max<ssize_t>(m, 0));
+        }
+    }
+
+    class Outbox
+    {
+    public:
+        static const uint32_t MAGIC = 0x4f594e46; // "FNYO"
+        static const uint32_t VERSION = 1;
+        static const size_t SEGMENT = 4 << 20;
+
+        struct SegmentHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            // Payload bytes written and delivered
+            uint64_t fill;
+            uint64_t head;
+            // CLOCK_REALTIME ms of the last append
+            uint64_t lastWrite;
+            uint64_t reserved[4];
+        };
+        static const size_t PAYLOAD = SEGMENT - sizeof(SegmentHeader);
+
+        size_t maxBytes = 64 << 20;
+        uint64_t maxAge = 24 * 3600 * 1000ull;
+
+        ~Outbox()
+        {
+            for (auto &[name, peer] : peers)
+                for (Segment &segment : peer.segments)
+                    unmap(segment);
+        }
+
+        // False if dir can't be created
+        bool open(const std::string &path)
+        {
+            mkdir(path.c_str(), 0700);
+            struct stat st;
+            if (stat(path.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+            {
+                fprintf(stderr, "[Outbox] %s is not a directory\n", path.c_str());
+                return false;
+            }
+            dir = path;
+            return true;
+        }
+
+        bool enabled() const { return !dir.empty(); }
+
+        // False if the bytes couldn't be stored
+        bool append(const std::string &name, const char *data, size_t length)
+        {
+            Peer &peer = load(name);
+            if (!peer.delivering)
+                expire(peer);
+            while (length > 0)
+            {
+                if (peer.segments.empty() || peer.segments.back().header->fill == PAYLOAD)
+                    if (!add_segment(peer))
+                        return false;
+                SegmentHeader *header = peer.segments.back().header;
+                size_t n = std::min(length, (size_t)(PAYLOAD - header->fill));
+                memcpy(peer.segments.back().payload + header->fill, data, n);
+                header->fill += n;
+                header->lastWrite = now_ms();
+                data += n;
+                length -= n;
+            }
+            return true;
+        }
+
+        // The undelivered bytes of a peer, empty while another delivery to it is in flight
+        std::vector<FileRange> backlog(const std::string &name)
+        {
+            std::vector<FileRange> ranges;
+            Peer &peer = load(name);
+            if (peer.delivering)
+                return ranges;
+            expire(peer);
+            for (Segment &segment : peer.segments)
+                if (segment.header->fill > segment.header->head)
+                    ranges.push_back({segment.fd, (off_t)(sizeof(SegmentHeader) + segment.header->head), (size_t)(segment.header->fill - segment.header->head)});
+            peer.delivering = !ranges.empty();
+            return ranges;
+        }
+
+        // Ends the delivery started by backlog(), bytes of it reached the socket
+        void delivered(const std::string &name, size_t bytes)
+        {
+            Peer &peer = load(name);
+            peer.delivering = false;
+            while (!peer.segments.empty())
+            {
+                Segment &segment = peer.segments.front();
+                size_t n = std::min(bytes, (size_t)(segment.header->fill - segment.header->head));
+                segment.header->head += n;
+                bytes -= n;
+                if (segment.header->head < segment.header->fill)
+                    break;
+                drop_front(peer);
+            }
+        }
+
+    private:
+        struct Segment
+        {
+            uint64_t seq;
+            int fd = -1;
+            char *map = nullptr;
+            SegmentHeader *header;
+            char *payload;
+        };
+
+        struct Peer
+        {
+            std::string path;
+            std::deque<Segment> segments;
+            uint64_t nextSeq = 0;
+            bool delivering = false;
+        };
+
+        std::string dir;
+        std::unordered_map<std::string, Peer> peers;
+
+        static uint64_t now_ms()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+        }
+
+        static void unmap(Segment &segment)
+        {
+            if (segment.map)
+                munmap(segment.map, SEGMENT);
+            if (segment.fd >= 0)
+                close(segment.fd);
+        }
+
+        std::string segment_path(const Peer &peer, uint64_t seq) { return peer.path + "/" + std::to_string(seq) + ".seg"; }
+
+        bool map(Segment &segment, const std::string &path, bool create)
+        {
+            segment.fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+            if (segment.fd < 0 || (create && ftruncate(segment.fd, SEGMENT) < 0))
+                return false;
+            segment.map = (char *)mmap(NULL, SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+            if (segment.map == MAP_FAILED)
+            {
+                segment.map = nullptr;
+                return false;
+            }
+            segment.header = (SegmentHeader *)segment.map;
+            segment.payload = segment.map + sizeof(SegmentHeader);
+            if (create)
+                *segment.header = {MAGIC, VERSION, 0, 0, now_ms(), {}};
+            return segment.header->magic == MAGIC && segment.header->version == VERSION &&
+                   segment.header->head <= segment.header->fill && segment.header->fill <= PAYLOAD;
+        }
+
+        // Peers are directories named by the hex of their name, loaded on first use
+        Peer &load(const std::string &name)
+        {
+            auto found = peers.find(name);
+            if (found != peers.end())
+                return found->second;
+            Peer &peer = peers[name];
+            peer.path = dir + "/";
+            for (unsigned char c : name)
+            {
+                char hex[3];
+                snprintf(hex, sizeof(hex), "%02x", c);
+                peer.path += hex;
+            }
+            std::vector<uint64_t> seqs;
+            if (DIR *d = opendir(peer.path.c_str()))
+            {
+                while (struct dirent *entry = readdir(d))
+                    if (strstr(entry->d_name, ".seg"))
+                        seqs.push_back(strtoull(entry->d_name, NULL, 10));
+                closedir(d);
+            }
+            std::sort(seqs.begin(), seqs.end());
+            for (uint64_t seq : seqs)
+            {
+                Segment segment;
+                segment.seq = seq;
+                if (map(segment, segment_path(peer, seq), false))
+                    peer.segments.push_back(segment);
+                else
+                {
+                    fprintf(stderr, "[Outbox] Skipping damaged segment %s\n", segment_path(peer, seq).c_str());
+                    unmap(segment);
+                }
+                peer.nextSeq = seq + 1;
+            }
+            return peer;
+        }
+
+        bool add_segment(Peer &peer)
+        {
+            mkdir(peer.path.c_str(), 0700);
+            Segment segment;
+            segment.seq = peer.nextSeq++;
+            if (!map(segment, segment_path(peer, segment.seq), true))
+            {
+                perror("[Outbox] segment");
+                unmap(segment);
+                return false;
+            }
+            peer.segments.push_back(segment);
+            return true;
+        }
+
+        void drop_front(Peer &peer)
+        {
+            Segment &segment = peer.segments.front();
+            unlink(segment_path(peer, segment.seq).c_str());
+            unmap(segment);
+            peer.segments.pop_front();
+        }
+
+        void expire(Peer &peer)
+        {
+            size_t bytes = 0;
+            for (Segment &segment : peer.segments)
+                bytes += segment.header->fill - segment.header->head;
+            uint64_t oldest = now_ms() - maxAge;
+            while (!peer.segments.empty())
+            {
+                SegmentHeader *header = peer.segments.front().header;
+                if (bytes <= maxBytes && header->lastWrite >= oldest)
+                    break;
+                bytes -= header->fill - header->head;
+                drop_front(peer);
+            }
+        }
+    };
+}
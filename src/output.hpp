@@ -0,0 +1,412 @@
+#pragma once
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdio>
+#include "trace.hpp"
+
+/* ** Output stage **
+ *  Every frame for API_OUT_FILENO is queued here and written by one writer thread.
+ *  Frames are sorted into lanes
+ *     CONTROL_LANE  strict priority, always drained first
+ *     DATA_LANE     connection data, DATA_WEIGHT chunks for every log chunk
+ *     LOG_LANE      best effort, the oldest logs are dropped beyond MAX_LOG_CHUNKS
+ *  A control frame for a connection that still has data queued goes behind that data,
+ *  so frames of one connection are never reordered.
+ *  The writer gathers up to MAX_IOV chunks or MAX_BATCH_BYTES into one writev, small
+ *  enough that a new control frame never waits behind a long write.
+ *
+ *  Inside DATA_LANE every connection has its own queue, served by deficit round robin
+ *  with a quantum of QUANTUM * weight bytes per round. A connection holding more than
+ *  `budget` queued bytes is throttled: throttle() tells the producer to stop reading it
+ *  and onDrained fires from the writer thread once it is below half the budget again.
+ *  push() never blocks. Past MAX_DATA_BYTES in all every connection that is checked is
+ *  throttled until the queue is below half of it, the queue overshoots by what was read
+ *  before that.
+ *  A non-blocking fd is waited on with poll, a batch is always written whole. After a
+ *  write error the writer stops and everything queued or pushed later is discarded.
+ */
+namespace Api
+{
+    enum Lane
+    {
+        CONTROL_LANE,
+        DATA_LANE,
+        LOG_LANE,
+        LANES
+    };
+
+    class Output
+    {
+    public:
+        static const int NO_CONNECTION = -1;
+        static const int MAX_IOV = 64;
+        static const size_t MAX_BATCH_BYTES = 256 << 10;
+        static const int DATA_WEIGHT = 16;
+        static const size_t MAX_LOG_CHUNKS = 4096;
+        static const size_t MAX_DATA_BYTES = 64 << 20;
+        static const long QUANTUM = 16 << 10;
+        static const int FLOWS = 256;
+
+        struct Chunk
+        {
+            int conn;
+            std::vector<char> bytes;
+            // Sampled message and when it was queued
+            uint64_t trace = 0, queued = 0;
+        };
+
+        ~Output() { close(); }
+
+        size_t budget = 1 << 20;
+        // Called on the writer thread when a throttled connection drained
+        std::function<void(int conn)> onDrained;
+        // Called on the writer thread with every batch right before it is written
+        std::function<void(const struct iovec *iov, int count)> onWrite;
+
+        void push(Lane lane, int conn, std::vector<char> bytes)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (failed)
+                return;
+            if (!writer.joinable() && !stopped)
+                writer = std::thread(&Output::run, this);
+            Flow &flow = flows[conn == NO_CONNECTION ? FLOWS - 1 : conn];
+            if (lane == CONTROL_LANE && conn != NO_CONNECTION && !flow.chunks.empty())
+                lane = DATA_LANE;
+            if (lane == DATA_LANE)
+            {
+                dataBytes += bytes.size();
+                flow.bytes += bytes.size();
+                flow.chunks.push_back({conn, std::move(bytes), traceCurrent, traceCurrent ? Tracer::now() : 0});
+                if (!flow.active)
+                {
+                    flow.active = true;
+                    active.push_back(&flow - flows.data());
+                }
+            }
+            else
+            {
+                if (lane == LOG_LANE && lanes[LOG_LANE].size() >= MAX_LOG_CHUNKS)
+                {
+                    lanes[LOG_LANE].pop_front();
+                    droppedLogs++;
+                }
+                lanes[lane].push_back({conn, std::move(bytes), traceCurrent, traceCurrent ? Tracer::now() : 0});
+            }
+            guard.unlock();
+            wake.notify_one();
+        }
+
+        // True if conn holds more than its budget or the writer can't keep up with the pipe,
+        // onDrained(conn) follows once both are below half
+        bool throttle(int conn)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Flow &flow = flows[conn];
+            if (flow.throttled)
+                return true;
+            if (dataBytes > MAX_DATA_BYTES)
+                stall(conn);
+            else if (flow.bytes <= budget)
+                return false;
+            flow.throttled = true;
+            return true;
+        }
+
+        // Weight 0 restores the default of 1
+        void set_weight(int conn, int weight)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            flows[conn].weight = weight ? weight : 1;
+        }
+
+        int weight(int conn)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return flows[conn].weight;
+        }
+
+        // Bytes of every connection waiting for the pipe
+        size_t data_bytes()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return dataBytes;
+        }
+
+        size_t queued(int conn)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return flows[conn].bytes;
+        }
+
+        // Writes everything queued and stops the writer
+        void close()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            stopped = true;
+            guard.unlock();
+            wake.notify_all();
+            if (writer.joinable())
+                writer.join();
+        }
+
+        // After close(), lets the writer run again, with what was pushed in between
+        void reopen()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (failed || !stopped)
+                return;
+            stopped = false;
+            if (!empty())
+                writer = std::thread(&Output::run, this);
+        }
+
+        uint64_t dropped_logs()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return droppedLogs;
+        }
+
+        int fd = STDOUT_FILENO;
+
+    private:
+        struct Flow
+        {
+            std::deque<Chunk> chunks;
+            size_t bytes = 0;
+            long deficit = 0;
+            int weight = 1;
+            bool active = false;
+            bool throttled = false;
+            // Listed in stalled
+            bool stalled = false;
+        };
+
+        // lanes[DATA_LANE] is unused, data lives in flows
+        std::array<std::deque<Chunk>, LANES> lanes;
+        std::array<Flow, FLOWS> flows;
+        std::deque<int> active;
+        bool visiting = false;
+        std::vector<int> drained;
+        // Throttled while all connections together were past MAX_DATA_BYTES
+        std::vector<int> stalled;
+        size_t dataBytes = 0;
+        uint64_t droppedLogs = 0;
+        int dataStreak = 0;
+        bool stopped = false;
+        // The pipe is gone
+        bool failed = false;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::thread writer;
+
+        bool empty() { return lanes[CONTROL_LANE].empty() && lanes[LOG_LANE].empty() && active.empty(); }
+
+        // Lock held
+        Lane next_lane()
+        {
+            if (!lanes[CONTROL_LANE].empty())
+                return CONTROL_LANE;
+            bool data = !active.empty(), logs = !lanes[LOG_LANE].empty();
+            if (data && (!logs || dataStreak < DATA_WEIGHT))
+            {
+                dataStreak++;
+                return DATA_LANE;
+            }
+            dataStreak = 0;
+            return LOG_LANE;
+        }
+
+        // Lock held, deficit round robin over the active flows
+        Chunk next_data()
+        {
+            while (true)
+            {
+                Flow &flow = flows[active.front()];
+                if (!visiting)
+                {
+                    flow.deficit += QUANTUM * flow.weight;
+                    visiting = true;
+                }
+                size_t size = flow.chunks.front().bytes.size();
+                if ((long)size > flow.deficit)
+                { // Next round
+                    active.push_back(active.front());
+                    active.pop_front();
+                    visiting = false;
+                    continue;
+                }
+                flow.deficit -= size;
+                flow.bytes -= size;
+                Chunk chunk = std::move(flow.chunks.front());
+                flow.chunks.pop_front();
+                if (flow.throttled && !flow.stalled && flow.bytes <= budget / 2)
+                {
+                    if (dataBytes > MAX_DATA_BYTES / 2)
+                        stall(active.front());
+                    else
+                    {
+                        flow.throttled = false;
+                        drained.push_back(active.front());
+                    }
+                }
+                if (flow.chunks.empty())
+                {
+                    flow.deficit = 0;
+                    flow.active = false;
+                    active.pop_front();
+                    visiting = false;
+                }
+                return chunk;
+            }
+        }
+
+        // Resumed once all connections together are below half of MAX_DATA_BYTES
+        void stall(int conn)
+        {
+            if (flows[conn].stalled)
+                return;
+            flows[conn].stalled = true;
+            stalled.push_back(conn);
+        }
+
+        void run()
+        {
+            std::vector<Chunk> batch;
+            struct iovec iov[MAX_IOV];
+            tracer.name_thread("output writer");
+            std::unique_lock<std::mutex> guard(lock);
+            while (true)
+            {
+                wake.wait(guard, [this]
+                          { return stopped || !empty(); });
+                if (empty())
+                    return;
+                size_t freed = 0, batched = 0;
+                while (batch.size() < MAX_IOV && batched < MAX_BATCH_BYTES && !empty())
+                {
+                    Lane lane = next_lane();
+                    if (lane == DATA_LANE)
+                    {
+                        batch.push_back(next_data());
+                        freed += batch.back().bytes.size();
+                        batched += batch.back().bytes.size();
+                        continue;
+                    }
+                    batch.push_back(std::move(lanes[lane].front()));
+                    lanes[lane].pop_front();
+                    batched += batch.back().bytes.size();
+                }
+                dataBytes -= freed;
+                if (!stalled.empty() && dataBytes <= MAX_DATA_BYTES / 2)
+                {
+                    for (int conn : stalled)
+                    {
+                        Flow &flow = flows[conn];
+                        flow.stalled = false;
+                        // Otherwise next_data() resumes it once its own queue drained
+                        if (flow.throttled && flow.bytes <= budget / 2)
+                        {
+                            flow.throttled = false;
+                            drained.push_back(conn);
+                        }
+                    }
+                    stalled.clear();
+                }
+                std::vector<int> resume;
+                resume.swap(drained);
+                guard.unlock();
+                if (onDrained)
+                    for (int conn : resume)
+                        onDrained(conn);
+
+                uint64_t dequeued = tracer.enabled ? Tracer::now() : 0;
+                for (size_t i = 0; i < batch.size(); i++)
+                {
+                    iov[i] = {batch[i].bytes.data(), batch[i].bytes.size()};
+                    if (batch[i].trace)
+                        tracer.span(batch[i].trace, "output queue", batch[i].conn, batch[i].queued, dequeued);
+                }
+                if (onWrite)
+                    onWrite(iov, batch.size());
+                if (!write_all(iov, batch.size()))
+                {
+                    perror("[Output] writev");
+                    guard.lock();
+                    fail();
+                    return;
+                }
+                if (dequeued)
+                {
+                    uint64_t written = Tracer::now();
+                    for (Chunk &chunk : batch)
+                        if (chunk.trace)
+                            tracer.span(chunk.trace, "pipe write", chunk.conn, dequeued, written);
+                }
+                batch.clear();
+                guard.lock();
+            }
+        }
+
+        // Lock held
+        void fail()
+        {
+            stopped = failed = true;
+            for (auto &lane : lanes)
+                lane.clear();
+            for (Flow &flow : flows)
+            {
+                flow.chunks.clear();
+                flow.bytes = 0;
+                flow.deficit = 0;
+                flow.active = flow.throttled = flow.stalled = false;
+            }
+            active.clear();
+            stalled.clear();
+            drained.clear();
+            visiting = false;
+            dataBytes = 0;
+        }
+
+        bool write_all(struct iovec *iov, int count)
+        {
+            while (count > 0)
+            {
+                ssize_t m = writev(fd, iov, count);
+                if (m < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        return false;
+                    struct pollfd out = {fd, POLLOUT, 0};
+                    if (poll(&out, 1, -1) < 0 && errno != EINTR)
+                        return false;
+                    continue;
+                }
+                while (count > 0 && (size_t)m >= iov->iov_len)
+                {
+                    m -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+                if (count > 0)
+                {
+                    iov->iov_base = (char *)iov->iov_base + m;
+                    iov->iov_len -= m;
+                }
+            }
+            return true;
+        }
+    };
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+/* ** Poller **
+ *  How a reactor thread waits for its epoll set. By default it blocks in epoll_wait. With
+ *  busy set it polls without blocking while it is idle for less than the spin window, then
+ *  yields the core between polls for yieldUs, and only then blocks. Wake-ups are cheaper the
+ *  earlier the phase they are found in, and cost more CPU.
+ *
+ *  The spin window adapts. Events found only after blocking mean the gaps between them are
+ *  longer than spinning covers, so the window halves, down to 1/16 of spinUs. Events found
+ *  while spinning double it back up to spinUs.
+ *
+ *  Sockets get SO_BUSY_POLL of spinUs where the kernel has it, so a read busy-polls the
+ *  device queue as well. Raising it above net.core.busy_read needs CAP_NET_ADMIN, refusals
+ *  are counted. With cpu set the thread is pinned to that core.
+ *
+ *  Counters for the latency and CPU tradeoff are kept for take(), on the polling thread.
+ */
+namespace Api
+{
+    class Poller
+    {
+    public:
+        enum Phase
+        {
+            SPIN,
+            YIELD,
+            BLOCK,
+            PHASES
+        };
+
+        struct Report
+        {
+            // Wake-ups with events, by the phase they were found in
+            uint64_t wakeups[PHASES];
+            uint64_t emptyPolls, refusedSockets;
+            // Of the polling thread since the last report
+            double cpu;
+            // Time from a post() to the loop running it, upper bounds of power of 2 buckets
+            uint64_t postP50Ns, postP99Ns;
+        };
+
+        bool busy = false;
+        uint32_t spinUs = 50, yieldUs = 200;
+        int cpu = -1;
+
+        // As epoll_wait, timeout in ms and -1 without one
+        int wait(int epollFd, struct epoll_event *events, int max, int timeout)
+        {
+            if (!busy)
+                return found(BLOCK, epoll_wait(epollFd, events, max, timeout));
+            uint64_t start = now_ns();
+            uint64_t deadline = timeout < 0 ? UINT64_MAX : start + timeout * 1000000ull;
+            uint64_t spinEnd = start + window, yieldEnd = spinEnd + yieldUs * 1000ull;
+            while (true)
+            {
+                int n = epoll_wait(epollFd, events, max, 0);
+                uint64_t now = now_ns();
+                if (n != 0 || now >= deadline)
+                    return found(now < spinEnd ? SPIN : YIELD, n);
+                emptyPolls++;
+                if (now >= yieldEnd)
+                    break;
+                if (now >= spinEnd)
+                    sched_yield();
+                else
+                    relax();
+            }
+            int left = timeout < 0 ? -1 : (int)((deadline - now_ns() + 999999) / 1000000);
+            return found(BLOCK, epoll_wait(epollFd, events, max, left));
+        }
+
+        // On the polling thread before the first wait
+        void start()
+        {
+            window = spinUs * 1000ull;
+            if (cpu >= 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+                    fprintf(stderr, "[Poller] can't pin to cpu %d\n", cpu);
+            }
+            lastWall = now_ns();
+            lastCpu = thread_cpu_ns();
+        }
+
+        void tune_socket(int fd)
+        {
+#ifdef SO_BUSY_POLL
+            int usec = spinUs;
+            if (busy && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+                refusedSockets++;
+#endif
+        }
+
+        void post_latency(uint64_t ns) { postBuckets[ns ? 64 - __builtin_clzll(ns) : 0]++; }
+
+        // Counters since the last take, on the polling thread
+        Report take()
+        {
+            Report report;
+            for (int phase = 0; phase < PHASES; phase++)
+                report.wakeups[phase] = wakeups[phase];
+            report.emptyPolls = emptyPolls;
+            report.refusedSockets = refusedSockets;
+            uint64_t wall = now_ns(), cpuNs = thread_cpu_ns();
+            report.cpu = wall > lastWall ? (double)(cpuNs - lastCpu) / (wall - lastWall) : 0;
+            report.postP50Ns = percentile(0.5);
+            report.postP99Ns = percentile(0.99);
+            lastWall = wall;
+            lastCpu = cpuNs;
+            memset(wakeups, 0, sizeof(wakeups));
+            memset(postBuckets, 0, sizeof(postBuckets));
+            emptyPolls = refusedSockets = 0;
+            return report;
+        }
+
+        static uint64_t now_ns()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+
+    private:
+        uint64_t window = 0;
+        uint64_t wakeups[PHASES] = {}, emptyPolls = 0, refusedSockets = 0;
+        uint64_t postBuckets[65] = {};
+        uint64_t lastWall = 0, lastCpu = 0;
+
+        int found(Phase phase, int n)
+        {
+            if (n <= 0)
+                return n;
+            wakeups[phase]++;
+            if (phase == BLOCK && busy)
+                window = std::max<uint64_t>(window / 2, spinUs * 1000ull / 16);
+            else if (phase == SPIN)
+                window = std::min<uint64_t>(window * 2, spinUs * 1000ull);
+            return n;
+        }
+
+        static void relax()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+
+        static uint64_t thread_cpu_ns()
+        {
+            struct rusage usage;
+            getrusage(RUSAGE_THREAD, &usage);
+            return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+        }
+
+        uint64_t percentile(double p) const
+        {
+            uint64_t total = 0, seen = 0;
+            for (uint64_t count : postBuckets)
+                total += count;
+            for (int bucket = 0; bucket < 65 && total; bucket++)
+            {
+                seen += postBuckets[bucket];
+                if (seen >= p * total)
+                    return bucket < 64 ? 1ull << bucket : UINT64_MAX;
+            }
+            return 0;
+        }
+    };
+}
@@ -0,0 +1,451 @@
+#include "api.hpp"
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <map>
+#include <deque>
+
+/* ** Capture replay **
+ *  Drives a fresh daemon from a file written with --capture.
+ *    - API_IN frames are written to the daemon's stdin at their original time
+ *    - SOCKET_OPEN opens a fake peer connection to the daemon
+ *    - SOCKET_DIAL targets are rewritten: CONNECT and CONNECT_MANY dial the replay's own
+ *      upstream listener, whose accepted sockets play the captured remote peers in dial order
+ *    - SOCKET_READ bytes are sent by the fake peer, SOCKET_CLOSE with PEER_CLOSED closes it and
+ *      SOCKET_ERROR resets it
+ *  Everything the daemon writes is drained and counted against the captured API_OUT and
+ *  SOCKET_WRITE bytes. Connection ids match the capture as long as the daemon hands out
+ *  slots in the same order, which it does for the same sequence of opens and closes.
+ *  Frames that name a connection wait until the daemon announced it (REQUEST_CONNECT or
+ *  CREATE_CONNECT), and an open waits until the previous holder of its id is gone, so the
+ *  replay stays causal at any speed. A wait that runs out is counted as a stall.
+ *
+ *  usage: funny_replay [-x speed] [-p port] capture daemon [daemon args...]
+ *  speed 1 is the original pace (default), 10 ten times faster, 0 as fast as possible.
+ */
+
+using namespace Api;
+
+struct Peer
+{
+    int fd = -1;
+    long written = 0;
+    long received = 0;
+};
+
+static int daemon_in, daemon_out, upstream_fd;
+static std::map<int, Peer> peers; // capture connection id -> fake peer
+static std::deque<int> dialed;   // captured dials waiting for their upstream accept
+static long api_out_bytes, api_out_frames, peer_received, lost_peers, stalls;
+static bool announced[MAX_CONNECTIONS];
+static std::vector<char> daemon_output;
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000l + ts.tv_nsec;
+}
+
+static int listen_local(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+        return -1;
+    return fd;
+}
+
+static int local_port(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static int dial_local(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+// Follows which connection ids the daemon has announced
+static void parse_output()
+{
+    size_t at = 0;
+    while (daemon_output.size() - at >= (size_t)PREFIX_SIZE)
+    {
+        MagicType magic = daemon_output[at];
+        MessageLengthType length;
+        memcpy(&length, &daemon_output[at + MAGIC_TYPE_SIZE], MESSAGE_LENGTH_TYPE_SIZE);
+        bool special = magic == Magic::REQUEST_CONNECT || magic == Magic::CREATE_CONNECT || magic == Magic::DISCONNECT;
+        size_t size = PREFIX_SIZE + (special ? 0 : length);
+        if (daemon_output.size() - at < size)
+            break;
+        if (special && (length & 0xFF) < MAX_CONNECTIONS)
+            announced[length & 0xFF] = magic != Magic::DISCONNECT;
+        api_out_frames++;
+        at += size;
+    }
+    daemon_output.erase(daemon_output.begin(), daemon_output.begin() + at);
+}
+
+// Reads whatever the daemon and the fake peers have for us, accepts upstream dials
+static void pump(int timeout_ms)
+{
+    static char buf[1 << 16];
+    std::vector<struct pollfd> fds = {{daemon_out, POLLIN, 0}, {upstream_fd, POLLIN, 0}};
+    std::vector<int> ids;
+    for (auto &[id, peer] : peers)
+        if (peer.fd >= 0)
+        {
+            fds.push_back({peer.fd, POLLIN, 0});
+            ids.push_back(id);
+        }
+    if (poll(fds.data(), fds.size(), timeout_ms) <= 0)
+        return;
+    if (fds[0].revents)
+    {
+        int m = read(daemon_out, buf, sizeof(buf));
+        if (m > 0)
+        {
+            api_out_bytes += m;
+            daemon_output.insert(daemon_output.end(), buf, buf + m);
+            parse_output();
+        }
+        else if (m == 0)
+        {
+            close(daemon_out);
+            daemon_out = -1;
+        }
+    }
+    if (fds[1].revents)
+    {
+        int fd;
+        while ((fd = accept4(upstream_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        {
+            if (dialed.empty())
+            {
+                close(fd);
+                continue;
+            }
+            peers[dialed.front()].fd = fd;
+            dialed.pop_front();
+        }
+    }
+    for (size_t i = 2; i < fds.size(); i++)
+    {
+        if (!fds[i].revents)
+            continue;
+        Peer &peer = peers[ids[i - 2]];
+        int m = read(peer.fd, buf, sizeof(buf));
+        if (m > 0)
+        {
+            peer.received += m;
+            peer_received += m;
+        }
+        else if (m == 0 || errno != EAGAIN)
+        { // Closed by the daemon
+            close(peer.fd);
+            peer.fd = -1;
+        }
+    }
+}
+
+static void wait_for(bool *flag, bool value)
+{
+    long deadline = now_ns() + 1000000000l;
+    while (*flag != value)
+    {
+        if (now_ns() > deadline)
+        {
+            stalls++;
+            return;
+        }
+        pump(1);
+    }
+}
+
+// The connection an api frame refers to, -1 for none
+static int frame_target(const char *frame, size_t length)
+{
+    MagicType magic = frame[0];
+    MessageLengthType messageLength;
+    memcpy(&messageLength, frame + MAGIC_TYPE_SIZE, MESSAGE_LENGTH_TYPE_SIZE);
+    if (magic < MAX_CONNECTIONS)
+        return magic;
+    if (magic == Magic::ACCEPT_CONNECT || magic == Magic::DISCONNECT || magic == Magic::SET_WEIGHT)
+        return messageLength & 0xFF;
+    if ((magic == Magic::SET_FRAMING || magic == Magic::SUBSCRIBE || magic == Magic::UNSUBSCRIBE ||
+         magic == Magic::SET_CORK || magic == Magic::SET_COMPRESSION || magic == Magic::MULTIPLEX ||
+         magic == Magic::SESSION || magic == Magic::SET_PEER) &&
+        length > (size_t)PREFIX_SIZE)
+        return *(const unsigned char *)(frame + PREFIX_SIZE);
+    return -1;
+}
+
+static void write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t m = write(fd, data, length);
+        if (m < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                pump(1);
+                continue;
+            }
+            return;
+        }
+        data += m;
+        length -= m;
+    }
+}
+
+// Points CONNECT and CONNECT_MANY at the upstream listener, other frames pass unchanged
+static std::vector<char> rewrite_frame(const char *frame, size_t length, int upstream_port)
+{
+    MagicType magic = frame[0];
+    if (magic != Magic::CONNECT && magic != Magic::CONNECT_MANY)
+        return std::vector<char>(frame, frame + length);
+    std::string target = "127.0.0.1";
+    if (magic == Magic::CONNECT)
+    {
+        std::string address = fmt::format("{}:{}", target, upstream_port);
+        return make_buffer(Magic::CONNECT, address.data(), address.size());
+    }
+    std::vector<char> message;
+    const char *iter = frame + PREFIX_SIZE, *end = frame + length;
+    unsigned short port = upstream_port;
+    while (iter < end)
+    {
+        unsigned char hostLength = *iter;
+        iter += 1 + hostLength + sizeof(port);
+        message.push_back(target.size());
+        message.insert(message.end(), target.begin(), target.end());
+        message.insert(message.end(), (char *)&port, (char *)&port + sizeof(port));
+    }
+    return make_buffer(Magic::CONNECT_MANY, message.data(), message.size());
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-x speed] [-p port] capture daemon [daemon args...]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    int port = 18888;
+    int opt;
+    while ((opt = getopt(argc, argv, "+x:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2)
+        usage(argv[0]);
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    const char *data = (const char *)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    struct Event
+    {
+        Capture::RecordHeader header;
+        const char *payload;
+    };
+    std::vector<Event> events;
+    long captured[Capture::SOCKET_CLOSE + 1] = {0};
+    if (!capture_for_each(data, st.st_size, [&](const Capture::RecordHeader &header, const char *payload)
+                          {
+                              events.push_back({header, payload});
+                              if (header.kind <= Capture::SOCKET_CLOSE)
+                                  captured[header.kind] += header.length; }))
+        fprintf(stderr, "%s: truncated or not a capture, replaying %zu records\n", argv[optind], events.size());
+
+    signal(SIGPIPE, SIG_IGN);
+    upstream_fd = listen_local(0);
+    int upstream_port = local_port(upstream_fd);
+
+    // Daemon on its own port, stdin and stdout are ours
+    int in[2], out[2];
+    pipe2(in, O_CLOEXEC);
+    pipe2(out, O_CLOEXEC);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        std::vector<char *> args(argv + optind + 1, argv + argc);
+        std::string portText = std::to_string(port);
+        args.push_back(portText.data());
+        args.push_back(nullptr);
+        execv(args[0], args.data());
+        perror(args[0]);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    daemon_in = in[1];
+    daemon_out = out[0];
+    fcntl(daemon_out, F_SETFL, O_NONBLOCK);
+
+    // The daemon logs once it listens, the same log is part of the captured API_OUT
+    long deadline = now_ns() + 5000000000l;
+    while (api_out_bytes == 0)
+    {
+        if (now_ns() > deadline || daemon_out < 0)
+        {
+            fprintf(stderr, "daemon did not start\n");
+            kill(child, SIGTERM);
+            return 1;
+        }
+        pump(10);
+    }
+    fcntl(daemon_in, F_SETFL, O_NONBLOCK);
+
+    long start = now_ns(), late = 0;
+    for (const Event &event : events)
+    {
+        const Capture::RecordHeader &header = event.header;
+        if (speed > 0)
+        {
+            long due = start + (long)(header.ts_ns / speed);
+            long now;
+            // Sleep in poll while more than a millisecond is left, then spin
+            while ((now = now_ns()) < due)
+                pump((due - now) / 1000000);
+            if (now - due > 1000000)
+                late++;
+        }
+        else
+            pump(0);
+        switch (header.kind)
+        {
+        case Capture::API_IN:
+        {
+            int target = frame_target(event.payload, header.length);
+            if (target >= 0 && target < MAX_CONNECTIONS)
+                wait_for(&announced[target], true);
+            std::vector<char> frame = rewrite_frame(event.payload, header.length, upstream_port);
+            write_all(daemon_in, frame.data(), frame.size());
+            break;
+        }
+        case Capture::SOCKET_OPEN:
+            wait_for(&announced[header.conn], false);
+            peers[header.conn] = Peer{dial_local(port)};
+            break;
+        case Capture::SOCKET_DIAL:
+            peers[header.conn] = Peer{};
+            dialed.push_back(header.conn);
+            break;
+        case Capture::SOCKET_READ:
+        {
+            Peer &peer = peers[header.conn];
+            // An upstream connection may still be on its way
+            for (int i = 0; peer.fd < 0 && !dialed.empty() && i < 1000; i++)
+                pump(1);
+            if (peer.fd < 0)
+            {
+                lost_peers++;
+                break;
+            }
+            write_all(peer.fd, event.payload, header.length);
+            peer.written += header.length;
+            break;
+        }
+        case Capture::SOCKET_CLOSE:
+        {
+            auto it = peers.find(header.conn);
+            // Closes the daemon initiated need no help, a peer close or reset is played back
+            if (it != peers.end() && it->second.fd >= 0 && (event.payload[0] == PEER_CLOSED || event.payload[0] == SOCKET_ERROR))
+            {
+                if (event.payload[0] == SOCKET_ERROR)
+                {
+                    struct linger reset = {1, 0};
+                    setsockopt(it->second.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                }
+                close(it->second.fd);
+            }
+            if (it != peers.end())
+                peers.erase(it);
+            auto pending = std::find(dialed.begin(), dialed.end(), header.conn);
+            if (pending != dialed.end())
+                dialed.erase(pending);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    long replayed = now_ns() - start;
+
+    // Let the daemon finish what the last events started
+    long quiet = now_ns();
+    while (now_ns() - quiet < 200000000l)
+    {
+        long before = api_out_bytes + peer_received;
+        pump(20);
+        if (api_out_bytes + peer_received != before)
+            quiet = now_ns();
+    }
+    close(daemon_in);
+    while (waitpid(child, NULL, WNOHANG) == 0)
+        pump(20);
+
+    uint64_t span = events.empty() ? 0 : events.back().header.ts_ns;
+    printf("records        %zu\n", events.size());
+    printf("captured span  %.3f s\n", span / 1e9);
+    printf("replayed in    %.3f s (%ld events late by >1ms)\n", replayed / 1e9, late);
+    printf("api in         %ld bytes\n", captured[Capture::API_IN]);
+    printf("api out        %ld bytes captured, %ld bytes in %ld frames replayed\n", captured[Capture::API_OUT], api_out_bytes, api_out_frames);
+    printf("socket read    %ld bytes\n", captured[Capture::SOCKET_READ]);
+    printf("socket write   %ld bytes captured, %ld bytes replayed\n", captured[Capture::SOCKET_WRITE], peer_received);
+    if (stalls)
+        printf("               %ld waits for the daemon timed out\n", stalls);
+    if (lost_peers)
+        printf("               %ld reads had no peer\n", lost_peers);
+    return 0;
+}
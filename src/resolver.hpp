@@ -0,0 +1,127 @@
+#pragma once
+#include "loop.hpp"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/* ** Resolver **
+ *  Host names are resolved with getaddrinfo (so /etc/hosts works) on a dedicated thread
+ *  and cached for `ttl` ms, failures for `negative_ttl` ms. Numeric addresses never leave
+ *  the calling thread. Concurrent lookups of the same name share one getaddrinfo call,
+ *  which keeps a reconnect storm against one host at a single query.
+ */
+namespace Api
+{
+    class Resolver
+    {
+    public:
+        // ok == false means the name could not be resolved
+        using Callback = std::function<void(bool ok, struct in_addr addr)>;
+
+        uint64_t ttl = 60000;
+        uint64_t negative_ttl = 5000;
+
+        ~Resolver()
+        {
+            lock.lock();
+            stopped = true;
+            lock.unlock();
+            wake.notify_all();
+            if (worker.joinable())
+                worker.join();
+        }
+
+        void resolve(const std::string &host, Callback callback)
+        {
+            struct in_addr addr;
+            if (inet_pton(AF_INET, host.c_str(), &addr) == 1)
+                return callback(true, addr);
+
+            uint64_t now = Loop::now_ms();
+            std::unique_lock<std::mutex> guard(lock);
+            auto it = cache.find(host);
+            if (it != cache.end() && it->second.expires > now)
+            {
+                Entry entry = it->second;
+                guard.unlock();
+                return callback(entry.ok, entry.addr);
+            }
+            auto pending = waiters.find(host);
+            if (pending != waiters.end())
+            {
+                pending->second.push_back(std::move(callback));
+                return;
+            }
+            waiters[host].push_back(std::move(callback));
+            queue.push_back(host);
+            if (!worker.joinable())
+                worker = std::thread(&Resolver::run, this);
+            guard.unlock();
+            wake.notify_one();
+        }
+
+    private:
+        struct Entry
+        {
+            bool ok;
+            struct in_addr addr;
+            uint64_t expires;
+        };
+
+        std::unordered_map<std::string, Entry> cache;
+        std::unordered_map<std::string, std::vector<Callback>> waiters;
+        std::deque<std::string> queue;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::thread worker;
+        bool stopped = false;
+
+        void run()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (true)
+            {
+                wake.wait(guard, [this]
+                          { return stopped || !queue.empty(); });
+                if (stopped)
+                    return;
+                std::string host = queue.front();
+                queue.pop_front();
+                guard.unlock();
+
+                struct addrinfo hints, *result = nullptr;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_STREAM;
+                Entry entry = {false, {0}, 0};
+                if (getaddrinfo(host.c_str(), nullptr, &hints, &result) == 0 && result)
+                {
+                    entry.ok = true;
+                    entry.addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+                }
+                if (result)
+                    freeaddrinfo(result);
+                entry.expires = Loop::now_ms() + (entry.ok ? ttl : negative_ttl);
+
+                guard.lock();
+                cache[host] = entry;
+                std::vector<Callback> callbacks = std::move(waiters[host]);
+                waiters.erase(host);
+                guard.unlock();
+                for (Callback &callback : callbacks)
+                    callback(entry.ok, entry.addr);
+                guard.lock();
+            }
+        }
+    };
+}
@@ -0,0 +1,220 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <vector>
+#include <algorithm>
+
+/* ** Resumable sessions **
+ *  A connection switched to a session with SESSION outlives its socket. The byte stream on
+ *  the socket is a sequence of records
+ *     [u8 SessionType][u64 seq][u16 length][payload]
+ *  TOKEN      the daemon's first record, payload is the token that resumes the session
+ *  DATA       payload is the stream from offset seq on, a part the receiver has already is skipped
+ *  ACK        the receiver has taken every byte before seq
+ *  RESUME     the peer's first record on the resume port, payload is the token and seq the
+ *             offset of the daemon's stream it has
+ *  RESUMED    the daemon's answer, seq is the offset of the peer's stream it has. What the
+ *             peer is missing follows as DATA, the peer sends again from seq on
+ *
+ *  Both sides keep what they sent until it is acknowledged. The daemon acks after ACK_BYTES
+ *  or ACK_DELAY ms and keeps at most window unacknowledged bytes. A session that sends past
+ *  it can't resume until the peer caught up with an ack, its link going down closes it.
+ *  Loop thread only, one Session per connection holds both directions.
+ */
+namespace Api
+{
+    enum SessionType : uint8_t
+    {
+        SESSION_TOKEN,
+        SESSION_DATA,
+        SESSION_ACK,
+        SESSION_RESUME,
+        SESSION_RESUMED
+    };
+
+    class Session
+    {
+    public:
+        static constexpr size_t HEADER = 11;
+        static constexpr size_t TOKEN = 16;
+        static constexpr size_t MAX_RECORD = 0xFFFF;
+        static constexpr size_t ACK_BYTES = 16 << 10;
+        static constexpr int ACK_DELAY = 20;
+
+        uint8_t token[TOKEN];
+        size_t window;
+        // Set while the link is down and the peer may come back with the token
+        bool suspended = false;
+        // Set while more than window bytes are unacknowledged and nothing is kept
+        bool overrun = false;
+        uint64_t resumes = 0, resent = 0;
+
+        explicit Session(size_t window) : window(window)
+        {
+            if (getrandom(token, TOKEN, 0) != (ssize_t)TOKEN)
+            {
+                int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+                if (fd < 0 || read(fd, token, TOKEN) != (ssize_t)TOKEN)
+                    abort();
+                close(fd);
+            }
+        }
+
+        static void record(std::vector<char> &out, SessionType type, uint64_t seq, const char *payload, uint16_t length)
+        {
+            char header[HEADER];
+            header[0] = type;
+            memcpy(header + 1, &seq, sizeof(seq));
+            memcpy(header + 9, &length, sizeof(length));
+            out.insert(out.end(), header, header + HEADER);
+            out.insert(out.end(), payload, payload + length);
+        }
+
+        // The TOKEN record that starts the session
+        void hello(std::vector<char> &out) const { record(out, SESSION_TOKEN, 0, (const char *)token, TOKEN); }
+
+        // DATA records for buf, kept until the peer acks them
+        void wrap(const char *buf, size_t length, std::vector<char> &out)
+        {
+            for (size_t done = 0; done < length; done += MAX_RECORD)
+                record(out, SESSION_DATA, sent + done, buf + done, std::min(MAX_RECORD, length - done));
+            sent += length;
+            if (overrun)
+                return;
+            retained.insert(retained.end(), buf, buf + length);
+            if (retained.size() - head > window)
+            {
+                overrun = true;
+                std::vector<char>().swap(retained);
+                head = 0;
+            }
+        }
+
+        // Appends the new bytes of the peer's stream to plain, false on a protocol error
+        bool unwrap(const char *buf, size_t length, std::vector<char> &plain)
+        {
+            pending.insert(pending.end(), buf, buf + length);
+            size_t at = 0;
+            bool ok = true;
+            while (ok && pending.size() - at >= HEADER)
+            {
+                uint64_t seq;
+                uint16_t payloadLength;
+                memcpy(&seq, &pending[at + 1], sizeof(seq));
+                memcpy(&payloadLength, &pending[at + 9], sizeof(payloadLength));
+                if (pending.size() - at - HEADER < payloadLength)
+                    break;
+                ok = take((SessionType)pending[at], seq, &pending[at + HEADER], payloadLength, plain);
+                at += HEADER + payloadLength;
+            }
+            pending.erase(pending.begin(), pending.begin() + at);
+            return ok;
+        }
+
+        // Bytes of the peer's stream taken since the last ACK
+        uint64_t unacked() const { return received - ackedIn; }
+
+        void ack(std::vector<char> &out)
+        {
+            record(out, SESSION_ACK, received, nullptr, 0);
+            ackedIn = received;
+        }
+
+        // A complete RESUME record is HEADER + TOKEN bytes, false if buf isn't one
+        static bool parse_resume(const char *buf, uint64_t &peerHas)
+        {
+            uint16_t length;
+            memcpy(&peerHas, buf + 1, sizeof(peerHas));
+            memcpy(&length, buf + 9, sizeof(length));
+            return buf[0] == SESSION_RESUME && length == TOKEN;
+        }
+
+        // Compares all bytes, so the time taken says nothing about the token
+        bool matches(const char *other) const
+        {
+            uint8_t diff = 0;
+            for (size_t i = 0; i < TOKEN; i++)
+                diff |= token[i] ^ (uint8_t)other[i];
+            return diff == 0;
+        }
+
+        // The peer is back and has everything before peerHas. Writes RESUMED and the DATA it
+        // is missing, false if those bytes weren't kept
+        bool resume(uint64_t peerHas, std::vector<char> &out)
+        {
+            if (overrun || peerHas < acked || peerHas > sent)
+                return false;
+            release(peerHas);
+            // A record cut off by the old link comes again whole
+            pending.clear();
+            record(out, SESSION_RESUMED, received, nullptr, 0);
+            ackedIn = received;
+            size_t length = retained.size() - head;
+            for (size_t done = 0; done < length; done += MAX_RECORD)
+                record(out, SESSION_DATA, acked + done, retained.data() + head + done, std::min(MAX_RECORD, length - done));
+            resumes++;
+            resent += length;
+            return true;
+        }
+
+        // Bytes sent that the peer hasn't acked
+        uint64_t in_flight() const { return sent - acked; }
+
+    private:
+        // Offsets of the two streams: sent and acknowledged by the peer, received and acknowledged to it
+        uint64_t sent = 0, acked = 0, received = 0, ackedIn = 0;
+        // The bytes from acked to sent start at head, unless overrun
+        std::vector<char> retained;
+        size_t head = 0;
+        // The incomplete tail of the peer's stream
+        std::vector<char> pending;
+
+        bool take(SessionType type, uint64_t seq, const char *payload, uint16_t length, std::vector<char> &plain)
+        {
+            switch (type)
+            {
+            case SESSION_DATA:
+            {
+                if (seq > received)
+                    return false;
+                uint64_t skip = received - seq;
+                if (skip < length)
+                {
+                    plain.insert(plain.end(), payload + skip, payload + length);
+                    received += length - skip;
+                }
+                return true;
+            }
+            case SESSION_ACK:
+                if (seq < acked || seq > sent)
+                    return false;
+                release(seq);
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        void release(uint64_t upTo)
+        {
+            if (!overrun)
+            {
+                head += upTo - acked;
+                // Moves the rest to the front once the acked part is the larger one, so it is rare
+                if (head > retained.size() / 2)
+                {
+                    retained.erase(retained.begin(), retained.begin() + head);
+                    head = 0;
+                }
+            }
+            acked = upTo;
+            // Caught up, whatever is sent from here on can be kept again
+            if (overrun && acked == sent)
+                overrun = false;
+        }
+    };
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* ** Connection stats **
+ *  With --stats-interval the daemon sends a STATS frame every interval, the message is
+ *     [u64 daemon clock ms][StatsRecord]...
+ *  with a record for each connection that changed since the last frame, and a last one in
+ *  state CLOSED for each that went away. Counters are totals since the connection was made,
+ *  so a reader that missed a frame is only late, never wrong, and rates are the difference
+ *  of two totals over the difference of two clocks.
+ *  Shared by the daemon and the Gui, which draws them in its side panel.
+ */
+namespace Api
+{
+    const uint8_t STATS_MAGIC = 238;
+
+    enum ConnectionState : uint8_t
+    {
+        CONNECTING,
+        PRE_ACCEPT,
+        OPEN,
+        CLOSED
+    };
+
+#pragma pack(push, 1)
+    struct StatsRecord
+    {
+        uint8_t id;
+        uint8_t state;
+        uint16_t port;
+        // Network byte order, 0 for a connection without an ipv4 address yet
+        uint32_t ip;
+        uint64_t bytesIn, bytesOut;
+        // Bytes copied for the peer that it hasn't taken yet
+        uint32_t queued;
+        // Codec::Stats of a compressed connection, 0 without compression
+        uint64_t rawIn, wireIn, rawOut, wireOut;
+
+        bool operator==(const StatsRecord &other) const { return memcmp(this, &other, sizeof(StatsRecord)) == 0; }
+    };
+#pragma pack(pop)
+
+    const size_t STATS_HEADER = sizeof(uint64_t);
+}
@@ -0,0 +1,206 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+/* ** Hierarchical timer wheel **
+ *  LEVELS wheels of SLOTS slots each, every level is SLOTS times coarser than the one below.
+ *  With 1 ms ticks the wheel spans 2^24 ms (~4.6 hours), later deadlines are parked in the
+ *  last slot of the top level and re-armed when they get there.
+ *
+ *  Timers are intrusive list nodes, so arm and cancel are O(1) and never allocate.
+ *  A per level occupancy bitmap lets advance() skip empty slots, so an idle wheel costs
+ *  a couple of bit operations per SLOTS ticks no matter how many timers are armed.
+ *
+ *  Not thread safe, the wheel belongs to the thread that calls advance().
+ */
+namespace Api
+{
+    struct Timer
+    {
+        Timer *next = nullptr;
+        Timer *prev = nullptr;
+        uint64_t expires = 0;
+        std::function<void()> callback;
+
+        bool armed() const { return next != nullptr; }
+    };
+
+    class TimerWheel
+    {
+    public:
+        static const int LEVEL_BITS = 6;
+        static const int SLOTS = 1 << LEVEL_BITS;
+        static const int LEVELS = 4;
+        static const uint64_t SPAN = (uint64_t)1 << (LEVEL_BITS * LEVELS);
+
+        TimerWheel()
+        {
+            for (int l = 0; l < LEVELS; l++)
+            {
+                occupied[l] = 0;
+                for (int s = 0; s < SLOTS; s++)
+                    slots[l][s].next = slots[l][s].prev = &slots[l][s];
+            }
+        }
+
+        // Fires callback after `ticks` ticks, re-arming an armed timer moves it
+        void arm(Timer *timer, uint64_t ticks)
+        {
+            if (timer->armed())
+                unlink(timer);
+            timer->expires = now + ticks;
+            insert(timer);
+            count++;
+        }
+
+        void cancel(Timer *timer)
+        {
+            if (!timer->armed())
+                return;
+            unlink(timer);
+            count--;
+        }
+
+        // Runs every tick up to (excluding) `to`, returns the number of fired timers
+        size_t advance(uint64_t to)
+        {
+            size_t fired = 0;
+            while (now < to)
+            {
+                int idx = now & (SLOTS - 1);
+                if (idx != 0 && (occupied[0] >> idx) == 0)
+                { // Nothing left in this rotation of level 0, jump to the next cascade
+                    uint64_t boundary = (now | (SLOTS - 1)) + 1;
+                    now = boundary < to ? boundary : to;
+                    continue;
+                }
+                if (idx == 0)
+                    for (int l = 1; l < LEVELS && cascade(l) == 0; l++)
+                        ;
+                fired += expire(idx);
+                now++;
+            }
+            return fired;
+        }
+
+        // Ticks until the next slot that may fire, -1 if nothing is armed
+        int64_t next_timeout()
+        {
+            if (count == 0)
+                return -1;
+            int idx = now & (SLOTS - 1);
+            uint64_t ahead = occupied[0] >> idx;
+            if (ahead)
+                return __builtin_ctzll(ahead);
+            return SLOTS - idx;
+        }
+
+        uint64_t ticks() const { return now; }
+        size_t size() const { return count; }
+
+    private:
+        Timer slots[LEVELS][SLOTS];
+        uint64_t occupied[LEVELS];
+        uint64_t now = 0;
+        size_t count = 0;
+
+        void insert(Timer *timer)
+        {
+            uint64_t delta = timer->expires - now;
+            uint64_t expires = timer->expires;
+            int level = 0;
+            if (delta >= SPAN)
+            {
+                expires = now + SPAN - 1;
+                level = LEVELS - 1;
+            }
+            else
+                while (level < LEVELS - 1 && delta >= (uint64_t)1 << (LEVEL_BITS * (level + 1)))
+                    level++;
+            int idx = (expires >> (LEVEL_BITS * level)) & (SLOTS - 1);
+            Timer *head = &slots[level][idx];
+            timer->next = head;
+            timer->prev = head->prev;
+            head->prev->next = timer;
+            head->prev = timer;
+            occupied[level] |= (uint64_t)1 << idx;
+        }
+
+        void unlink(Timer *timer)
+        {
+            Timer *next = timer->next;
+            timer->prev->next = next;
+            next->prev = timer->prev;
+            timer->next = timer->prev = nullptr;
+            // An empty circular list points back at its head, clear the slot bit
+            if (next == next->next && next->prev == next)
+                clear_bit(next);
+        }
+
+        void clear_bit(Timer *head)
+        {
+            for (int l = 0; l < LEVELS; l++)
+                if (head >= slots[l] && head < slots[l] + SLOTS)
+                {
+                    occupied[l] &= ~((uint64_t)1 << (head - slots[l]));
+                    return;
+                }
+        }
+
+        // Detaches the slot list so callbacks can freely arm and cancel
+        Timer *take(int level, int idx, Timer *list)
+        {
+            Timer *head = &slots[level][idx];
+            if (head->next == head)
+                return nullptr;
+            list->next = head->next;
+            list->prev = head->prev;
+            list->next->prev = list;
+            list->prev->next = list;
+            head->next = head->prev = head;
+            occupied[level] &= ~((uint64_t)1 << idx);
+            return list;
+        }
+
+        // Moves the current slot of `level` down, returns the slot index
+        int cascade(int level)
+        {
+            int idx = (now >> (LEVEL_BITS * level)) & (SLOTS - 1);
+            Timer list;
+            if (take(level, idx, &list))
+                while (list.next != &list)
+                {
+                    Timer *timer = list.next;
+                    list.next = timer->next;
+                    timer->next->prev = &list;
+                    insert(timer);
+                }
+            return idx;
+        }
+
+        size_t expire(int idx)
+        {
+            Timer list;
+            size_t fired = 0;
+            if (!take(0, idx, &list))
+                return 0;
+            while (list.next != &list)
+            {
+                Timer *timer = list.next;
+                list.next = timer->next;
+                timer->next->prev = &list;
+                timer->next = timer->prev = nullptr;
+                if (timer->expires > now)
+                { // Was parked at the end of the wheel
+                    insert(timer);
+                    continue;
+                }
+                count--;
+                fired++;
+                timer->callback();
+            }
+            return fired;
+        }
+    };
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <bitset>
+#include <unordered_map>
+#include <functional>
+
+/* ** Topic index **
+ *  Subscriptions of connections to hierarchical topics, levels separated by '.'.
+ *  A pattern level '*' matches exactly one level, a last level '#' matches the rest of the
+ *  topic, including nothing. "metrics.*.cpu" matches "metrics.a.cpu", "metrics.#" matches
+ *  "metrics" and "metrics.a.cpu".
+ *
+ *  Patterns are stored in a trie of their levels, every node holds the set of connections
+ *  subscribed to the pattern ending there. Matching walks the topic's levels once, following
+ *  the exact child and the '*' child and collecting '#' children on the way, so its cost
+ *  depends on the depth of the topic, not on the number of subscriptions.
+ *  Loop thread only.
+ */
+namespace Api
+{
+    template <size_t IDS>
+    class TopicIndex
+    {
+    public:
+        using Set = std::bitset<IDS>;
+
+        void subscribe(int id, std::string_view pattern)
+        {
+            Node *node = &root;
+            for_each_level(pattern, [&](std::string_view level)
+                           {
+                               std::unique_ptr<Node> &child = node->children[std::string(level)];
+                               if (!child)
+                                   child = std::make_unique<Node>();
+                               node = child.get(); });
+            if (!node->subscribers[id])
+                patterns[id].push_back(std::string(pattern));
+            node->subscribers[id] = true;
+        }
+
+        void unsubscribe(int id, std::string_view pattern)
+        {
+            std::vector<std::string> &mine = patterns[id];
+            for (size_t i = 0; i < mine.size(); i++)
+                if (mine[i] == pattern)
+                {
+                    mine.erase(mine.begin() + i);
+                    remove(&root, pattern, id);
+                    return;
+                }
+        }
+
+        // Every subscription of id, when its connection goes away
+        void unsubscribe_all(int id)
+        {
+            for (std::string &pattern : patterns[id])
+                remove(&root, pattern, id);
+            patterns[id].clear();
+        }
+
+        const std::vector<std::string> &subscriptions(int id) const
+        {
+            static const std::vector<std::string> none;
+            auto it = patterns.find(id);
+            return it == patterns.end() ? none : it->second;
+        }
+
+        Set match(std::string_view topic) const
+        {
+            Set result;
+            std::vector<const Node *> frontier{&root}, next;
+            for_each_level(topic, [&](std::string_view level)
+                           {
+                               next.clear();
+                               for (const Node *node : frontier)
+                               {
+                                   collect_rest(node, result);
+                                   if (const Node *child = find(node, level))
+                                       next.push_back(child);
+                                   if (const Node *star = find(node, "*"))
+                                       next.push_back(star);
+                               }
+                               frontier.swap(next); });
+            for (const Node *node : frontier)
+            {
+                result |= node->subscribers;
+                collect_rest(node, result);
+            }
+            return result;
+        }
+
+    private:
+        // Levels are looked up as string_views of the topic, without a copy
+        struct LevelHash
+        {
+            using is_transparent = void;
+            size_t operator()(std::string_view level) const { return std::hash<std::string_view>{}(level); }
+        };
+
+        struct Node
+        {
+            std::unordered_map<std::string, std::unique_ptr<Node>, LevelHash, std::equal_to<>> children;
+            Set subscribers;
+        };
+
+        Node root;
+        std::unordered_map<int, std::vector<std::string>> patterns;
+
+        template <typename Func>
+        static void for_each_level(std::string_view text, Func func)
+        {
+            while (true)
+            {
+                size_t dot = text.find('.');
+                func(text.substr(0, dot));
+                if (dot == std::string_view::npos)
+                    return;
+                text.remove_prefix(dot + 1);
+            }
+        }
+
+        static const Node *find(const Node *node, std::string_view level)
+        {
+            auto it = node->children.find(level);
+            return it == node->children.end() ? nullptr : it->second.get();
+        }
+
+        static void collect_rest(const Node *node, Set &result)
+        {
+            if (const Node *rest = find(node, "#"))
+                result |= rest->subscribers;
+        }
+
+        // Clears id at the end of pattern and prunes the nodes left empty, true if node is empty
+        static bool remove(Node *node, std::string_view pattern, int id)
+        {
+            if (pattern.data() == nullptr)
+                node->subscribers[id] = false;
+            else
+            {
+                size_t dot = pattern.find('.');
+                auto it = node->children.find(pattern.substr(0, dot));
+                if (it == node->children.end())
+                    return false;
+                std::string_view rest = dot == std::string_view::npos ? std::string_view() : pattern.substr(dot + 1);
+                if (remove(it->second.get(), rest, id))
+                    node->children.erase(it);
+            }
+            return node->subscribers.none() && node->children.empty();
+        }
+    };
+}
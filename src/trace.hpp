@@ -0,0 +1,188 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+/* ** Message tracing **
+ *  With --trace PATH one message in `every` is followed through the daemon. Each stage it
+ *  passes records a span into a ring buffer of the thread it runs on, written without locks.
+ *  At exit the buffers are exported as Chrome trace JSON (chrome://tracing, ui.perfetto.dev),
+ *  the spans of one message are linked by flow arrows.
+ *
+ *     peer to controller   socket read, pre-accept buffer, framing, output queue, pipe write
+ *     controller to peer   api decode, id lookup, send
+ *
+ *  A sampled message carries its trace id, the stages of a call chain find it in traceCurrent.
+ *  Disabled or unsampled, a stage costs one branch on a zero id.
+ */
+namespace Api
+{
+    // The message the current thread is working on, 0 if it isn't sampled
+    inline thread_local uint64_t traceCurrent = 0;
+
+    class Tracer
+    {
+    public:
+        static const size_t EVENTS = 1 << 16;
+
+        struct Event
+        {
+            uint64_t start, end;
+            uint64_t id;
+            const char *name;
+            int conn;
+        };
+
+        bool enabled = false;
+        uint32_t every = 100;
+
+        static uint64_t now()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+
+        void open(const std::string &tracePath, uint32_t sampleEvery)
+        {
+            path = tracePath;
+            every = std::max<uint32_t>(sampleEvery, 1);
+            enabled = true;
+        }
+
+        // A trace id for one in `every` calls, 0 otherwise
+        uint64_t sample()
+        {
+            if (!enabled)
+                return 0;
+            thread_local uint32_t countdown = 1;
+            if (--countdown > 0)
+                return 0;
+            countdown = every;
+            return nextId.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void span(uint64_t id, const char *name, int conn, uint64_t start, uint64_t end = now())
+        {
+            Buffer &buffer = local();
+            size_t head = buffer.head.load(std::memory_order_relaxed);
+            buffer.events[head % EVENTS] = {start, end, id, name, conn};
+            buffer.head.store(head + 1, std::memory_order_release);
+        }
+
+        void name_thread(const char *name)
+        {
+            if (enabled)
+                local().name = name;
+        }
+
+        // Writes the trace, call once the other threads are done
+        bool write()
+        {
+            if (!enabled)
+                return false;
+            FILE *file = fopen(path.c_str(), "w");
+            if (!file)
+            {
+                perror("[Tracer] fopen");
+                return false;
+            }
+            struct Record
+            {
+                Event event;
+                int tid;
+            };
+            std::vector<Record> records;
+            fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+            buffersLock.lock();
+            for (size_t tid = 0; tid < buffers.size(); tid++)
+            {
+                Buffer &buffer = *buffers[tid];
+                size_t head = buffer.head.load(std::memory_order_acquire);
+                for (size_t i = head > EVENTS ? head - EVENTS : 0; i < head; i++)
+                    records.push_back({buffer.events[i % EVENTS], (int)tid});
+                fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}},\n", tid, buffer.name);
+            }
+            buffersLock.unlock();
+            // Flow arrows go from the first span of a message to the next, in time order
+            std::sort(records.begin(), records.end(), [](const Record &a, const Record &b)
+                      { return a.event.id != b.event.id ? a.event.id < b.event.id : a.event.start < b.event.start; });
+            for (size_t i = 0; i < records.size(); i++)
+            {
+                const Event &e = records[i].event;
+                double ts = (e.start - epoch) / 1000.0, dur = (e.end - e.start) / 1000.0;
+                fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"message\":%lu,\"conn\":%d}}",
+                        i ? ",\n" : "", e.name, ts, dur, records[i].tid, (unsigned long)e.id, e.conn);
+                bool first = i == 0 || records[i - 1].event.id != e.id;
+                bool last = i + 1 == records.size() || records[i + 1].event.id != e.id;
+                if (first && last)
+                    continue;
+                fprintf(file, ",\n{\"name\":\"message\",\"cat\":\"flow\",\"ph\":\"%s\",\"id\":%lu,\"ts\":%.3f,\"pid\":1,\"tid\":%d%s}",
+                        first ? "s" : last ? "f" : "t", (unsigned long)e.id, ts, records[i].tid, first ? "" : ",\"bp\":\"e\"");
+            }
+            fprintf(file, "\n]}\n");
+            fclose(file);
+            return true;
+        }
+
+    private:
+        struct Buffer
+        {
+            std::vector<Event> events = std::vector<Event>(EVENTS);
+            std::atomic<size_t> head{0};
+            const char *name = "thread";
+        };
+
+        std::string path;
+        std::atomic<uint64_t> nextId{1};
+        uint64_t epoch = now();
+        std::vector<std::unique_ptr<Buffer>> buffers;
+        std::mutex buffersLock;
+
+        // Registered once per thread, buffers live until exit so late spans stay valid
+        Buffer &local()
+        {
+            thread_local Buffer *buffer = nullptr;
+            if (!buffer)
+            {
+                buffersLock.lock();
+                buffers.push_back(std::make_unique<Buffer>());
+                buffer = buffers.back().get();
+                buffersLock.unlock();
+            }
+            return *buffer;
+        }
+    };
+
+    inline Tracer tracer;
+
+    // Records a span for the current message from construction to destruction
+    struct TraceSpan
+    {
+        const char *name;
+        int conn;
+        uint64_t id, start;
+
+        TraceSpan(const char *name, int conn, uint64_t id = traceCurrent) : name(name), conn(conn), id(id), start(id ? Tracer::now() : 0) {}
+        ~TraceSpan()
+        {
+            if (id)
+                tracer.span(id, name, conn, start);
+        }
+    };
+
+    // Makes id the current message of this thread for a scope
+    struct TraceScope
+    {
+        uint64_t saved;
+
+        TraceScope(uint64_t id) : saved(traceCurrent) { traceCurrent = id; }
+        ~TraceScope() { traceCurrent = saved; }
+    };
+}
@@ -0,0 +1,257 @@
+#pragma once
+#include "loop.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <functional>
+
+/* ** UDP transport **
+ *  One non-blocking datagram socket on the loop. Datagrams are read with recvmmsg, BATCH per
+ *  syscall, and written with sendmmsg from a queue that is flushed once per loop iteration.
+ *  Where the kernel has them, UDP_GRO hands over runs of equal sized datagrams as one buffer,
+ *  which is split again here, and UDP_SEGMENT sends runs of equal sized datagrams to the same
+ *  peer as one message.
+ */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace Api
+{
+    class UdpSocket
+    {
+    public:
+        static const int BATCH = 32;
+        static const size_t DATAGRAM = 65536;
+        static const int MAX_SEGMENTS = 64;
+
+        // Once per received datagram, data is valid during the call only
+        std::function<void(const struct sockaddr_in &from, const char *data, size_t length)> onDatagram;
+        // After every recvmmsg round
+        std::function<void()> onBatch;
+
+        bool gro = false, gso = false;
+        int fd = -1;
+
+        UdpSocket(Loop &loop) : loop(loop) {}
+        ~UdpSocket() { close(); }
+
+        // False if port can't be bound
+        bool open(int port)
+        {
+            int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port = htons(port);
+            if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            {
+                if (sock >= 0)
+                    ::close(sock);
+                return false;
+            }
+            adopt(sock);
+            return true;
+        }
+
+        // Serves an already bound socket, one inherited from another process
+        void adopt(int sock)
+        {
+            fd = sock;
+            int yes = 1, rcvbuf = 4 << 20;
+            // Bursts land in the kernel buffer while the loop is busy, capped by net.core.rmem_max
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            gro = setsockopt(fd, SOL_UDP, UDP_GRO, &yes, sizeof(yes)) == 0;
+            int segment = 0;
+            socklen_t len = sizeof(segment);
+            gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+
+            buffers.resize(BATCH * DATAGRAM);
+            watch.fd = fd;
+            watch.onEvents = [this](uint32_t events)
+            {
+                if (events & EPOLLOUT)
+                    flush();
+                if (events & EPOLLIN)
+                    receive();
+            };
+            loop.add(&watch, EPOLLIN);
+        }
+
+        int port()
+        {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            return getsockname(fd, (struct sockaddr *)&addr, &len) == 0 ? ntohs(addr.sin_port) : 0;
+        }
+
+        void close()
+        {
+            if (fd < 0)
+                return;
+            loop.remove(&watch);
+            ::close(fd);
+            fd = -1;
+        }
+
+        // Loop thread only, copies data, goes out with the next flush
+        void send(const struct sockaddr_in &to, const char *data, size_t length)
+        {
+            if (fd < 0)
+                return;
+            if (queue.empty() && !waiting)
+                loop.post([this]
+                          { flush(); });
+            queue.push_back({to, bytes.size(), length});
+            bytes.insert(bytes.end(), data, data + length);
+        }
+
+    private:
+        struct Pending
+        {
+            struct sockaddr_in to;
+            size_t offset, length;
+        };
+
+        Loop &loop;
+        Watch watch;
+        std::vector<char> buffers;
+        std::vector<Pending> queue;
+        std::vector<char> bytes;
+        size_t sent = 0;
+        // Send buffer full, flushed again on EPOLLOUT
+        bool waiting = false;
+
+        void receive()
+        {
+            struct mmsghdr msgs[BATCH];
+            struct iovec iovs[BATCH];
+            struct sockaddr_in from[BATCH];
+            char control[BATCH][CMSG_SPACE(sizeof(int))];
+            // Bounded number of rounds per wakeup so a flood can't starve the loop
+            for (int round = 0; round < 4; round++)
+            {
+                for (int i = 0; i < BATCH; i++)
+                {
+                    iovs[i] = {buffers.data() + i * DATAGRAM, DATAGRAM};
+                    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                    msgs[i].msg_hdr.msg_name = &from[i];
+                    msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_control = control[i];
+                    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+                }
+                int n = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+                if (n <= 0)
+                    return;
+                for (int i = 0; i < n; i++)
+                {
+                    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                        continue;
+                    const char *data = (const char *)iovs[i].iov_base;
+                    size_t length = msgs[i].msg_len;
+                    size_t segment = length;
+                    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+                        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                        {
+                            int size;
+                            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                            if (size > 0)
+                                segment = size;
+                        }
+                    // A coalesced buffer holds equal sized datagrams, only the last may be shorter
+                    for (size_t at = 0; at < length; at += segment)
+                        onDatagram(from[i], data + at, std::min(segment, length - at));
+                }
+                onBatch();
+                if (n < BATCH)
+                    return;
+            }
+        }
+
+        static bool same_peer(const struct sockaddr_in &a, const struct sockaddr_in &b)
+        {
+            return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+        }
+
+        void flush()
+        {
+            struct mmsghdr msgs[BATCH];
+            struct iovec iovs[BATCH * MAX_SEGMENTS];
+            char control[BATCH][CMSG_SPACE(sizeof(uint16_t))];
+            while (sent < queue.size())
+            {
+                int count = 0, iovCount = 0;
+                size_t i = sent;
+                while (i < queue.size() && count < BATCH)
+                {
+                    struct msghdr &hdr = msgs[count].msg_hdr;
+                    memset(&hdr, 0, sizeof(hdr));
+                    hdr.msg_name = &queue[i].to;
+                    hdr.msg_namelen = sizeof(queue[i].to);
+                    hdr.msg_iov = &iovs[iovCount];
+                    size_t segment = queue[i].length, total = 0;
+                    int segments = 0;
+                    // Equal sized datagrams to one peer ride in one message, a shorter one ends the run
+                    do
+                    {
+                        iovs[iovCount++] = {bytes.data() + queue[i].offset, queue[i].length};
+                        total += queue[i].length;
+                        segments++;
+                        i++;
+                    } while (gso && segment && i < queue.size() && segments < MAX_SEGMENTS && same_peer(queue[i].to, queue[i - 1].to) &&
+                             queue[i - 1].length == segment && queue[i].length <= segment && total + queue[i].length < DATAGRAM - 64);
+                    hdr.msg_iovlen = segments;
+                    if (segments > 1)
+                    {
+                        hdr.msg_control = control[count];
+                        hdr.msg_controllen = sizeof(control[count]);
+                        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+                        cmsg->cmsg_level = SOL_UDP;
+                        cmsg->cmsg_type = UDP_SEGMENT;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                        uint16_t size = segment;
+                        memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+                    }
+                    count++;
+                }
+                int n = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        if (!waiting)
+                            loop.modify(&watch, EPOLLIN | EPOLLOUT);
+                        waiting = true;
+                        return;
+                    }
+                    if (errno == EIO && gso)
+                    { // The device can't segment, send one datagram per message from now on
+                        gso = false;
+                        continue;
+                    }
+                    n = 1; // Datagrams are lossy anyway, drop the one the kernel refused
+                }
+                for (int m = 0; m < n; m++)
+                    sent += msgs[m].msg_hdr.msg_iovlen;
+            }
+            queue.clear();
+            bytes.clear();
+            sent = 0;
+            if (waiting)
+                loop.modify(&watch, EPOLLIN);
+            waiting = false;
+        }
+    };
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdio.h>
+
+/* ** Test checks **
+ *  CHECK(condition) reports a condition that doesn't hold with its line and carries on, a
+ *  test's main returns check_failures() so ctest fails it.
+ */
+inline int &check_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                          \
+    do                                                                            \
+    {                                                                             \
+        if (!(condition))                                                         \
+        {                                                                         \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            check_failures()++;                                                   \
+        }                                                                         \
+    } while (0)
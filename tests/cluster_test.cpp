@@ -0,0 +1,88 @@
+#include "check.hpp"
+#include "cluster.hpp"
+#include <string>
+
+using namespace Api;
+
+// A port nothing listens on right now
+static int free_port()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+// Two nodes on localhost in one loop: they link up, a record crosses, and a link the loop
+// didn't get to flush drops what is beyond its cap and reports it
+int main()
+{
+    Loop loop;
+    Resolver resolver;
+    Cluster a(loop, resolver), b(loop, resolver);
+    std::string nodes = "a=127.0.0.1:" + std::to_string(free_port()) + ",b=127.0.0.1:" + std::to_string(free_port());
+    CHECK(a.configure(nodes, "a"));
+    CHECK(b.configure(nodes, "b"));
+
+    const std::string frame(60000, 'x');
+    int linked = 0;
+    bool greeted = false;
+    size_t flooded = 0, expected = 0, received = 0;
+    uint64_t fullReports = 0, dropped = 0;
+    a.onLink = b.onLink = [&](int, bool up)
+    {
+        if (up && ++linked == 2)
+            a.send(1, Cluster::COMMANDS, "hello", 5);
+    };
+    a.onRecord = [](int, Cluster::Kind, const char *, size_t) {};
+    b.onRecord = [&](int from, Cluster::Kind kind, const char *frames, size_t length)
+    {
+        CHECK(from == 0);
+        CHECK(kind == (greeted ? Cluster::EVENTS : Cluster::COMMANDS));
+        if (!greeted)
+        {
+            greeted = true;
+            CHECK(std::string(frames, length) == "hello");
+            // Nothing is flushed before this returns, the link fills up
+            for (size_t i = 0; i < Cluster::MAX_LINK_BYTES / frame.size() + 100; i++, flooded++)
+                if (a.send(1, Cluster::EVENTS, frame.data(), frame.size()))
+                    expected += frame.size();
+            return;
+        }
+        received += length;
+        if (received >= expected)
+            loop.stop();
+    };
+    a.onFull = [&](int node, bool full, uint64_t count)
+    {
+        CHECK(node == 1);
+        if (full)
+            fullReports++;
+        else
+            dropped = count;
+    };
+    b.onFull = [](int, bool, uint64_t) {};
+
+    Timer timeout;
+    timeout.callback = [&loop]
+    { loop.stop(); };
+    loop.arm(&timeout, 10000);
+    CHECK(a.start());
+    CHECK(b.start());
+    loop.run();
+
+    CHECK(linked == 2);
+    CHECK(a.up(1) && b.up(0));
+    CHECK(greeted);
+    CHECK(expected > 0 && expected <= Cluster::MAX_LINK_BYTES);
+    CHECK(received == expected);
+    CHECK(fullReports == 1);
+    CHECK(dropped > 0 && dropped == flooded - expected / frame.size());
+    return check_failures();
+}
@@ -0,0 +1,88 @@
+#include "check.hpp"
+#include "compress.hpp"
+#include <string>
+
+using namespace Api;
+
+static uint64_t seed = 88172645463325252ull;
+
+static uint64_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static std::string random_bytes(size_t length)
+{
+    std::string bytes(length, 0);
+    for (char &c : bytes)
+        c = next_random();
+    return bytes;
+}
+
+// Encodes every message on its own and decodes the stream in pieces of step bytes
+static bool round_trip(const std::vector<std::string> &messages, size_t step, size_t *wireBytes = nullptr)
+{
+    Codec sender, receiver;
+    std::string plain, wire;
+    for (const std::string &message : messages)
+    {
+        std::vector<char> encoded = sender.encode(message.data(), message.size());
+        wire.append(encoded.begin(), encoded.end());
+        plain += message;
+    }
+    std::vector<char> decoded;
+    for (size_t at = 0; at < wire.size(); at += step)
+        if (!receiver.decode(wire.data() + at, std::min(step, wire.size() - at), decoded))
+            return false;
+    if (wireBytes)
+        *wireBytes = wire.size();
+    return std::string(decoded.begin(), decoded.end()) == plain && receiver.stats.rawIn == plain.size() &&
+           sender.stats.wireOut == wire.size();
+}
+
+int main()
+{
+    // Small messages of a chatty protocol compress against the ones before them
+    std::vector<std::string> chatty;
+    for (int i = 0; i < 2000; i++)
+        chatty.push_back("{\"type\":\"quote\",\"symbol\":\"ABC\",\"seq\":" + std::to_string(i) + "}\n");
+    size_t plain = 0, wire = 0;
+    for (const std::string &message : chatty)
+        plain += message.size();
+    for (size_t step : {1, 3, 1000, 1 << 20})
+        CHECK(round_trip(chatty, step, &wire));
+    CHECK(wire < plain / 2);
+
+    // Incompressible bytes go out stored and cost only the block headers
+    std::vector<std::string> noise{random_bytes(10 * Codec::BLOCK + 123)};
+    CHECK(round_trip(noise, 4096, &wire));
+    CHECK(wire <= noise[0].size() + 11 * Codec::HEADER);
+
+    // Empty messages, single bytes, runs longer than a block and repeats beyond the window
+    std::string block = random_bytes(Codec::BLOCK);
+    std::vector<std::string> edges{"", "a", "", std::string(3 * Codec::BLOCK + 1, 'z'), block,
+                                   random_bytes(Codec::WINDOW), block, "abcabcabcabcabcabc"};
+    for (size_t step : {1, 7, 1 << 20})
+        CHECK(round_trip(edges, step));
+
+    // Streams that break the format are rejected
+    Codec codec;
+    std::vector<char> out;
+    std::vector<char> encoded = Codec().encode("hello hello hello hello", 23);
+    encoded[0] = 7;
+    CHECK(!codec.decode(encoded.data(), encoded.size(), out));
+    const char storedTooShort[] = {STORED, 4, 0, 3, 0, 'a', 'b', 'c'};
+    CHECK(!Codec().decode(storedTooShort, sizeof(storedTooShort), out));
+    // A match reaching back before the stream started
+    const char matchTooFar[] = {LZ, 5, 0, 3, 0, 0x10, 'a', 9, 0};
+    CHECK(!Codec().decode(matchTooFar, sizeof(matchTooFar), out));
+    // A block that promises more than it holds waits for the rest
+    const char incomplete[] = {STORED, 4, 0, 4, 0, 'a'};
+    Codec waiting;
+    CHECK(waiting.decode(incomplete, sizeof(incomplete), out));
+    CHECK(out.empty());
+    return check_failures();
+}
@@ -0,0 +1,83 @@
+#include "check.hpp"
+#include "framing.hpp"
+#include <string>
+
+using namespace Api;
+
+static const uint32_t MAX = 64;
+
+// Feeds input in pieces of step bytes, the messages are joined with '|'
+static std::string frame(Framer &framer, const std::string &input, size_t step, bool *ok = nullptr)
+{
+    std::string out;
+    bool good = true;
+    for (size_t at = 0; at < input.size() && good; at += step)
+        good = framer.feed(input.data() + at, std::min(step, input.size() - at), MAX, [&out](const char *message, size_t length)
+                           { out.append(message, length).push_back('|'); });
+    if (ok)
+        *ok = good;
+    return out;
+}
+
+static std::string u16(const std::string &message)
+{
+    uint16_t n = htons(message.size());
+    return std::string((const char *)&n, 2) + message;
+}
+
+static std::string u32(const std::string &message)
+{
+    uint32_t n = htonl(message.size());
+    return std::string((const char *)&n, 4) + message;
+}
+
+int main()
+{
+    // Every mode gives the same messages however the stream is cut
+    for (size_t step : {1, 2, 3, 7, 100})
+    {
+        Framer newline(NEWLINE, 0);
+        CHECK(frame(newline, "one\ntwo\n\nthree\nfo", step) == "one|two||three|");
+        CHECK(newline.buffered() == 2);
+        CHECK(frame(newline, "ur\n", step) == "four|");
+        CHECK(newline.buffered() == 0);
+
+        Framer prefix16(LENGTH_U16, 0);
+        CHECK(frame(prefix16, u16("a") + u16("") + u16("hello") + u16("tail").substr(0, 3), step) == "a||hello|");
+        CHECK(frame(prefix16, u16("tail").substr(3), step) == "tail|");
+
+        Framer prefix32(LENGTH_U32, 0);
+        CHECK(frame(prefix32, u32("abc") + u32(std::string(MAX, 'x')), step) == "abc|" + std::string(MAX, 'x') + "|");
+
+        Framer fixed(FIXED, 3);
+        CHECK(frame(fixed, "abcdefgh", step) == "abc|def|");
+        CHECK(frame(fixed, "i", step) == "ghi|");
+    }
+
+    // RAW hands every read on as it is
+    Framer raw;
+    CHECK(frame(raw, "ab\ncd", 3) == "ab\n|cd|");
+
+    // A message longer than MAX is an error, whether it arrives whole or in pieces
+    bool ok = true;
+    Framer tooLong(LENGTH_U16, 0);
+    frame(tooLong, u16(std::string(MAX + 1, 'x')), 100, &ok);
+    CHECK(!ok);
+    Framer tooLongSplit(LENGTH_U32, 0);
+    frame(tooLongSplit, u32(std::string(MAX + 1, 'x')), 1, &ok);
+    CHECK(!ok);
+    Framer noNewline(NEWLINE, 0);
+    frame(noNewline, std::string(2 * MAX, 'x'), 8, &ok);
+    CHECK(!ok);
+    Framer zero(FIXED, 0);
+    frame(zero, "abc", 1, &ok);
+    CHECK(!ok);
+
+    // A handed over tail continues where it stopped
+    Framer before(NEWLINE, 0);
+    frame(before, "first\nsec", 100);
+    Framer after(NEWLINE, 0);
+    after.restore(before.buffered_bytes().data(), before.buffered());
+    CHECK(frame(after, "ond\n", 100) == "second|");
+    return check_failures();
+}
@@ -0,0 +1,42 @@
+#include "check.hpp"
+#include "histogram.hpp"
+
+// The highest value in the bucket of value, as percentile reports it
+static uint64_t bucket_top(uint64_t value)
+{
+    Histogram histogram;
+    histogram.record(value);
+    histogram.record(UINT64_MAX);
+    return histogram.percentile(50);
+}
+
+int main()
+{
+    // Exact below LINEAR, within 1% above it, and never below the value
+    for (uint64_t value = 0; value < Histogram::LINEAR; value++)
+        CHECK(bucket_top(value) == value);
+    uint64_t previous = 0;
+    for (uint64_t value = Histogram::LINEAR; value < (1ull << 62); value += value / 97 + 1)
+    {
+        uint64_t top = bucket_top(value);
+        CHECK(top >= value);
+        CHECK(top - value <= value / 100);
+        CHECK(top >= previous);
+        previous = top;
+    }
+    // The last buckets still hold the largest values
+    CHECK(bucket_top(UINT64_MAX - 1) == UINT64_MAX);
+
+    Histogram a, b;
+    for (uint64_t value = 1; value <= 100; value++)
+        (value % 2 ? a : b).record(value);
+    a.add(b);
+    CHECK(a.count() == 100);
+    CHECK(a.max() == 100);
+    CHECK(a.mean() == 50.5);
+    CHECK(a.percentile(50) == 50);
+    CHECK(a.percentile(99) == 99);
+    CHECK(a.percentile(100) == 100);
+    CHECK(Histogram().percentile(50) == 0);
+    return check_failures();
+}
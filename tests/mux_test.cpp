@@ -0,0 +1,75 @@
+#include "check.hpp"
+#include "mux.hpp"
+#include <string>
+
+using namespace Api;
+
+struct Frame
+{
+    MuxType type;
+    uint16_t channel;
+    std::string payload;
+};
+
+// Feeds wire in pieces of step bytes
+static std::vector<Frame> parse(Mux &mux, const std::vector<char> &wire, size_t step)
+{
+    std::vector<Frame> frames;
+    for (size_t at = 0; at < wire.size(); at += step)
+        mux.feed(wire.data() + at, std::min(step, wire.size() - at), [&frames](MuxType type, uint16_t channel, const char *payload, uint16_t length)
+                 {
+                     frames.push_back({type, channel, std::string(payload, length)});
+                     return true; });
+    return frames;
+}
+
+int main()
+{
+    std::vector<char> wire;
+    Mux::frame(wire, MUX_OPEN, 3, nullptr, 0);
+    Mux::frame(wire, MUX_DATA, 3, "hello", 5);
+    Mux::window(wire, 3, 1234);
+    Mux::frame(wire, MUX_DATA, 0, "", 0);
+    std::string big(0xFFFF, 'x');
+    Mux::frame(wire, MUX_DATA, 0xFFFF, big.data(), big.size());
+    Mux::frame(wire, MUX_CLOSE, 3, nullptr, 0);
+
+    // A frame split anywhere, even inside its header, comes out whole and in order
+    for (size_t step : {1, 2, 4, 5, 6, 1000, 1 << 20})
+    {
+        Mux mux;
+        std::vector<Frame> frames = parse(mux, wire, step);
+        CHECK(frames.size() == 6);
+        if (frames.size() != 6)
+            continue;
+        CHECK(frames[0].type == MUX_OPEN && frames[0].channel == 3 && frames[0].payload.empty());
+        CHECK(frames[1].type == MUX_DATA && frames[1].payload == "hello");
+        uint32_t increment = 0;
+        CHECK(frames[2].type == MUX_WINDOW && frames[2].payload.size() == sizeof(increment));
+        memcpy(&increment, frames[2].payload.data(), std::min(sizeof(increment), frames[2].payload.size()));
+        CHECK(increment == 1234);
+        CHECK(frames[3].channel == 0 && frames[3].payload.empty());
+        CHECK(frames[4].channel == 0xFFFF && frames[4].payload == big);
+        CHECK(frames[5].type == MUX_CLOSE && frames[5].channel == 3);
+    }
+
+    // Parsing stops at the frame the callback refuses, the rest stays unread
+    Mux refusing;
+    int calls = 0;
+    CHECK(!refusing.feed(wire.data(), wire.size(), [&calls](MuxType, uint16_t, const char *, uint16_t)
+                         { return ++calls < 2; }));
+    CHECK(calls == 2);
+
+    // Even numbers, skipping the taken ones and wrapping before 0
+    Mux numbers;
+    CHECK(numbers.allocate() == 2);
+    numbers.channels[4] = 1;
+    CHECK(numbers.allocate() == 6);
+    numbers.nextChannel = 0xFFFE;
+    CHECK(numbers.allocate() == 0xFFFE);
+    CHECK(numbers.allocate() == 2);
+    for (uint16_t channel = 2; channel != 0; channel += 2)
+        numbers.channels[channel] = 1;
+    CHECK(numbers.allocate() == 0);
+    return check_failures();
+}
@@ -0,0 +1,141 @@
+#include "check.hpp"
+#include "session.hpp"
+#include <string>
+
+using namespace Api;
+
+struct Record
+{
+    SessionType type;
+    uint64_t seq;
+    std::string payload;
+};
+
+static std::vector<Record> records(const std::vector<char> &wire)
+{
+    std::vector<Record> out;
+    for (size_t at = 0; at + Session::HEADER <= wire.size();)
+    {
+        Record record;
+        uint16_t length;
+        record.type = (SessionType)wire[at];
+        memcpy(&record.seq, &wire[at + 1], sizeof(record.seq));
+        memcpy(&length, &wire[at + 9], sizeof(length));
+        record.payload.assign(&wire[at + Session::HEADER], length);
+        out.push_back(record);
+        at += Session::HEADER + length;
+    }
+    return out;
+}
+
+// Unwraps wire in pieces of step bytes
+static bool unwrap(Session &session, const std::vector<char> &wire, size_t step, std::string &plain)
+{
+    std::vector<char> out;
+    for (size_t at = 0; at < wire.size(); at += step)
+        if (!session.unwrap(wire.data() + at, std::min(step, wire.size() - at), out))
+            return false;
+    plain.append(out.begin(), out.end());
+    return true;
+}
+
+int main()
+{
+    // Both directions use the same records, so two sessions talk to each other
+    for (size_t step : {1, 5, 11, 1 << 20})
+    {
+        Session daemon(1 << 20), peer(1 << 20);
+        std::vector<char> wire;
+        daemon.wrap("hello ", 6, wire);
+        daemon.wrap("world", 5, wire);
+        std::string plain;
+        CHECK(unwrap(peer, wire, step, plain));
+        CHECK(plain == "hello world");
+        CHECK(peer.unacked() == 11);
+        CHECK(daemon.in_flight() == 11);
+
+        std::vector<char> ack;
+        peer.ack(ack);
+        CHECK(peer.unacked() == 0);
+        std::string none;
+        CHECK(unwrap(daemon, ack, step, none));
+        CHECK(none.empty());
+        CHECK(daemon.in_flight() == 0);
+    }
+
+    // More than MAX_RECORD bytes go out as several records
+    Session big(1 << 20), bigPeer(1 << 20);
+    std::string bytes(Session::MAX_RECORD + 10, 'b');
+    std::vector<char> wire;
+    big.wrap(bytes.data(), bytes.size(), wire);
+    std::vector<Record> split = records(wire);
+    CHECK(split.size() == 2 && split[1].seq == Session::MAX_RECORD && split[1].payload.size() == 10);
+    std::string plain;
+    CHECK(unwrap(bigPeer, wire, 1000, plain) && plain == bytes);
+
+    // A record sent again after a reconnect only adds what is new, a gap is an error
+    Session receiver(1 << 20);
+    std::vector<char> first, again, gap;
+    Session::record(first, SESSION_DATA, 0, "abcd", 4);
+    Session::record(again, SESSION_DATA, 2, "cdef", 4);
+    Session::record(gap, SESSION_DATA, 10, "x", 1);
+    plain.clear();
+    CHECK(unwrap(receiver, first, 3, plain) && unwrap(receiver, again, 3, plain) && unwrap(receiver, first, 3, plain));
+    CHECK(plain == "abcdef");
+    CHECK(!unwrap(receiver, gap, 100, plain));
+
+    // An ack of bytes never sent is an error
+    Session acked(1 << 20);
+    std::vector<char> data, badAck;
+    acked.wrap("12345", 5, data);
+    Session::record(badAck, SESSION_ACK, 6, nullptr, 0);
+    CHECK(!unwrap(acked, badAck, 100, plain));
+
+    // Resuming sends RESUMED and what the peer is missing, from what it says it has
+    Session resumed(1 << 20);
+    std::vector<char> sent, resumeWire, peerData, ackWire;
+    resumed.wrap("0123456789", 10, sent);
+    Session::record(ackWire, SESSION_ACK, 4, nullptr, 0);
+    Session::record(peerData, SESSION_DATA, 0, "xyz", 3);
+    plain.clear();
+    CHECK(unwrap(resumed, ackWire, 100, plain) && unwrap(resumed, peerData, 100, plain) && plain == "xyz");
+    CHECK(!resumed.resume(3, resumeWire));
+    CHECK(!resumed.resume(11, resumeWire));
+    CHECK(resumed.resume(6, resumeWire));
+    std::vector<Record> answer = records(resumeWire);
+    CHECK(answer.size() == 2);
+    if (answer.size() == 2)
+    {
+        CHECK(answer[0].type == SESSION_RESUMED && answer[0].seq == 3);
+        CHECK(answer[1].type == SESSION_DATA && answer[1].seq == 6 && answer[1].payload == "6789");
+    }
+    CHECK(resumed.resumes == 1 && resumed.resent == 4);
+
+    // Past the window nothing is kept and the session can't resume until the peer caught up
+    Session small(8);
+    std::vector<char> out;
+    small.wrap("0123456789", 10, out);
+    CHECK(small.overrun);
+    CHECK(!small.resume(0, out));
+    std::vector<char> caughtUp;
+    Session::record(caughtUp, SESSION_ACK, 10, nullptr, 0);
+    CHECK(unwrap(small, caughtUp, 100, plain));
+    CHECK(!small.overrun);
+    out.clear();
+    CHECK(small.resume(10, out));
+
+    // The token resumes only its own session
+    Session owner(1 << 20), other(1 << 20);
+    std::vector<char> hello, resume;
+    owner.hello(hello);
+    std::vector<Record> token = records(hello);
+    CHECK(token.size() == 1 && token[0].type == SESSION_TOKEN && token[0].payload.size() == Session::TOKEN);
+    Session::record(resume, SESSION_RESUME, 42, token[0].payload.data(), token[0].payload.size());
+    uint64_t peerHas = 0;
+    CHECK(resume.size() == Session::HEADER + Session::TOKEN);
+    CHECK(Session::parse_resume(resume.data(), peerHas) && peerHas == 42);
+    CHECK(owner.matches(resume.data() + Session::HEADER));
+    CHECK(!other.matches(resume.data() + Session::HEADER));
+    CHECK(!Session::parse_resume(hello.data(), peerHas));
+    return check_failures();
+}
@@ -0,0 +1,58 @@
+#include "check.hpp"
+#include "topics.hpp"
+
+using namespace Api;
+
+using Index = TopicIndex<8>;
+
+static Index::Set ids(std::initializer_list<int> list)
+{
+    Index::Set set;
+    for (int id : list)
+        set[id] = true;
+    return set;
+}
+
+int main()
+{
+    Index topics;
+    topics.subscribe(0, "metrics.a.cpu");
+    topics.subscribe(1, "metrics.*.cpu");
+    topics.subscribe(2, "metrics.#");
+    topics.subscribe(3, "#");
+    topics.subscribe(4, "*");
+
+    CHECK(topics.match("metrics.a.cpu") == ids({0, 1, 2, 3}));
+    CHECK(topics.match("metrics.b.cpu") == ids({1, 2, 3}));
+    // '#' matches nothing as well, '*' exactly one level
+    CHECK(topics.match("metrics") == ids({2, 3, 4}));
+    CHECK(topics.match("metrics.a") == ids({2, 3}));
+    CHECK(topics.match("metrics.a.cpu.x") == ids({2, 3}));
+    CHECK(topics.match("other") == ids({3, 4}));
+    CHECK(topics.match("") == ids({3, 4}));
+
+    // A pattern counts once per id, and unsubscribing it leaves the id's other patterns
+    topics.subscribe(1, "metrics.*.cpu");
+    topics.subscribe(1, "logs");
+    CHECK(topics.subscriptions(1).size() == 2);
+    topics.unsubscribe(1, "metrics.*.cpu");
+    CHECK(topics.match("metrics.b.cpu") == ids({2, 3}));
+    CHECK(topics.match("logs") == ids({1, 3, 4}));
+    // Unknown patterns are ignored
+    topics.unsubscribe(1, "metrics.*.cpu");
+    topics.unsubscribe(5, "logs");
+    CHECK(topics.match("logs") == ids({1, 3, 4}));
+
+    // A pruned branch can be subscribed again
+    topics.unsubscribe(0, "metrics.a.cpu");
+    CHECK(topics.match("metrics.a.cpu") == ids({2, 3}));
+    topics.subscribe(5, "metrics.a.cpu");
+    CHECK(topics.match("metrics.a.cpu") == ids({2, 3, 5}));
+
+    for (int id = 0; id < 8; id++)
+        topics.unsubscribe_all(id);
+    CHECK(topics.match("metrics.a.cpu").none());
+    CHECK(topics.match("logs").none());
+    CHECK(topics.subscriptions(1).empty());
+    return check_failures();
+}